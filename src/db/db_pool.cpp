@@ -1,5 +1,7 @@
 
 #include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
 
 #include <db/db_pool.h>
 
@@ -9,6 +11,490 @@ pthread_mutex_t DBPool::startup_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t DBPool::maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
 volatile bool DBPool::maintenance_thread_running = false;
 volatile bool DBPool::maintenance_thread_exiting = false;
+volatile unsigned DBPool::num_threads = 0;
+
+/*
+ * Index of the calling thread plus one, zero if not assigned yet
+ */
+static __thread unsigned pool_thread_index = 0;
+
+DBConn::~DBConn()
+{
+	for(StmtList::iterator i = m_stmts.begin() ; i != m_stmts.end() ; i++) {
+		delete *i;
+	}
+
+	mysql_close(&m_handler);
+    LogSQL("connection closed");
+}
+
+DBPreparedStmt *DBConn::acquire_stmt(const std::string &sql)
+{
+	StmtIndex::iterator i = m_stmt_index.find(sql);
+
+	if(i != m_stmt_index.end() && !(*i->second)->m_in_use) {
+		DBPreparedStmt *stmt = *i->second;
+
+		m_stmts.splice(m_stmts.begin(), m_stmts, i->second);
+
+		stmt->m_in_use = true;
+
+		return stmt;
+	}
+
+	std::auto_ptr<DBPreparedStmt> stmt(new DBPreparedStmt(&m_handler, sql));
+
+	stmt->m_in_use = true;
+
+	/*
+	 * Statement that is in use already gets a private copy
+	 */
+	if(i != m_stmt_index.end()) {
+		return stmt.release();
+	}
+
+	/*
+	 * Close least recently used statements that are idle
+	 */
+	StmtList::iterator victim = m_stmts.end();
+
+	while(m_stmts.size() >= m_max_stmts && victim != m_stmts.begin()) {
+		victim--;
+
+		if(!(*victim)->m_in_use) {
+			m_stmt_index.erase((*victim)->m_sql);
+			delete *victim;
+			victim = m_stmts.erase(victim);
+		}
+	}
+
+	if(m_stmts.size() < m_max_stmts) {
+		m_stmts.push_front(stmt.get());
+		m_stmt_index.insert(std::make_pair(sql, m_stmts.begin()));
+		stmt->m_cached = true;
+	}
+
+	return stmt.release();
+}
+
+void DBConn::release_stmt(DBPreparedStmt *stmt, bool failed)
+{
+	if(!stmt->m_cached) {
+		delete stmt;
+		return;
+	}
+
+	if(failed) {
+		StmtIndex::iterator i = m_stmt_index.find(stmt->m_sql);
+
+		m_stmts.erase(i->second);
+		m_stmt_index.erase(i);
+
+		delete stmt;
+		return;
+	}
+
+	stmt->m_in_use = false;
+}
+
+DBPool::DBPool(const DBCred &cred, size_t _min_connections, size_t _max_connections)
+    : m_waiters()
+    , m_num_waiting(0)
+    , m_cred(cred)
+    , m_all_connections()
+    , m_min_connections(_min_connections)
+    , m_max_connections(_max_connections)
+    , m_num_connections(0)
+    , m_acquire_timeout(DB_POOL_ACQUIRE_TIMEOUT)
+{
+    for(unsigned i = 0 ; i != DB_POOL_SLOTS ; i++) {
+        m_slots[i].conn = 0;
+    }
+
+    for(unsigned i = 0 ; i != DB_POOL_SHARDS ; i++) {
+        pthread_mutex_init(&m_shards[i].lock, NULL);
+    }
+
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_mutex_init(&m_wait_lock, NULL);
+}
+
+DBPool::~DBPool()
+{
+    for(std::list<DBConn*>::const_iterator i = m_all_connections.begin() ; i != m_all_connections.end() ; i++) {
+        delete *i;
+    }
+
+    for(unsigned i = 0 ; i != DB_POOL_SHARDS ; i++) {
+        pthread_mutex_destroy(&m_shards[i].lock);
+    }
+
+    pthread_mutex_destroy(&m_lock);
+    pthread_mutex_destroy(&m_wait_lock);
+}
+
+unsigned DBPool::thread_index()
+{
+    if(pool_thread_index == 0) {
+        pool_thread_index = __sync_add_and_fetch(&num_threads, 1);
+    }
+
+    return pool_thread_index - 1;
+}
+
+/*
+ * Open new connection if the pool is below its limit. Room is reserved
+ * first, so that no lock is held while connecting
+ */
+DBConn *DBPool::grow()
+{
+    for(;;) {
+        size_t num_connections = m_num_connections;
+
+        if(num_connections >= m_max_connections) {
+            return 0;
+        }
+
+        if(__sync_bool_compare_and_swap(&m_num_connections, num_connections, num_connections + 1)) {
+            break;
+        }
+    }
+
+    DBConn *conn;
+
+    try {
+        conn = new DBConn(m_cred);
+    }
+    catch(...) {
+        __sync_sub_and_fetch(&m_num_connections, 1);
+        throw;
+    }
+
+    pthread_mutex_lock(&m_lock);
+    m_all_connections.push_back(conn);
+    pthread_mutex_unlock(&m_lock);
+
+    LogSQL("grow connection " << conn);
+
+    return conn;
+}
+
+void DBPool::shrink(DBConn *conn)
+{
+    pthread_mutex_lock(&m_lock);
+    m_all_connections.remove(conn);
+    pthread_mutex_unlock(&m_lock);
+
+    __sync_sub_and_fetch(&m_num_connections, 1);
+
+    LogSQL("shrink connection " << conn);
+
+    delete conn;
+}
+
+/*
+ * Take connection from the free list, own shard first
+ */
+DBConn *DBPool::take_shared(unsigned me)
+{
+    for(unsigned i = 0 ; i != DB_POOL_SHARDS ; i++) {
+        shard &s = m_shards[(me + i) % DB_POOL_SHARDS];
+        DBConn *conn = 0;
+
+        pthread_mutex_lock(&s.lock);
+
+        if(!s.conns.empty()) {
+            conn = s.conns.back();
+            s.conns.pop_back();
+        }
+
+        pthread_mutex_unlock(&s.lock);
+
+        if(conn != 0) {
+            return conn;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Take connection parked by any thread
+ */
+DBConn *DBPool::take_parked(unsigned me)
+{
+    for(unsigned i = 0 ; i != DB_POOL_SLOTS ; i++) {
+        slot &s = m_slots[(me + i) % DB_POOL_SLOTS];
+
+        if(s.conn != 0) {
+            DBConn *conn = __sync_lock_test_and_set(&s.conn, (DBConn*)0);
+
+            if(conn != 0) {
+                return conn;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void DBPool::put_shared(unsigned me, DBConn *conn)
+{
+    shard &s = m_shards[me % DB_POOL_SHARDS];
+
+    pthread_mutex_lock(&s.lock);
+    s.conns.push_back(conn);
+    pthread_mutex_unlock(&s.lock);
+}
+
+/*
+ * Give connection to the thread waiting longest
+ *
+ * @return false if nobody is waiting
+ */
+bool DBPool::hand_off(DBConn *conn)
+{
+    if(m_num_waiting == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&m_wait_lock);
+
+    if(m_waiters.empty()) {
+        pthread_mutex_unlock(&m_wait_lock);
+        return false;
+    }
+
+    waiter *w = m_waiters.front();
+
+    m_waiters.pop_front();
+    __sync_sub_and_fetch(&m_num_waiting, 1);
+
+    w->conn = conn;
+
+    pthread_cond_signal(&w->cond);
+
+    pthread_mutex_unlock(&m_wait_lock);
+
+    return true;
+}
+
+/*
+ * Give idle connections to waiting threads
+ */
+void DBPool::wake_waiters(unsigned me)
+{
+    while(m_num_waiting != 0) {
+        DBConn *conn = take_shared(me);
+
+        if(conn == 0) {
+            conn = take_parked(me);
+        }
+
+        if(conn == 0) {
+            break;
+        }
+
+        if(!hand_off(conn)) {
+            put_shared(me, conn);
+            break;
+        }
+    }
+}
+
+DBConn *DBPool::wait(unsigned me)
+{
+    waiter w;
+    DBConn *conn, *extra = 0;
+
+    pthread_cond_init(&w.cond, NULL);
+    w.conn = 0;
+
+    pthread_mutex_lock(&m_wait_lock);
+    m_waiters.push_back(&w);
+    __sync_add_and_fetch(&m_num_waiting, 1);
+    pthread_mutex_unlock(&m_wait_lock);
+
+    /*
+     * Connection could have been returned before the waiter was seen
+     */
+    conn = take_shared(me);
+
+    if(conn == 0) {
+        conn = take_parked(me);
+    }
+
+    struct timeval now;
+    struct timespec deadline;
+
+    gettimeofday(&now, NULL);
+
+    deadline.tv_sec = now.tv_sec + m_acquire_timeout / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (m_acquire_timeout % 1000) * 1000000;
+
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&m_wait_lock);
+
+    if(conn == 0) {
+        while(w.conn == 0) {
+            if(pthread_cond_timedwait(&w.cond, &m_wait_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        conn = w.conn;
+    }
+    else {
+        extra = w.conn;
+    }
+
+    /*
+     * Still queued unless a connection was handed off
+     */
+    if(w.conn == 0) {
+        m_waiters.remove(&w);
+        __sync_sub_and_fetch(&m_num_waiting, 1);
+    }
+
+    pthread_mutex_unlock(&m_wait_lock);
+
+    pthread_cond_destroy(&w.cond);
+
+    if(extra != 0) {
+        put(extra);
+    }
+
+    if(conn == 0) {
+        throw db_exception("timed out waiting for connection", "get_connection");
+    }
+
+    return conn;
+}
+
+DBConn *DBPool::get()
+{
+    unsigned me = thread_index();
+    DBConn *conn = __sync_lock_test_and_set(&m_slots[me % DB_POOL_SLOTS].conn, (DBConn*)0);
+
+    if(conn == 0) {
+        conn = take_shared(me);
+    }
+
+    if(conn == 0) {
+        /*
+         * Reuse a connection idle in another thread's slot before
+         * opening a new one
+         */
+        conn = take_parked(me);
+    }
+
+    if(conn == 0) {
+        /*
+         * If there is room to grow connections then do it
+         */
+        conn = grow();
+    }
+
+    if(conn == 0) {
+        /*
+         * Otherwise wait for a connection to be returned
+         */
+        conn = wait(me);
+    }
+
+    time(&conn->m_last_used);
+
+    LogSQL("get connection " << conn << " (" << m_num_connections << ')');
+
+    return conn;
+}
+
+void DBPool::put(DBConn *conn)
+{
+    LogSQL("put connection " << conn << " (" << m_num_connections << ')');
+
+    time(&conn->m_last_used);
+
+    park(thread_index(), conn);
+}
+
+/*
+ * Give connection to a waiting thread or park it in a slot
+ */
+void DBPool::park(unsigned me, DBConn *conn)
+{
+    if(hand_off(conn)) {
+        return;
+    }
+
+    if(!__sync_bool_compare_and_swap(&m_slots[me % DB_POOL_SLOTS].conn, (DBConn*)0, conn)) {
+        put_shared(me, conn);
+    }
+
+    /*
+     * A thread could start waiting after the waiter count was checked
+     * and miss the connection parked here
+     */
+    __sync_synchronize();
+
+    if(m_num_waiting != 0) {
+        wake_waiters(me);
+    }
+}
+
+/*
+ * Take a connection that is idle for more than a minute out of the pool
+ */
+DBConn *DBPool::remove_idle(time_t now)
+{
+    for(unsigned i = 0 ; i != DB_POOL_SHARDS ; i++) {
+        shard &s = m_shards[i];
+        DBConn *conn = 0;
+
+        pthread_mutex_lock(&s.lock);
+
+        for(std::list<DBConn*>::iterator j = s.conns.begin() ; j != s.conns.end() ; j++) {
+            if((now - (*j)->m_last_used) >= 60) {
+                conn = *j;
+                s.conns.erase(j);
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&s.lock);
+
+        if(conn != 0) {
+            return conn;
+        }
+    }
+
+    for(unsigned i = 0 ; i != DB_POOL_SLOTS ; i++) {
+        /*
+         * Claim the slot before looking at the connection, its owner
+         * can take it at any moment
+         */
+        DBConn *conn = __sync_lock_test_and_set(&m_slots[i].conn, (DBConn*)0);
+
+        if(conn == 0) {
+            continue;
+        }
+
+        if((now - conn->m_last_used) >= 60) {
+            return conn;
+        }
+
+        /*
+         * Still in use, park it back for its owner as it was
+         */
+        park(i, conn);
+    }
+
+    return 0;
+}
 
 void *DBPool::maintenance_thread_func(void *arg) {
     bool exiting;
@@ -21,24 +507,11 @@ void *DBPool::maintenance_thread_func(void *arg) {
         pthread_mutex_lock(&maintenance_lock);
 
         for(std::list<DBPool*>::iterator p = pools.begin() ; p != pools.end() ; p++) {
+            DBConn *conn = (*p)->remove_idle(now);
 
-            std::auto_ptr<DBConn> to_remove;
-
-            /*
-             * Look for a connection that is idle for more than 5 minutes
-             */
-            pthread_mutex_lock(&(*p)->m_lock);
-            for(std::list<DBConn*>::iterator i = (*p)->m_available_connections.begin() ; i != (*p)->m_available_connections.end() ; i++) {
-                if((now - (*i)->m_last_used) >= 60) {
-                    to_remove.reset(*i);
-                    (*p)->m_available_connections.erase(i);
-                    (*p)->m_num_connections--;
-                    (*p)->m_num_available--;
-                    break;
-                }
+            if(conn != 0) {
+                (*p)->shrink(conn);
             }
-
-            pthread_mutex_unlock(&(*p)->m_lock);
         }
 
         exiting = maintenance_thread_exiting;
@@ -4,12 +4,15 @@
 #include <string>
 #include <memory>
 #include <list>
+#include <map>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
 
 #include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
 
 #ifdef WIN32
@@ -19,6 +22,7 @@
 #include <mysql.h>
 
 #include <logger/logger.h>
+#include <server/string_ref.h>
 
 class db_exception {
 public:
@@ -68,9 +72,29 @@ public:
 	unsigned int port;
 };
 
+/*
+ * Number of prepared statements kept by a connection
+ */
+#define DB_STMT_CACHE_SIZE 32
+
+/*
+ * Initial size of a BLOB column buffer. Buffers grow to fit the largest
+ * value fetched and are cut back to the initial size when the statement
+ * is returned to the connection holding more than DB_BLOB_BUFFER_KEEP
+ */
+#define DB_BLOB_BUFFER_SIZE 4096
+#define DB_BLOB_BUFFER_KEEP 65536
+
+class DBPreparedStmt;
+
 class DBConn {
+	typedef std::list<DBPreparedStmt*> StmtList;
+	typedef std::map<std::string, StmtList::iterator> StmtIndex;
 public:
-	DBConn(const DBCred &cred)
+	DBConn(const DBCred &cred, size_t max_stmts = DB_STMT_CACHE_SIZE)
+		: m_stmts()
+		, m_stmt_index()
+		, m_max_stmts(max_stmts)
 	{
 		mysql_init(&m_handler);
 
@@ -85,14 +109,27 @@ public:
         LogSQL("connection established");
 	}
 
-	~DBConn()
-	{
-		mysql_close(&m_handler);
-        LogSQL("connection closed");
-	}
+	~DBConn();
+
+	/*
+	 * Get prepared statement for SQL text, preparing it only if the
+	 * connection has no idle one. Statements are kept in LRU order
+	 */
+	DBPreparedStmt *acquire_stmt(const std::string &sql);
+
+	/*
+	 * Return statement to the cache. Statement that failed is closed,
+	 * as it may be out of sync with the server
+	 */
+	void release_stmt(DBPreparedStmt *stmt, bool failed);
 
 	MYSQL			m_handler;
     time_t          m_last_used;
+
+private:
+	StmtList		m_stmts;
+	StmtIndex		m_stmt_index;
+	size_t			m_max_stmts;
 };
 
 typedef struct {
@@ -103,6 +140,26 @@ typedef struct {
     MYSQL_FIELD *field;
 } column_data_t;
 
+/*
+ * Date and time column value
+ */
+struct DBTimestamp {
+    unsigned year, month, day;
+    unsigned hour, minute, second;
+
+    /*
+     * Format as MySQL does
+     */
+    std::string str() const {
+        char buf[64];
+
+        int len = snprintf(buf, sizeof(buf), "%04u-%02u-%02u %02u:%02u:%02u",
+            year, month, day, hour, minute, second);
+
+        return std::string(buf, len);
+    }
+};
+
 class BlobParam {
 public:
     BlobParam(int _param, const std::string &_value)
@@ -121,29 +178,36 @@ public:
     const std::string value;
 };
 
-class DBStmt {
+/*
+ * Prepared statement handle with its parameter and result bind buffers.
+ * Owned by connection and reused by statements with the same SQL text
+ */
+class DBPreparedStmt {
 public:
-	DBStmt(DBConn &conn, const std::string &stmt)
-		: m_handler(&conn.m_handler)
-		, m_stmt(mysql_stmt_init(&conn.m_handler))
+	DBPreparedStmt(MYSQL *handler, const std::string &sql)
+		: m_sql(sql)
+		, m_stmt(mysql_stmt_init(handler))
 		, m_bind_in(0)
 		, m_bind_out(0)
         , m_column_data(0)
 		, m_meta_result(0)
         , m_num_fields(0)
         , m_param_count(0)
-        , m_blob_params()
+        , m_in_use(false)
+        , m_cached(false)
 	{
-        LogSQL(stmt);
-
-		if(mysql_stmt_prepare(m_stmt, stmt.c_str(), stmt.size())) {
-			throw db_exception(m_stmt, "prepare");
+		if(mysql_stmt_prepare(m_stmt, sql.c_str(), sql.size())) {
+			db_exception e(m_stmt, "prepare");
+			mysql_stmt_close(m_stmt);
+			throw e;
 		}
 
 		m_param_count = mysql_stmt_param_count(m_stmt);
 
 		if(m_param_count != 0) {
 			m_bind_in = new MYSQL_BIND[m_param_count];
+
+			memset(m_bind_in, 0, sizeof(MYSQL_BIND) * m_param_count);
 		}
 
 		m_meta_result = mysql_stmt_result_metadata(m_stmt);
@@ -181,13 +245,13 @@ public:
 					bind->is_null = &column_data->is_null;
 				}
 				else {
-					column_data->buffer = NULL;
-					column_data->length = 0;
+					column_data->buffer = new u_char[DB_BLOB_BUFFER_SIZE];
+					column_data->length = DB_BLOB_BUFFER_SIZE;
 					column_data->field = field;
 
 					bind->buffer_type = field->type;
-					bind->buffer = NULL;
-					bind->buffer_length = 0;
+					bind->buffer = column_data->buffer;
+					bind->buffer_length = column_data->length;
 					bind->length = &column_data->actual_length;
 					bind->is_null = &column_data->is_null;
 				}
@@ -198,10 +262,10 @@ public:
         }
 	}
 
-	~DBStmt()
+	~DBPreparedStmt()
 	{
 		for(unsigned i = 0 ; i != m_num_fields ; i++) {
-			delete [] (u_char*)m_bind_out[i].buffer;
+			delete [] m_column_data[i].buffer;
 		}
 
 		delete [] m_bind_in;
@@ -213,32 +277,169 @@ public:
 		}
 
 		if(mysql_stmt_close(m_stmt)) {
-			throw db_exception(m_stmt, "stmt_close");
+			LogError("cannot close statement: " << m_sql);
+		}
+	}
+
+	/*
+	 * Make statement ready for the next user: discard unread rows and
+	 * parameters. Server side state is reset only if long data was sent,
+	 * as that takes a round trip
+	 *
+	 * @return false if statement cannot be reused
+	 */
+	bool reset(bool long_data)
+	{
+		if(m_param_count != 0) {
+			memset(m_bind_in, 0, sizeof(MYSQL_BIND) * m_param_count);
+		}
+
+		if(mysql_stmt_free_result(m_stmt)) {
+			return false;
+		}
+
+		if(long_data && mysql_stmt_reset(m_stmt)) {
+			return false;
+		}
+
+		for(unsigned i = 0 ; i != m_num_fields ; i++) {
+			if(m_column_data[i].field->type == MYSQL_TYPE_BLOB && m_column_data[i].length > DB_BLOB_BUFFER_KEEP) {
+				resize_blob(i, DB_BLOB_BUFFER_SIZE);
+			}
+		}
+
+		return true;
+	}
+
+	/*
+	 * Make buffer of a BLOB column hold at least size bytes. Results must
+	 * be bound again before the next fetch
+	 */
+	void grow_blob(size_t colno, unsigned long size)
+	{
+		unsigned long capacity = m_column_data[colno].length;
+
+		if(capacity >= size) {
+			return;
+		}
+
+		while(capacity < size) {
+			capacity *= 2;
 		}
+
+		resize_blob(colno, capacity);
+	}
+
+	static bool is_time_field(unsigned field_type)
+	{
+		return field_type == MYSQL_TYPE_TIME || field_type == MYSQL_TYPE_DATE ||
+			field_type == MYSQL_TYPE_DATETIME || field_type == MYSQL_TYPE_TIMESTAMP;
+	}
+
+	static bool is_string_field(unsigned field_type)
+	{
+		return field_type == MYSQL_TYPE_STRING || field_type == MYSQL_TYPE_VAR_STRING ||
+			field_type == MYSQL_TYPE_BLOB || field_type == MYSQL_TYPE_NEWDECIMAL ||
+			field_type == MYSQL_TYPE_DECIMAL;
+	}
+
+private:
+	void resize_blob(size_t colno, unsigned long capacity)
+	{
+		column_data_t *column_data = m_column_data + colno;
+
+		delete [] column_data->buffer;
+
+		column_data->buffer = new u_char[capacity];
+		column_data->length = capacity;
+
+		m_bind_out[colno].buffer = column_data->buffer;
+		m_bind_out[colno].buffer_length = capacity;
+	}
+
+	friend class DBConn;
+	friend class DBStmt;
+
+	const std::string m_sql;
+	MYSQL_STMT *m_stmt;
+	MYSQL_BIND *m_bind_in;
+	MYSQL_BIND *m_bind_out;
+    column_data_t *m_column_data;
+	MYSQL_RES  *m_meta_result;
+	size_t m_num_fields;
+	size_t m_param_count;
+	bool m_in_use;
+	bool m_cached;
+};
+
+/*
+ * Statement borrowed from connection for the lifetime of the object
+ */
+class DBStmt {
+public:
+	DBStmt(DBConn &conn, const std::string &stmt)
+		: m_conn(conn)
+		, m_prepared(conn.acquire_stmt(stmt))
+		, m_stmt(m_prepared->m_stmt)
+		, m_bind_in(m_prepared->m_bind_in)
+		, m_bind_out(m_prepared->m_bind_out)
+		, m_bind_result(m_bind_out)
+        , m_column_data(m_prepared->m_column_data)
+        , m_num_fields(m_prepared->m_num_fields)
+        , m_param_count(m_prepared->m_param_count)
+        , m_failed(false)
+        , m_prefetch(false)
+        , m_blob_params()
+	{
+        LogSQL(stmt);
+	}
+
+	~DBStmt()
+	{
+		m_conn.release_stmt(m_prepared, m_failed || !m_prepared->reset(!m_blob_params.empty()));
 	}
 
 	void execute()
 	{
 		if(m_param_count) {
 			if(mysql_stmt_bind_param(m_stmt, m_bind_in)) {
-				throw db_exception(m_stmt, "bind_param");
+				fail("bind_param");
 			}
 
             for(std::list<BlobParam>::const_iterator i = m_blob_params.begin() ; i != m_blob_params.end() ; i++) {
                 if(mysql_stmt_send_long_data(m_stmt, i->param, i->value.c_str(), i->value.size()))
                 {
-                    throw db_exception(m_stmt, "send_long_data");
+                    fail("send_long_data");
                 }
             }
 		}
 
 		if(mysql_stmt_execute(m_stmt)) {
-			throw db_exception(m_stmt, "execute");
+			fail("execute");
+		}
+
+		if(m_prefetch && m_num_fields) {
+			my_bool update_max_length = 1;
+
+			mysql_stmt_attr_set(m_stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &update_max_length);
+
+			if(mysql_stmt_store_result(m_stmt)) {
+				fail("store_result");
+			}
+
+			/*
+			 * Longest values are known, BLOB buffers are sized once
+			 */
+			for(unsigned i = 0 ; i != m_num_fields ; i++) {
+				if(m_column_data[i].field->type == MYSQL_TYPE_BLOB) {
+					grow_blob(i, m_column_data[i].field->max_length);
+				}
+			}
 		}
 
 		if(m_num_fields) {
-			if(mysql_stmt_bind_result(m_stmt, m_bind_out)) {
-				throw db_exception(m_stmt, "bind_result");
+			if(mysql_stmt_bind_result(m_stmt, m_bind_result)) {
+				fail("bind_result");
 			}
 		}
 	}
@@ -251,27 +452,35 @@ public:
 		}
 
         if(result == 1) {
-            throw db_exception(m_stmt, "stmt_fetch");
+            fail("stmt_fetch");
         }
 
+		bool rebind = false;
+
 		for(unsigned i = 0 ; i != m_num_fields ; i++) {
-			if(m_column_data[i].field->type == MYSQL_TYPE_BLOB) {
-				delete [] (u_char*)m_column_data[i].buffer;
-
-				m_column_data[i].buffer = NULL;
-				
-				if(m_column_data[i].actual_length != 0) {
-					m_column_data[i].buffer = new u_char[m_column_data[i].actual_length];
-					m_bind_out[i].buffer = m_column_data[i].buffer;
-					m_bind_out[i].buffer_length = m_column_data[i].actual_length;
-
-					if(mysql_stmt_fetch_column(m_stmt, &m_bind_out[i], i, 0)) {
-						throw db_exception(m_stmt, "fetch_column");
-					}
+			column_data_t *column_data = m_column_data + i;
+
+			if(column_data->field->type == MYSQL_TYPE_BLOB && !column_data->is_null &&
+				column_data->actual_length > column_data->length)
+			{
+				/*
+				 * Only the part that fit was copied, read the rest
+				 * into a larger buffer
+				 */
+				grow_blob(i, column_data->actual_length);
+
+				if(mysql_stmt_fetch_column(m_stmt, &m_bind_out[i], i, 0)) {
+					fail("fetch_column");
 				}
+
+				rebind = true;
 			}
 		}
 
+		if(rebind && mysql_stmt_bind_result(m_stmt, m_bind_result)) {
+			fail("bind_result");
+		}
+
 		return true;
 	}
 
@@ -286,6 +495,17 @@ public:
 		}
 	}
 
+	void bindInt64(size_t colno, const long long &value) {
+		if(colno < m_param_count) {
+			m_bind_in[colno].buffer_type = MYSQL_TYPE_LONGLONG;
+			m_bind_in[colno].is_unsigned = 0;
+			m_bind_in[colno].buffer = (void*)&value;
+			m_bind_in[colno].buffer_length = sizeof(long long);
+			m_bind_in[colno].length = NULL;
+			m_bind_in[colno].is_null = NULL;
+		}
+	}
+
 	void bindDouble(size_t colno, const double &value) {
 		if(colno < m_param_count) {
 			m_bind_in[colno].buffer_type = MYSQL_TYPE_DOUBLE;
@@ -319,11 +539,137 @@ public:
 		}
 	}
 
+	/*
+	 * Read the whole result set in one go when executed. The connection
+	 * is free for other statements while rows are fetched
+	 */
+	void setPrefetch(bool prefetch) {
+		m_prefetch = prefetch;
+	}
+
 	int asInt(int colno) const {
-		int i;
-		std::istringstream s(this->asString(colno));
-		s >> i;
-		return i;
+		return asInt32(colno);
+	}
+
+	/*
+	 * Typed accessors read the bound buffer directly. Character columns
+	 * are parsed, NULL reads as zero
+	 */
+	int asInt32(size_t colno) const {
+		return (int)asInt64(colno);
+	}
+
+	long long asInt64(size_t colno) const {
+		if(colno >= m_num_fields || m_column_data[colno].is_null) {
+			return 0;
+		}
+
+		const column_data_t *col = m_column_data + colno;
+		bool is_unsigned = (col->field->flags & UNSIGNED_FLAG) != 0;
+
+		switch(col->field->type) {
+			case MYSQL_TYPE_TINY:
+				return is_unsigned ? (long long)*((unsigned char*)col->buffer) : (long long)*((signed char*)col->buffer);
+			case MYSQL_TYPE_SHORT:
+			case MYSQL_TYPE_YEAR:
+				return is_unsigned ? (long long)*((unsigned short*)col->buffer) : (long long)*((short*)col->buffer);
+			case MYSQL_TYPE_INT24:
+			case MYSQL_TYPE_LONG:
+				return is_unsigned ? (long long)*((unsigned int*)col->buffer) : (long long)*((int*)col->buffer);
+			case MYSQL_TYPE_LONGLONG:
+				return *((long long*)col->buffer);
+			case MYSQL_TYPE_DOUBLE:
+				return (long long)*((double*)col->buffer);
+			case MYSQL_TYPE_FLOAT:
+				return (long long)*((float*)col->buffer);
+			default:
+				break;
+		}
+
+		char buf[32];
+
+		return strtoll(column_to_cstring(col, buf, sizeof(buf)), NULL, 10);
+	}
+
+	double asDouble(size_t colno) const {
+		if(colno >= m_num_fields || m_column_data[colno].is_null) {
+			return 0;
+		}
+
+		const column_data_t *col = m_column_data + colno;
+
+		switch(col->field->type) {
+			case MYSQL_TYPE_DOUBLE:
+				return *((double*)col->buffer);
+			case MYSQL_TYPE_FLOAT:
+				return *((float*)col->buffer);
+			case MYSQL_TYPE_TINY:
+			case MYSQL_TYPE_SHORT:
+			case MYSQL_TYPE_YEAR:
+			case MYSQL_TYPE_INT24:
+			case MYSQL_TYPE_LONG:
+			case MYSQL_TYPE_LONGLONG:
+				return (double)asInt64(colno);
+			default:
+				break;
+		}
+
+		char buf[64];
+
+		return strtod(column_to_cstring(col, buf, sizeof(buf)), NULL);
+	}
+
+	DBTimestamp asTimestamp(size_t colno) const {
+		DBTimestamp ts;
+
+		memset(&ts, 0, sizeof(ts));
+
+		if(colno >= m_num_fields || m_column_data[colno].is_null) {
+			return ts;
+		}
+
+		const column_data_t *col = m_column_data + colno;
+
+		if(DBPreparedStmt::is_time_field(col->field->type)) {
+			const MYSQL_TIME *t = (const MYSQL_TIME*)col->buffer;
+
+			ts.year = t->year;
+			ts.month = t->month;
+			ts.day = t->day;
+			ts.hour = t->hour;
+			ts.minute = t->minute;
+			ts.second = t->second;
+		}
+		else {
+			char buf[32];
+
+			sscanf(column_to_cstring(col, buf, sizeof(buf)), "%u-%u-%u %u:%u:%u",
+				&ts.year, &ts.month, &ts.day, &ts.hour, &ts.minute, &ts.second);
+		}
+
+		return ts;
+	}
+
+	/*
+	 * Character or binary column data without copying. Valid until
+	 * the next fetch
+	 */
+	fp::string_ref asStringRef(size_t colno) const {
+		if(colno >= m_num_fields || m_column_data[colno].is_null) {
+			return fp::string_ref();
+		}
+
+		const column_data_t *col = m_column_data + colno;
+
+		if(!DBPreparedStmt::is_string_field(col->field->type)) {
+			throw db_exception("Column is not a string", "stmt_fetch");
+		}
+
+		if(col->buffer == NULL) {
+			return fp::string_ref();
+		}
+
+		return fp::string_ref((const char*)col->buffer, col->actual_length);
 	}
 
 	std::string asString(size_t colno) const {
@@ -331,9 +677,26 @@ public:
             return "";
         }
 
+        const column_data_t *col = m_column_data + colno;
+
+        if(DBPreparedStmt::is_string_field(col->field->type)) {
+            return col->is_null || col->buffer == NULL ? std::string()
+                : std::string((const char*)col->buffer, col->actual_length);
+        }
+
+        if(col->field->type == MYSQL_TYPE_DATETIME || col->field->type == MYSQL_TYPE_TIMESTAMP) {
+            const MYSQL_TIME *ts = (const MYSQL_TIME*)col->buffer;
+            char buf[64];
+
+            int len = snprintf(buf, sizeof(buf), "%04u-%02u-%02u %02u:%02u:%02u",
+                ts->year, ts->month, ts->day, ts->hour, ts->minute, ts->second);
+
+            return std::string(buf, len);
+        }
+
         std::ostringstream o;
 
-        column_to_string(m_column_data + colno, o);
+        column_to_string(col, o);
 
 		return o.str();
 	}
@@ -348,10 +711,40 @@ public:
     }
 
 private:
-    static bool is_time_field(unsigned field_type)
+    void fail(const char *stage)
+    {
+        m_failed = true;
+        throw db_exception(m_stmt, stage);
+    }
+
+    /*
+     * Results may be bound to buffers other than the column ones, those
+     * have to follow BLOB buffers when they grow
+     */
+    void grow_blob(unsigned colno, unsigned long size)
     {
-        return field_type == MYSQL_TYPE_TIME || field_type == MYSQL_TYPE_DATE ||
-            field_type == MYSQL_TYPE_DATETIME || field_type == MYSQL_TYPE_TIMESTAMP;
+        m_prepared->grow_blob(colno, size);
+
+        if(m_bind_result != m_bind_out) {
+            m_bind_result[colno].buffer = m_bind_out[colno].buffer;
+            m_bind_result[colno].buffer_length = m_bind_out[colno].buffer_length;
+        }
+    }
+
+    /*
+     * Copy character data to a terminated buffer for parsing
+     */
+    static const char *column_to_cstring(const column_data_t *col, char *buf, size_t size) {
+        size_t len = 0;
+
+        if(DBPreparedStmt::is_string_field(col->field->type) && col->buffer != NULL) {
+            len = std::min((size_t)col->actual_length, size - 1);
+            memcpy(buf, col->buffer, len);
+        }
+
+        buf[len] = '\0';
+
+        return buf;
     }
 
     static void convert_timestamp(MYSQL_TIME *ts, std::ostream &o) {
@@ -405,15 +798,21 @@ private:
         }
     }
 
-	MYSQL *m_handler;
+	DBStmt(const DBStmt&);
+	DBStmt &operator=(const DBStmt&);
+
+protected:
+	DBConn &m_conn;
+	DBPreparedStmt *m_prepared;
 	MYSQL_STMT *m_stmt;
 	MYSQL_BIND *m_bind_in;
 	MYSQL_BIND *m_bind_out;
+	MYSQL_BIND *m_bind_result;
     column_data_t *m_column_data;
-	MYSQL_RES  *m_meta_result;
 	size_t m_num_fields;
 	size_t m_param_count;
-	my_ulonglong m_num_rows;
+	bool m_failed;
+	bool m_prefetch;
     std::list<BlobParam> m_blob_params;
 };
 
@@ -449,102 +848,104 @@ private:
     std::string lockname;
 };
 
+/*
+ * Connections parked by threads for their own reuse, and shards of
+ * the shared free list
+ */
+#define DB_POOL_SLOTS 64
+#define DB_POOL_SHARDS 8
+
+/*
+ * How long get() waits for a connection to be returned, in milliseconds
+ */
+#define DB_POOL_ACQUIRE_TIMEOUT 5000
+
+#define DB_POOL_CACHE_LINE 64
+
+/*
+ * Every thread has a slot it parks connection in on put() and takes it
+ * from on get(), with an atomic exchange and no lock. Connections that
+ * do not fit in a slot go to a sharded free list. Idle connections of
+ * other threads are taken before a new connection is opened, so that
+ * the pool grows only when all connections are in use. Threads that
+ * still find nothing wait and are served in arrival order
+ */
 class DBPool {
 public:
-    DBPool(const DBCred &cred, size_t _min_connections, size_t _max_connections)
-        : m_cred(cred)
-        , m_all_connections()
-        , m_available_connections()
-        , m_min_connections(_min_connections)
-        , m_max_connections(_max_connections)
-        , m_num_connections(0)
-        , m_num_available(0)
-    {
-        pthread_cond_init(&m_not_empty, NULL);
-        pthread_mutex_init(&m_lock, NULL);
-    }
-
-    ~DBPool() {
-        for(std::list<DBConn*>::const_iterator i = m_all_connections.begin() ; i != m_all_connections.end() ; i++) {
-            delete *i;
-        }
-        pthread_mutex_destroy(&m_lock);
-        pthread_cond_destroy(&m_not_empty);
-    }
-
-    DBConn *grow() {
-
-        std::auto_ptr<DBConn> conn(new DBConn(m_cred));
+    DBPool(const DBCred &cred, size_t _min_connections, size_t _max_connections);
+    ~DBPool();
 
-        m_all_connections.push_back(conn.get());
-        m_num_connections++;
+    /*
+     * @throw db_exception if no connection is returned within acquire timeout
+     */
+    DBConn *get();
+    void put(DBConn *conn);
 
-        LogSQL("grow connection " << conn.get());
+    void set_acquire_timeout(unsigned _acquire_timeout) { m_acquire_timeout = _acquire_timeout; }
 
-        return conn.release();
-    }
-
-    DBConn *get() {
-        std::auto_ptr<DBConn> conn;
-
-        pthread_mutex_lock(&m_lock);
-
-        if(m_num_available == 0 && m_num_connections < m_max_connections) {
-            /*
-             * If there is room to grow connections then do it
-             */
-            conn.reset(grow());
-        }
-        else {
-            /*
-             * Otherwise wait on queue and get existing connection
-             */
-            if(m_available_connections.empty())
-                pthread_cond_wait(&m_not_empty, &m_lock);
-
-            conn.reset(m_available_connections.front());
-            m_available_connections.pop_front();
-            m_num_available--;
-        }
-
-        time(&conn.get()->m_last_used);
-
-        pthread_mutex_unlock(&m_lock);
-
-        LogSQL("get connection " << conn.get() << " (" << m_num_available << '/' << m_num_connections << ')');
-
-        return conn.release();
-    }
-
-    void put(DBConn *conn) {
-        LogSQL("put connection " << conn << " (" << m_num_available << '/' << m_num_connections << ')');
-
-        pthread_mutex_lock(&m_lock);
-        m_available_connections.push_back(conn);
-        m_num_available++;
-        time(&conn->m_last_used);
-        pthread_cond_signal(&m_not_empty);
-        pthread_mutex_unlock(&m_lock);
-    }
+    /*
+     * Number of threads waiting for a connection to be returned
+     */
+    size_t num_waiting() const { return m_num_waiting; }
 
     static void start_maintenance_thread(DBPool&);
     static void join_maintenance_thread();
 
 private:
+    struct slot {
+        DBConn * volatile   conn;
+        char                pad[DB_POOL_CACHE_LINE - sizeof(DBConn*)];
+    };
+
+    struct shard {
+        pthread_mutex_t     lock;
+        std::list<DBConn*>  conns;
+    };
+
+    struct waiter {
+        pthread_cond_t      cond;
+        DBConn              *conn;
+    };
+
+    DBConn *grow();
+    void shrink(DBConn*);
+
+    DBConn *take_shared(unsigned);
+    DBConn *take_parked(unsigned);
+    void put_shared(unsigned, DBConn*);
+    bool hand_off(DBConn*);
+    void park(unsigned, DBConn*);
+    void wake_waiters(unsigned);
+    DBConn *wait(unsigned);
+
+    DBConn *remove_idle(time_t);
+
+    static unsigned thread_index();
     static void *maintenance_thread_func(void*);
 
+    DBPool(const DBPool&);
+    DBPool &operator=(const DBPool&);
+
 private:
+    slot                m_slots[DB_POOL_SLOTS];
+    shard               m_shards[DB_POOL_SHARDS];
+
+    /*
+     * Protects list of all connections
+     */
     pthread_mutex_t     m_lock;
-    pthread_cond_t      m_not_empty;
+
+    pthread_mutex_t     m_wait_lock;
+    std::list<waiter*>  m_waiters;
+    volatile size_t     m_num_waiting;
 
     DBCred              m_cred;
     std::list<DBConn*>  m_all_connections;
-    std::list<DBConn*>  m_available_connections;
 
     size_t              m_min_connections;
     size_t              m_max_connections;
-    size_t              m_num_connections;
-    size_t              m_num_available;
+    volatile size_t     m_num_connections;
+    unsigned            m_acquire_timeout;
 
     static              std::list<DBPool*> pools;
     static              pthread_t maintenance_thread;
@@ -552,6 +953,7 @@ private:
     static              pthread_mutex_t maintenance_lock;
     static volatile     bool maintenance_thread_running;
     static volatile     bool maintenance_thread_exiting;
+    static volatile     unsigned num_threads;
 };
 
 class DBConnHolder {
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "db_pool.h"
+
+static const size_t MAX_CONNECTIONS = 5;
+static const int ITERATIONS = 20000;
+
+/*
+ * get/put throughput of the connection pool with 5 to 64 threads over
+ * 5 connections, against a MySQL server given by DB_TEST_HOST,
+ * DB_TEST_USER, DB_TEST_PASSWD and DB_TEST_DB. Results are printed, the
+ * limit on connections in use is asserted
+ */
+class db_pool_bench : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(db_pool_bench);
+    CPPUNIT_TEST(bench_contention);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp()
+    {
+        pool = new DBPool(credentials(), 1, MAX_CONNECTIONS);
+    }
+
+    void tearDown()
+    {
+        delete pool;
+    }
+
+    void bench_contention()
+    {
+        try {
+            DBConnHolder conn(*pool);
+        }
+        catch(const db_exception &e) {
+            CPPUNIT_FAIL(std::string("cannot connect to test database: ") + e.what());
+        }
+
+        static const int thread_counts[] = { 5, 16, 32, 64 };
+
+        for(size_t n = 0 ; n != sizeof(thread_counts) / sizeof(thread_counts[0]) ; n++) {
+            std::vector<pthread_t> threads(thread_counts[n]);
+
+            in_use = max_in_use = failures = 0;
+
+            double start = now();
+
+            for(std::vector<pthread_t>::iterator i = threads.begin() ; i != threads.end() ; i++) {
+                pthread_create(&*i, NULL, contender, this);
+            }
+
+            for(std::vector<pthread_t>::iterator i = threads.begin() ; i != threads.end() ; i++) {
+                pthread_join(*i, NULL);
+            }
+
+            double elapsed = now() - start;
+
+            printf("\ndb_pool %2d threads, %u connections: %9.0f get/put per second",
+                thread_counts[n], (unsigned)MAX_CONNECTIONS, threads.size() * ITERATIONS / elapsed);
+
+            CPPUNIT_ASSERT_EQUAL(0, (int)failures);
+            CPPUNIT_ASSERT((size_t)max_in_use <= MAX_CONNECTIONS);
+        }
+    }
+
+private:
+    static DBCred credentials()
+    {
+        return DBCred(env("DB_TEST_HOST", "localhost"), env("DB_TEST_USER", "test"),
+            env("DB_TEST_PASSWD", ""), env("DB_TEST_DB", "test"));
+    }
+
+    static const char *env(const char *name, const char *def)
+    {
+        const char *value = getenv(name);
+
+        return value != 0 ? value : def;
+    }
+
+    static double now()
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, 0);
+
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+
+    static void *contender(void *arg)
+    {
+        db_pool_bench *bench = static_cast<db_pool_bench*>(arg);
+
+        for(int i = 0 ; i != ITERATIONS ; i++) {
+            try {
+                DBConnHolder conn(*bench->pool);
+                int n = __sync_add_and_fetch(&bench->in_use, 1);
+                int m;
+
+                while((m = bench->max_in_use) < n && !__sync_bool_compare_and_swap(&bench->max_in_use, m, n)) {
+                }
+
+                __sync_sub_and_fetch(&bench->in_use, 1);
+            }
+            catch(const db_exception&) {
+                __sync_add_and_fetch(&bench->failures, 1);
+            }
+        }
+
+        return NULL;
+    }
+
+private:
+    DBPool *pool;
+
+    volatile int in_use;
+    volatile int max_in_use;
+    volatile int failures;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(db_pool_bench);
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "db_pool.h"
+
+static const size_t MAX_CONNECTIONS = 5;
+static const size_t WAITERS = 5;
+
+/*
+ * Connection pool against a MySQL server given by DB_TEST_HOST,
+ * DB_TEST_USER, DB_TEST_PASSWD and DB_TEST_DB. Tests fail when the
+ * server cannot be reached, test_main skips them if DB_TEST_SKIP is set
+ */
+class db_pool_test : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(db_pool_test);
+    CPPUNIT_TEST(test_reuse);
+    CPPUNIT_TEST(test_fifo);
+    CPPUNIT_TEST(test_acquire_timeout);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp()
+    {
+        pool = new DBPool(credentials(), 1, MAX_CONNECTIONS);
+    }
+
+    void tearDown()
+    {
+        delete pool;
+    }
+
+    void test_reuse()
+    {
+        require_server();
+
+        DBConn *conn = pool->get();
+
+        pool->put(conn);
+
+        /*
+         * Same thread gets the connection it parked
+         */
+        CPPUNIT_ASSERT(pool->get() == conn);
+
+        pool->put(conn);
+    }
+
+    void test_fifo()
+    {
+        require_server();
+
+        std::vector<DBConn*> held;
+
+        for(size_t i = 0 ; i != MAX_CONNECTIONS ; i++) {
+            held.push_back(pool->get());
+        }
+
+        fifo_order order;
+        std::vector<fifo_waiter> waiters(WAITERS);
+
+        pthread_mutex_init(&order.lock, NULL);
+        pthread_cond_init(&order.served, NULL);
+
+        /*
+         * Each waiter starts once the previous one is queued in the pool
+         */
+        for(size_t i = 0 ; i != WAITERS ; i++) {
+            waiters[i].pool = pool;
+            waiters[i].order = &order;
+            waiters[i].index = i;
+
+            pthread_create(&waiters[i].thread, NULL, fifo_wait, &waiters[i]);
+
+            CPPUNIT_ASSERT(wait_for_waiters(i + 1));
+        }
+
+        /*
+         * Waiters are served in arrival order, one connection at a time:
+         * each puts it back to the next one
+         */
+        pool->put(held.back());
+        held.pop_back();
+
+        pthread_mutex_lock(&order.lock);
+
+        while(order.indexes.size() != WAITERS) {
+            pthread_cond_wait(&order.served, &order.lock);
+        }
+
+        pthread_mutex_unlock(&order.lock);
+
+        for(size_t i = 0 ; i != WAITERS ; i++) {
+            pthread_join(waiters[i].thread, NULL);
+        }
+
+        for(std::vector<DBConn*>::const_iterator i = held.begin() ; i != held.end() ; i++) {
+            pool->put(*i);
+        }
+
+        pthread_cond_destroy(&order.served);
+        pthread_mutex_destroy(&order.lock);
+
+        for(size_t i = 0 ; i != WAITERS ; i++) {
+            CPPUNIT_ASSERT_EQUAL(i, order.indexes[i]);
+        }
+    }
+
+    void test_acquire_timeout()
+    {
+        require_server();
+
+        std::vector<DBConn*> held;
+
+        for(size_t i = 0 ; i != MAX_CONNECTIONS ; i++) {
+            held.push_back(pool->get());
+        }
+
+        pool->set_acquire_timeout(200);
+
+        double start = now();
+
+        CPPUNIT_ASSERT_THROW(pool->get(), db_exception);
+
+        double waited = now() - start;
+
+        CPPUNIT_ASSERT(waited >= 0.15 && waited < 2.0);
+
+        for(std::vector<DBConn*>::const_iterator i = held.begin() ; i != held.end() ; i++) {
+            pool->put(*i);
+        }
+    }
+
+private:
+    /*
+     * Order waiters were served in
+     */
+    struct fifo_order {
+        pthread_mutex_t     lock;
+        pthread_cond_t      served;
+        std::vector<size_t> indexes;
+    };
+
+    struct fifo_waiter {
+        DBPool      *pool;
+        fifo_order  *order;
+        size_t      index;
+        pthread_t   thread;
+    };
+
+    static DBCred credentials()
+    {
+        return DBCred(env("DB_TEST_HOST", "localhost"), env("DB_TEST_USER", "test"),
+            env("DB_TEST_PASSWD", ""), env("DB_TEST_DB", "test"));
+    }
+
+    static const char *env(const char *name, const char *def)
+    {
+        const char *value = getenv(name);
+
+        return value != 0 ? value : def;
+    }
+
+    /*
+     * Fail the test if the server cannot be reached
+     */
+    void require_server()
+    {
+        try {
+            DBConnHolder conn(*pool);
+        }
+        catch(const db_exception &e) {
+            CPPUNIT_FAIL(std::string("cannot connect to test database: ") + e.what());
+        }
+    }
+
+    /*
+     * Wait until given number of threads are queued in the pool
+     *
+     * @return false if they are not within 5 seconds
+     */
+    bool wait_for_waiters(size_t n)
+    {
+        for(int i = 0 ; i != 5000 ; i++) {
+            if(pool->num_waiting() == n) {
+                return true;
+            }
+
+            usleep(1000);
+        }
+
+        return false;
+    }
+
+    static double now()
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, 0);
+
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+
+    static void *fifo_wait(void *arg)
+    {
+        fifo_waiter *waiter = static_cast<fifo_waiter*>(arg);
+        DBConn *conn = waiter->pool->get();
+
+        pthread_mutex_lock(&waiter->order->lock);
+        waiter->order->indexes.push_back(waiter->index);
+        pthread_cond_signal(&waiter->order->served);
+        pthread_mutex_unlock(&waiter->order->lock);
+
+        waiter->pool->put(conn);
+
+        return NULL;
+    }
+
+private:
+    DBPool *pool;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(db_pool_test);
@@ -0,0 +1,318 @@
+#ifndef _DB_ROW_H_
+#define _DB_ROW_H_
+
+#include <string>
+
+#include <db/db_pool.h>
+
+/*
+ * End of a row type list
+ */
+struct DBNil {
+	enum { size = 0 };
+};
+
+/*
+ * Row type as a list of column types
+ */
+template<class H, class T>
+struct DBCons {
+	typedef H head_type;
+	typedef T tail_type;
+
+	enum { size = 1 + T::size };
+
+	H head;
+	T tail;
+};
+
+/*
+ * Column value of a row by index
+ */
+template<int N, class L>
+struct DBElement {
+	typedef typename DBElement<N - 1, typename L::tail_type>::type type;
+
+	static type &get(L &row) { return DBElement<N - 1, typename L::tail_type>::get(row.tail); }
+	static const type &get(const L &row) { return DBElement<N - 1, typename L::tail_type>::get(row.tail); }
+};
+
+template<class L>
+struct DBElement<0, L> {
+	typedef typename L::head_type type;
+
+	static type &get(L &row) { return row.head; }
+	static const type &get(const L &row) { return row.head; }
+};
+
+/*
+ * Row of up to eight columns:
+ *
+ * DBTuple<int, fp::string_ref, DBTimestamp> row;
+ * row.get<1>()
+ */
+template<class A = DBNil, class B = DBNil, class C = DBNil, class D = DBNil,
+	class E = DBNil, class F = DBNil, class G = DBNil, class H = DBNil>
+struct DBTuple : DBCons<A, DBTuple<B, C, D, E, F, G, H> > {
+	template<int N>
+	typename DBElement<N, DBTuple>::type &get() { return DBElement<N, DBTuple>::get(*this); }
+
+	template<int N>
+	const typename DBElement<N, DBTuple>::type &get() const { return DBElement<N, DBTuple>::get(*this); }
+};
+
+template<>
+struct DBTuple<> : DBNil {
+};
+
+/*
+ * How a column is read into a value of type T. Types without traits
+ * cannot be used in rows
+ *
+ * accepts() tells if a column of given type can be read into T
+ * bind() points result bind at storage of the value, or leaves it
+ * bound to column buffer
+ * fetch() finishes the value after a row is fetched
+ */
+template<class T>
+struct DBColumnTraits;
+
+struct DBIntegerColumn {
+	static bool accepts(unsigned field_type)
+	{
+		return field_type == MYSQL_TYPE_TINY || field_type == MYSQL_TYPE_SHORT ||
+			field_type == MYSQL_TYPE_INT24 || field_type == MYSQL_TYPE_LONG ||
+			field_type == MYSQL_TYPE_LONGLONG || field_type == MYSQL_TYPE_YEAR;
+	}
+};
+
+template<>
+struct DBColumnTraits<int> : DBIntegerColumn {
+	static const char *name() { return "int"; }
+
+	static void bind(MYSQL_BIND &bind, int &value, column_data_t&)
+	{
+		bind.buffer_type = MYSQL_TYPE_LONG;
+		bind.buffer = &value;
+		bind.buffer_length = sizeof(value);
+		bind.is_unsigned = 0;
+	}
+
+	static void fetch(int &value, const column_data_t &col)
+	{
+		if(col.is_null) {
+			value = 0;
+		}
+	}
+};
+
+template<>
+struct DBColumnTraits<long long> : DBIntegerColumn {
+	static const char *name() { return "long long"; }
+
+	static void bind(MYSQL_BIND &bind, long long &value, column_data_t&)
+	{
+		bind.buffer_type = MYSQL_TYPE_LONGLONG;
+		bind.buffer = &value;
+		bind.buffer_length = sizeof(value);
+		bind.is_unsigned = 0;
+	}
+
+	static void fetch(long long &value, const column_data_t &col)
+	{
+		if(col.is_null) {
+			value = 0;
+		}
+	}
+};
+
+template<>
+struct DBColumnTraits<double> {
+	static const char *name() { return "double"; }
+
+	static bool accepts(unsigned field_type)
+	{
+		return field_type == MYSQL_TYPE_DOUBLE || field_type == MYSQL_TYPE_FLOAT ||
+			DBIntegerColumn::accepts(field_type);
+	}
+
+	static void bind(MYSQL_BIND &bind, double &value, column_data_t&)
+	{
+		bind.buffer_type = MYSQL_TYPE_DOUBLE;
+		bind.buffer = &value;
+		bind.buffer_length = sizeof(value);
+		bind.is_unsigned = 0;
+	}
+
+	static void fetch(double &value, const column_data_t &col)
+	{
+		if(col.is_null) {
+			value = 0;
+		}
+	}
+};
+
+/*
+ * Refers to column buffer, valid until the next fetch
+ */
+template<>
+struct DBColumnTraits<fp::string_ref> {
+	static const char *name() { return "string_ref"; }
+
+	static bool accepts(unsigned field_type)
+	{
+		return DBPreparedStmt::is_string_field(field_type);
+	}
+
+	static void bind(MYSQL_BIND&, fp::string_ref&, column_data_t&)
+	{
+	}
+
+	static void fetch(fp::string_ref &value, const column_data_t &col)
+	{
+		value = col.is_null ? fp::string_ref() : fp::string_ref((const char*)col.buffer, col.actual_length);
+	}
+};
+
+template<>
+struct DBColumnTraits<std::string> {
+	static const char *name() { return "string"; }
+
+	static bool accepts(unsigned field_type)
+	{
+		return DBPreparedStmt::is_string_field(field_type);
+	}
+
+	static void bind(MYSQL_BIND&, std::string&, column_data_t&)
+	{
+	}
+
+	static void fetch(std::string &value, const column_data_t &col)
+	{
+		if(col.is_null) {
+			value.clear();
+		}
+		else {
+			value.assign((const char*)col.buffer, col.actual_length);
+		}
+	}
+};
+
+template<>
+struct DBColumnTraits<DBTimestamp> {
+	static const char *name() { return "timestamp"; }
+
+	static bool accepts(unsigned field_type)
+	{
+		return field_type == MYSQL_TYPE_DATE || field_type == MYSQL_TYPE_DATETIME ||
+			field_type == MYSQL_TYPE_TIMESTAMP;
+	}
+
+	static void bind(MYSQL_BIND&, DBTimestamp&, column_data_t&)
+	{
+	}
+
+	static void fetch(DBTimestamp &value, const column_data_t &col)
+	{
+		const MYSQL_TIME *t = (const MYSQL_TIME*)col.buffer;
+
+		if(col.is_null) {
+			memset(&value, 0, sizeof(value));
+			return;
+		}
+
+		value.year = t->year;
+		value.month = t->month;
+		value.day = t->day;
+		value.hour = t->hour;
+		value.minute = t->minute;
+		value.second = t->second;
+	}
+};
+
+/*
+ * Walks row type list, one column per element
+ */
+template<class L>
+struct DBRowBinder {
+	typedef DBColumnTraits<typename L::head_type> traits;
+
+	static void bind(L &row, MYSQL_BIND *bind, column_data_t *col)
+	{
+		if(!traits::accepts(col->field->type)) {
+			throw db_exception(std::string("Cannot read column ") + col->field->name + " as " + traits::name(),
+				"prepare");
+		}
+
+		traits::bind(*bind, row.head, *col);
+
+		DBRowBinder<typename L::tail_type>::bind(row.tail, bind + 1, col + 1);
+	}
+
+	static void fetch(L &row, const column_data_t *col)
+	{
+		traits::fetch(row.head, *col);
+
+		DBRowBinder<typename L::tail_type>::fetch(row.tail, col + 1);
+	}
+};
+
+template<>
+struct DBRowBinder<DBTuple<> > {
+	static void bind(DBTuple<>&, MYSQL_BIND*, column_data_t*)
+	{
+	}
+
+	static void fetch(DBTuple<>&, const column_data_t*)
+	{
+	}
+};
+
+/*
+ * Statement with rows of a fixed type. Columns are checked against
+ * result metadata when the statement is made, values are fetched
+ * straight into the row and need no conversion afterwards. Columns
+ * are read with row(), not with as*() accessors
+ */
+template<class Row>
+class DBRowStmt : public DBStmt {
+public:
+	DBRowStmt(DBConn &conn, const std::string &stmt)
+		: DBStmt(conn, stmt)
+	{
+		if(m_num_fields != (size_t)Row::size) {
+			std::ostringstream o;
+
+			o << "Statement returns " << m_num_fields << " columns, row has " << (size_t)Row::size;
+
+			throw db_exception(o.str(), "prepare");
+		}
+
+		memcpy(m_row_bind, m_bind_out, sizeof(m_row_bind));
+
+		DBRowBinder<Row>::bind(m_row, m_row_bind, m_column_data);
+
+		m_bind_result = m_row_bind;
+	}
+
+	bool fetch()
+	{
+		if(!DBStmt::fetch()) {
+			return false;
+		}
+
+		DBRowBinder<Row>::fetch(m_row, m_column_data);
+
+		return true;
+	}
+
+	const Row &row() const {
+		return m_row;
+	}
+
+private:
+	Row m_row;
+	MYSQL_BIND m_row_bind[Row::size];
+};
+
+#endif //_DB_ROW_H_
@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+/*
+ * Runs all test suites registered in the test objects. Tests need a
+ * MySQL server and fail without one unless DB_TEST_SKIP is set
+ */
+int main(int argc, char **argv)
+{
+    if(getenv("DB_TEST_SKIP") != 0) {
+        printf("SKIPPED: DB_TEST_SKIP is set, no tests run\n");
+        return 0;
+    }
+
+    CppUnit::TextUi::TestRunner runner;
+
+    runner.addTest(CppUnit::TestFactoryRegistry::getRegistry().makeTest());
+
+    return runner.run() ? 0 : 1;
+}
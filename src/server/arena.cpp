@@ -0,0 +1,110 @@
+
+#include <string.h>
+
+#include "arena.h"
+
+namespace fp {
+
+arena::arena(size_t _chunk_size, size_t _max_retained)
+    : first(0)
+    , current(0)
+    , pos(0)
+    , end(0)
+    , chunk_size(_chunk_size)
+    , max_retained(_max_retained)
+{
+}
+
+arena::~arena()
+{
+    chunk *c = first;
+
+    while(c != 0) {
+        chunk *next = c->next;
+        delete [] reinterpret_cast<char*>(c);
+        c = next;
+    }
+}
+
+void arena::use_chunk(chunk *c)
+{
+    current = c;
+    pos = reinterpret_cast<char*>(c) + header_size;
+    end = reinterpret_cast<char*>(c) + c->size;
+}
+
+void *arena::alloc_slow(size_t _size)
+{
+    /*
+     * Try chunks retained from previous use
+     */
+    while(current != 0 && current->next != 0) {
+        use_chunk(current->next);
+
+        if(_size <= (size_t)(end - pos)) {
+            void *p = pos;
+            pos += _size;
+            return p;
+        }
+    }
+
+    size_t size = header_size + (_size > chunk_size ? _size : chunk_size);
+    chunk *c = reinterpret_cast<chunk*>(new char[size]);
+
+    c->next = 0;
+    c->size = size;
+
+    if(current != 0) {
+        current->next = c;
+    }
+    else {
+        first = c;
+    }
+
+    use_chunk(c);
+
+    void *p = pos;
+    pos += _size;
+    return p;
+}
+
+char *arena::dup(const char *_s, size_t _len)
+{
+    char *p = static_cast<char*>(alloc(_len + 1));
+
+    memcpy(p, _s, _len);
+    p[_len] = '\0';
+
+    return p;
+}
+
+void arena::reset()
+{
+    size_t retained = 0;
+    chunk **c = &first;
+
+    /*
+     * Keep chunks up to max_retained bytes, release the rest
+     */
+    while(*c != 0) {
+        if(retained + (*c)->size > max_retained && retained != 0) {
+            chunk *to_free = *c;
+            *c = to_free->next;
+            delete [] reinterpret_cast<char*>(to_free);
+            continue;
+        }
+
+        retained += (*c)->size;
+        c = &(*c)->next;
+    }
+
+    if(first != 0) {
+        use_chunk(first);
+    }
+    else {
+        current = 0;
+        pos = end = 0;
+    }
+}
+
+};
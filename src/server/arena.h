@@ -0,0 +1,144 @@
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <string>
+#include <new>
+
+#include <stddef.h>
+
+namespace fp {
+
+/*
+ * Bump allocator. Memory is allocated from chunks and released all at
+ * once by reset(). Chunks up to max_retained bytes are kept for reuse
+ * after reset, so a worker thread that resets its arena after each
+ * request does not call malloc in steady state
+ */
+class arena {
+public:
+    arena(size_t _chunk_size = 16384, size_t _max_retained = 256 * 1024);
+    ~arena();
+
+    void *alloc(size_t _size) {
+        size_t size = (_size + alignment - 1) & ~(alignment - 1);
+
+        if(size > (size_t)(end - pos)) {
+            return alloc_slow(size);
+        }
+
+        void *p = pos;
+        pos += size;
+        return p;
+    }
+
+    /*
+     * Copy string into the arena and terminate it by '\0'
+     */
+    char *dup(const char *_s, size_t _len);
+
+    /*
+     * Release all allocations
+     */
+    void reset();
+
+private:
+    struct chunk {
+        chunk   *next;
+        size_t  size;
+    };
+
+    static const size_t alignment = 2 * sizeof(void*);
+    static const size_t header_size = (sizeof(chunk) + alignment - 1) & ~(alignment - 1);
+
+    void *alloc_slow(size_t _size);
+    void use_chunk(chunk *c);
+
+    arena(const arena&);
+    arena &operator=(const arena&);
+
+private:
+    chunk       *first;
+    chunk       *current;
+    char        *pos;
+    char        *end;
+    size_t      chunk_size;
+    size_t      max_retained;
+};
+
+/*
+ * STL allocator that takes memory from an arena. Deallocation is a no-op,
+ * containers using it must be destroyed or cleared before the arena is reset
+ */
+template<class T>
+class arena_allocator {
+public:
+    typedef T           value_type;
+    typedef T           *pointer;
+    typedef const T     *const_pointer;
+    typedef T           &reference;
+    typedef const T     &const_reference;
+    typedef size_t      size_type;
+    typedef ptrdiff_t   difference_type;
+
+    template<class U>
+    struct rebind {
+        typedef arena_allocator<U> other;
+    };
+
+    arena_allocator(arena &_arena)
+        : m_arena(&_arena)
+    {
+    }
+
+    template<class U>
+    arena_allocator(const arena_allocator<U> &_other)
+        : m_arena(_other.get_arena())
+    {
+    }
+
+    pointer allocate(size_type n, const void* = 0) {
+        return static_cast<pointer>(m_arena->alloc(n * sizeof(T)));
+    }
+
+    void deallocate(pointer, size_type) {
+    }
+
+    void construct(pointer p, const T &value) {
+        new((void*)p) T(value);
+    }
+
+    void destroy(pointer p) {
+        p->~T();
+    }
+
+    size_type max_size() const {
+        return (size_type)-1 / sizeof(T);
+    }
+
+    pointer address(reference r) const { return &r; }
+    const_pointer address(const_reference r) const { return &r; }
+
+    arena *get_arena() const { return m_arena; }
+
+private:
+    arena       *m_arena;
+};
+
+template<class T, class U>
+inline bool operator==(const arena_allocator<T> &a, const arena_allocator<U> &b)
+{
+    return a.get_arena() == b.get_arena();
+}
+
+template<class T, class U>
+inline bool operator!=(const arena_allocator<T> &a, const arena_allocator<U> &b)
+{
+    return a.get_arena() != b.get_arena();
+}
+
+typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char> > arena_string;
+
+};
+
+#endif //_ARENA_H_
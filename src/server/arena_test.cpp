@@ -0,0 +1,72 @@
+#include <string.h>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "arena.h"
+
+using namespace fp;
+
+/*
+ * Allocation from chunks, and reuse of retained chunks after reset
+ */
+class arena_test : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(arena_test);
+    CPPUNIT_TEST(test_alignment);
+    CPPUNIT_TEST(test_dup);
+    CPPUNIT_TEST(test_large_alloc);
+    CPPUNIT_TEST(test_reset);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void test_alignment()
+    {
+        arena a(256);
+
+        for(size_t size = 1 ; size != 100 ; size++) {
+            CPPUNIT_ASSERT_EQUAL((size_t)0, (size_t)a.alloc(size) % (2 * sizeof(void*)));
+        }
+    }
+
+    void test_dup()
+    {
+        arena a;
+        char *s = a.dup("value", 3);
+
+        CPPUNIT_ASSERT_EQUAL(std::string("val"), std::string(s));
+    }
+
+    void test_large_alloc()
+    {
+        arena a(256);
+
+        /*
+         * Allocations over the chunk size get a chunk of their own
+         */
+        char *p = static_cast<char*>(a.alloc(10000));
+
+        memset(p, 'x', 10000);
+
+        char *q = static_cast<char*>(a.alloc(16));
+
+        CPPUNIT_ASSERT(q < p || q >= p + 10000);
+    }
+
+    void test_reset()
+    {
+        arena a(256, 1024);
+        void *first = a.alloc(16);
+
+        for(int i = 0 ; i != 100 ; i++) {
+            a.alloc(100);
+        }
+
+        a.reset();
+
+        /*
+         * Retained chunks are reused from the first one
+         */
+        CPPUNIT_ASSERT(a.alloc(16) == first);
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(arena_test);
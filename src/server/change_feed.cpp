@@ -0,0 +1,456 @@
+#include <errno.h>
+#include <time.h>
+
+#include <logger/logger.h>
+#include <db/db_pool.h>
+#include <db/db_row.h>
+
+#include "fcgi_cache.h"
+#include "shm_cache.h"
+
+#include "change_feed.h"
+
+namespace fp {
+
+change_feed::change_feed()
+    : poll_interval(5)
+    , thread_running(false)
+    , exiting(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wakeup, NULL);
+}
+
+change_feed::~change_feed()
+{
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&lock);
+}
+
+void change_feed::init()
+{
+    if(pthread_create(&thread, NULL, change_feed::poll_thread_starter, (void*)this) != 0) {
+        LogError("cannot create change feed thread: " << errno);
+        return;
+    }
+
+    thread_running = true;
+}
+
+void change_feed::shutdown()
+{
+    void *return_value;
+
+    if(!thread_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    exiting = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, &return_value);
+
+    thread_running = false;
+}
+
+/*
+ * Options hold site settings, title, widgets and such, which affect every
+ * page. CHECKSUM TABLE is cheap on a table of this size
+ */
+void change_feed::poll_options(DBConn &conn, site &_site, change_set &changes)
+{
+    /*
+     * Only options pages are rendered from. Transients, cron and the
+     * like are rewritten all the time and must not flush the caches.
+     * Rows are looked up by the option_name key
+     */
+    DBStmt stmt(conn, "select count(*), sum(crc32(concat(option_name, '=', option_value))) from wp_options"
+        " where option_name in ('home', 'siteurl', 'blogname', 'blogdescription', 'posts_per_page',"
+        " 'permalink_structure', 'category_base', 'tag_base', 'show_on_front', 'page_on_front',"
+        " 'page_for_posts', 'date_format', 'time_format', 'template', 'stylesheet', 'sidebars_widgets')"
+        " or option_name like 'widget\\_%' or option_name like 'theme\\_mods\\_%'");
+
+    stmt.execute();
+
+    while(stmt.fetch()) {
+        std::string checksum(stmt.asString(0) + ":" + (stmt.is_null(1) ? "" : stmt.asString(1)));
+
+        if(checksum != _site.options_checksum) {
+            _site.options_checksum = checksum;
+            changes.site = true;
+        }
+    }
+}
+
+void change_feed::poll_posts(DBConn &conn, site &_site, change_set &changes)
+{
+    if(!_site.primed) {
+        DBStmt stmt(conn, "select max(post_modified_gmt) from wp_posts");
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            if(!stmt.is_null(0)) {
+                _site.watermark = stmt.asString(0);
+            }
+        }
+
+        return;
+    }
+
+    std::vector<unsigned long> changed_posts;
+    std::string watermark(_site.watermark);
+    std::set<unsigned long> watermark_posts;
+
+    {
+        /*
+         * Watermark is inclusive, so that posts modified within the same
+         * second after the previous poll are not lost. Posts already seen
+         * at the watermark are skipped
+         */
+        DBRowStmt<DBTuple<long long, string_ref, string_ref, DBTimestamp, string_ref, string_ref> > stmt(conn,
+            "select p.ID, p.post_name, p.post_type, p.post_modified_gmt, u.user_login, p.post_status"
+            " from wp_posts p left join wp_users u on p.post_author=u.ID where p.post_modified_gmt >= ?"
+            " and p.post_type != 'revision' order by p.post_modified_gmt");
+
+        stmt.bindString(0, _site.watermark);
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            unsigned long id = stmt.row().get<0>();
+            std::string modified_dt(stmt.row().get<3>().str());
+
+            if(modified_dt > watermark) {
+                watermark = modified_dt;
+                watermark_posts.clear();
+            }
+
+            watermark_posts.insert(id);
+
+            if(modified_dt == _site.watermark && _site.watermark_posts.count(id) != 0) {
+                continue;
+            }
+
+            const string_ref &post_type = stmt.row().get<2>();
+
+            changed_posts.push_back(id);
+
+            if(stmt.row().get<5>() == "publish") {
+                _site.published.insert(id);
+            }
+            else {
+                _site.published.erase(id);
+            }
+
+            if(!stmt.row().get<1>().empty()) {
+                changes.posts.insert(stmt.row().get<1>());
+            }
+
+            /*
+             * Posts are listed on the front page and author archives
+             */
+            if(post_type == "post") {
+                changes.front_page = true;
+
+                if(!stmt.row().get<4>().empty()) {
+                    changes.authors.insert(stmt.row().get<4>());
+                }
+            }
+        }
+    }
+
+    _site.watermark = watermark;
+    _site.watermark_posts.swap(watermark_posts);
+
+    if(changed_posts.empty()) {
+        return;
+    }
+
+    /*
+     * Archives the post belongs to now. Archives it was removed from
+     * are found by their term counts
+     */
+    DBRowStmt<DBTuple<std::string, std::string> > stmt(conn,
+        "select tt.taxonomy, ts.slug from wp_terms ts, wp_term_taxonomy tt, wp_term_relationships tr"
+        " where tr.object_id=? and tt.term_id=ts.term_id and tt.term_taxonomy_id = tr.term_taxonomy_id");
+
+    long long id;
+
+    stmt.bindInt64(0, id);
+
+    for(std::vector<unsigned long>::const_iterator i = changed_posts.begin() ; i != changed_posts.end() ; i++) {
+        id = *i;
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            changes.terms.insert(change_term(stmt.row().get<0>(), stmt.row().get<1>()));
+        }
+    }
+}
+
+/*
+ * Deleted posts leave no trace in post_modified_gmt. Published posts are
+ * counted and compared with the IDs known to be published, which
+ * poll_posts keeps up to date. IDs are only reloaded when the numbers
+ * differ. A post that is gone from the table flushes the site, as its
+ * name and archives are not known anymore. One that was unpublished
+ * meanwhile is found by the next poll_posts
+ */
+void change_feed::poll_deleted(DBConn &conn, site &_site, change_set &changes)
+{
+    size_t count = 0;
+
+    {
+        DBStmt stmt(conn, "select count(*) from wp_posts where post_status='publish' and post_type != 'revision'");
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            count = stmt.asInt64(0);
+        }
+    }
+
+    if(_site.primed && count == _site.published.size()) {
+        return;
+    }
+
+    std::set<unsigned long> published;
+
+    {
+        DBRowStmt<DBTuple<long long> > stmt(conn,
+            "select ID from wp_posts where post_status='publish' and post_type != 'revision'");
+
+        stmt.setPrefetch(true);
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            published.insert(stmt.row().get<0>());
+        }
+    }
+
+    if(_site.primed) {
+        DBRowStmt<DBTuple<long long> > stmt(conn, "select count(*) from wp_posts where ID=?");
+        long long id;
+
+        stmt.bindInt64(0, id);
+
+        std::set<unsigned long>::const_iterator i;
+
+        for(i = _site.published.begin() ; i != _site.published.end() && !changes.site ; i++) {
+            if(published.count(*i) != 0) {
+                continue;
+            }
+
+            id = *i;
+
+            stmt.execute();
+
+            while(stmt.fetch()) {
+                if(stmt.row().get<0>() == 0) {
+                    changes.site = true;
+                }
+            }
+        }
+    }
+
+    _site.published.swap(published);
+}
+
+/*
+ * Terms are only fetched when their checksum changes
+ */
+void change_feed::poll_terms(DBConn &conn, site &_site, change_set &changes)
+{
+    std::string checksum;
+
+    {
+        DBStmt stmt(conn, "select count(*), sum(crc32(concat_ws(':', tt.term_taxonomy_id, tt.taxonomy, ts.slug,"
+            " tt.count))) from wp_terms ts, wp_term_taxonomy tt where tt.term_id=ts.term_id");
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            checksum = stmt.asString(0) + ":" + (stmt.is_null(1) ? "" : stmt.asString(1));
+        }
+    }
+
+    if(checksum == _site.terms_checksum) {
+        return;
+    }
+
+    DBRowStmt<DBTuple<long long, std::string, std::string, int> > stmt(conn,
+        "select tt.term_taxonomy_id, tt.taxonomy, ts.slug, tt.count from wp_terms ts, wp_term_taxonomy tt"
+        " where tt.term_id=ts.term_id");
+
+    stmt.setPrefetch(true);
+
+    stmt.execute();
+
+    TermContainer terms;
+
+    while(stmt.fetch()) {
+        unsigned long term_id = stmt.row().get<0>();
+        term_state &state = terms[term_id];
+
+        state.term.first = stmt.row().get<1>();
+        state.term.second = stmt.row().get<2>();
+        state.count = stmt.row().get<3>();
+
+        TermContainer::iterator i = _site.terms.find(term_id);
+
+        if(i == _site.terms.end()) {
+            changes.terms.insert(state.term);
+            continue;
+        }
+
+        if(i->second.count != state.count || i->second.term != state.term) {
+            changes.terms.insert(i->second.term);
+            changes.terms.insert(state.term);
+        }
+
+        _site.terms.erase(i);
+    }
+
+    /*
+     * Whatever is left was deleted
+     */
+    for(TermContainer::const_iterator i = _site.terms.begin() ; i != _site.terms.end() ; i++) {
+        changes.terms.insert(i->second.term);
+    }
+
+    _site.terms.swap(terms);
+    _site.terms_checksum = checksum;
+}
+
+void change_feed::poll_site(const std::string &hostname, site &_site)
+{
+    change_set changes;
+
+    {
+        DBConnHolder conn(*_site.pool);
+
+        poll_options(conn.get(), _site, changes);
+        poll_posts(conn.get(), _site, changes);
+        poll_deleted(conn.get(), _site, changes);
+        poll_terms(conn.get(), _site, changes);
+    }
+
+    if(!_site.primed) {
+        _site.primed = true;
+        return;
+    }
+
+    if(changes.empty()) {
+        return;
+    }
+
+    LogInfo("change_feed::poll_site " << hostname << ": " << changes.posts.size() << " posts, "
+        << changes.authors.size() << " authors, " << changes.terms.size() << " terms"
+        << (changes.site ? ", whole site" : ""));
+
+    for(ListenerContainer::const_iterator i = listeners.begin() ; i != listeners.end() ; i++) {
+        (*i)->changed(hostname, changes);
+    }
+}
+
+void change_feed::poll_all()
+{
+    for(SiteContainer::iterator i = sites.begin() ; i != sites.end() ; i++) {
+        try {
+            poll_site(i->first, i->second);
+        }
+        catch(const db_exception &e) {
+            LogError("change_feed::poll_all DB error: " << i->first << ": " << e.what());
+        }
+    }
+}
+
+void *change_feed::poll_thread_starter(void *arg) {
+    static_cast<change_feed*>(arg)->poll_thread();
+    return NULL;
+}
+
+void change_feed::poll_thread()
+{
+    pthread_mutex_lock(&lock);
+
+    while(!exiting) {
+        pthread_mutex_unlock(&lock);
+
+        poll_all();
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += poll_interval;
+
+        pthread_mutex_lock(&lock);
+
+        while(!exiting) {
+            if(pthread_cond_timedwait(&wakeup, &lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Pages are cached under the path they were requested with,
+ * archives are linked with a trailing slash
+ */
+static void add_page(std::vector<std::string> &paths, const std::string &path)
+{
+    paths.push_back(path);
+    paths.push_back(path + "/");
+}
+
+void page_cache_invalidator::changed(const std::string &_hostname, const change_set &_changes)
+{
+    if(_changes.site) {
+        if(cache != 0) {
+            cache->clear();
+        }
+
+        if(shared_cache != 0) {
+            shared_cache->clear();
+        }
+
+        return;
+    }
+
+    std::vector<std::string> paths;
+
+    if(_changes.front_page) {
+        paths.push_back("/");
+    }
+
+    for(std::set<std::string>::const_iterator i = _changes.posts.begin() ; i != _changes.posts.end() ; i++) {
+        add_page(paths, "/" + *i);
+    }
+
+    for(std::set<std::string>::const_iterator i = _changes.authors.begin() ; i != _changes.authors.end() ; i++) {
+        add_page(paths, "/author/" + *i);
+    }
+
+    for(std::set<change_term>::const_iterator i = _changes.terms.begin() ; i != _changes.terms.end() ; i++) {
+        add_page(paths, "/" + (i->first == "post_tag" ? std::string("tag") : i->first) + "/" + i->second);
+    }
+
+    if(cache != 0) {
+        for(std::vector<std::string>::const_iterator i = paths.begin() ; i != paths.end() ; i++) {
+            cache->invalidate(_hostname, *i);
+        }
+    }
+
+    if(shared_cache != 0) {
+        shared_cache->invalidate(_hostname, paths);
+    }
+}
+
+};
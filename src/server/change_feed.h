@@ -0,0 +1,167 @@
+
+#ifndef _CHANGE_FEED_H_
+#define _CHANGE_FEED_H_
+
+#include <string>
+#include <set>
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+
+#include <db/db_pool.h>
+
+namespace fp {
+
+class fcgi_cache;
+class shm_cache;
+
+/*
+ * Term identified by taxonomy and slug
+ */
+typedef std::pair<std::string, std::string> change_term;
+
+/*
+ * Content of a site changed since the previous poll
+ */
+struct change_set {
+    change_set()
+        : front_page(false)
+        , site(false)
+    {
+    }
+
+    bool empty() const {
+        return posts.empty() && authors.empty() && terms.empty() && !front_page && !site;
+    }
+
+    std::set<std::string>   posts;      // post_name of modified posts
+    std::set<std::string>   authors;    // user_login of their authors
+    std::set<change_term>   terms;      // archives that changed
+    bool                    front_page;
+    bool                    site;       // options changed or posts were deleted, every page is affected
+};
+
+/*
+ * Receives changes found by the change feed. Called from the feed thread
+ */
+class change_listener {
+public:
+    virtual ~change_listener() {}
+
+    virtual void changed(const std::string &_hostname, const change_set &_changes) = 0;
+};
+
+/*
+ * Background thread that polls watermarks of sites: the latest
+ * post_modified_gmt, checksums of the options pages are rendered from
+ * and of terms with their counts, and the number of published posts,
+ * and notifies listeners of what changed, so that cached pages can be
+ * invalidated precisely soon after an edit
+ */
+class change_feed {
+    struct term_state {
+        change_term     term;
+        unsigned long   count;
+    };
+
+    typedef std::map<unsigned long, term_state> TermContainer;
+
+    struct site {
+        site(DBPool &_pool)
+            : pool(&_pool)
+            , primed(false)
+            , watermark("0000-00-00 00:00:00")
+        {
+        }
+
+        DBPool                  *pool;
+
+        /*
+         * Watermarks are taken by the first poll, which reports no changes
+         */
+        bool                    primed;
+
+        std::string             watermark;
+        std::set<unsigned long> watermark_posts;    // posts seen at watermark
+        std::string             options_checksum;
+        std::string             terms_checksum;
+        TermContainer           terms;
+
+        /*
+         * IDs of published posts, to tell deleted posts by their count
+         */
+        std::set<unsigned long> published;
+    };
+
+    typedef std::map<std::string, site> SiteContainer;
+    typedef std::vector<change_listener*> ListenerContainer;
+public:
+    change_feed();
+    ~change_feed();
+
+    void add_site(const std::string &hostname, DBPool &pool)
+    {
+        sites.insert(std::make_pair(hostname, site(pool)));
+    }
+
+    void add_listener(change_listener *_listener)
+    {
+        listeners.push_back(_listener);
+    }
+
+    /*
+     * Set interval between polls in seconds
+     */
+    void set_poll_interval(unsigned _poll_interval)
+    {
+        poll_interval = _poll_interval;
+    }
+
+    void init();
+    void shutdown();
+
+private:
+    void poll_options(DBConn&, site&, change_set&);
+    void poll_posts(DBConn&, site&, change_set&);
+    void poll_deleted(DBConn&, site&, change_set&);
+    void poll_terms(DBConn&, site&, change_set&);
+    void poll_site(const std::string&, site&);
+
+    void poll_all();
+    void poll_thread();
+    static void *poll_thread_starter(void*);
+
+    SiteContainer sites;
+    ListenerContainer listeners;
+
+    unsigned poll_interval;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool thread_running;
+    bool exiting;
+};
+
+/*
+ * Removes changed pages from response caches
+ */
+class page_cache_invalidator : public change_listener {
+public:
+    page_cache_invalidator(fcgi_cache *_cache, shm_cache *_shared_cache)
+        : cache(_cache)
+        , shared_cache(_shared_cache)
+    {
+    }
+
+    virtual void changed(const std::string &_hostname, const change_set &_changes);
+
+private:
+    fcgi_cache *cache;
+    shm_cache *shared_cache;
+};
+
+};
+
+#endif //_CHANGE_FEED_H_
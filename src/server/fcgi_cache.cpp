@@ -0,0 +1,472 @@
+
+#include <algorithm>
+#include <vector>
+
+#include <errno.h>
+#include <sys/time.h>
+
+#include "fcgi_handler.h"
+#include "fcgi_cache.h"
+
+namespace fp {
+
+/*
+ * Approximate memory used by an entry besides its key and data
+ */
+#define CACHE_ENTRY_OVERHEAD 128
+
+#define CACHE_DEFAULT_STALE_TIME 60
+#define CACHE_DEFAULT_WAIT_TIMEOUT 5000
+
+fcgi_cache::fcgi_cache(size_t _max_bytes, unsigned _num_shards)
+    : shards(new shard[_num_shards])
+    , num_shards(_num_shards)
+    , max_shard_bytes(_max_bytes / _num_shards)
+    , max_entry_size(_max_bytes / _num_shards / 4)
+    , stale_time(CACHE_DEFAULT_STALE_TIME)
+    , wait_timeout(CACHE_DEFAULT_WAIT_TIMEOUT)
+    , hits(0)
+    , misses(0)
+    , inserts(0)
+    , evictions(0)
+    , stale_hits(0)
+    , coalesced(0)
+    , timeouts(0)
+{
+    for(unsigned i = 0 ; i != num_shards ; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+        pthread_mutex_init(&shards[i].flight_lock, NULL);
+        shards[i].bytes = 0;
+    }
+}
+
+fcgi_cache::~fcgi_cache()
+{
+    clear();
+
+    for(unsigned i = 0 ; i != num_shards ; i++) {
+        pthread_rwlock_destroy(&shards[i].lock);
+        pthread_mutex_destroy(&shards[i].flight_lock);
+    }
+
+    delete [] shards;
+}
+
+void fcgi_cache::make_key(const fcgi_request &_request, std::string &_key)
+{
+    string_ref query = _request.get_fcgi_param("QUERY_STRING");
+    std::vector<string_ref> args;
+    size_t pos = 0;
+
+    while(pos < query.size()) {
+        size_t delim = query.find('&', pos);
+
+        if(delim == string_ref::npos) {
+            delim = query.size();
+        }
+
+        if(delim != pos) {
+            args.push_back(query.substr(pos, delim - pos));
+        }
+
+        pos = delim + 1;
+    }
+
+    std::sort(args.begin(), args.end());
+
+    string_ref host = _request.get_fcgi_param("SERVER_NAME");
+    string_ref path = _request.get_script_name();
+
+    _key.assign(host.data(), host.size());
+    _key.append(path.data(), path.size());
+    _key.append(1, '?');
+
+    for(std::vector<string_ref>::const_iterator i = args.begin() ; i != args.end() ; i++) {
+        if(i != args.begin()) {
+            _key.append(1, '&');
+        }
+
+        _key.append(i->data(), i->size());
+    }
+}
+
+/*
+ * Shard is selected by host and path, so that all variants of
+ * a page can be invalidated at once
+ */
+fcgi_cache::shard &fcgi_cache::get_shard(const string_ref &_host_path)
+{
+    unsigned hash = 2166136261u;
+
+    for(string_ref::const_iterator p = _host_path.begin() ; p != _host_path.end() ; p++) {
+        hash ^= (u_char)*p;
+        hash *= 16777619u;
+    }
+
+    return shards[hash % num_shards];
+}
+
+fcgi_cache::shard &fcgi_cache::get_shard_by_key(const std::string &_key)
+{
+    string_ref key(_key);
+
+    return get_shard(key.substr(0, key.find('?')));
+}
+
+size_t fcgi_cache::entry_size(const fcgi_cache_entry *_entry)
+{
+    return _entry->key.size() + _entry->data.size() + CACHE_ENTRY_OVERHEAD;
+}
+
+/*
+ * Find entry that is fresh or can still be served stale
+ */
+fcgi_cache_entry *fcgi_cache::find(shard &_shard, const std::string &_key, bool &_stale)
+{
+    fcgi_cache_entry *entry = 0;
+    time_t now = time(NULL);
+
+    pthread_rwlock_rdlock(&_shard.lock);
+
+    entry_map_t::const_iterator i = _shard.entries.find(_key);
+
+    if(i != _shard.entries.end() && i->second->expires + (time_t)stale_time > now) {
+        entry = i->second;
+        entry->ref();
+
+        __atomic_store_n(&entry->referenced, true, __ATOMIC_RELAXED);
+
+        _stale = entry->expires <= now;
+    }
+
+    pthread_rwlock_unlock(&_shard.lock);
+
+    return entry;
+}
+
+fcgi_cache_entry *fcgi_cache::lookup(const std::string &_key, bool &_leader)
+{
+    shard &s = get_shard_by_key(_key);
+    bool stale = false;
+
+    _leader = false;
+
+    fcgi_cache_entry *entry = find(s, _key, stale);
+
+    if(entry != 0 && !stale) {
+        __sync_add_and_fetch(&hits, 1);
+        return entry;
+    }
+
+    pthread_mutex_lock(&s.flight_lock);
+
+    flight_map_t::iterator i = s.flights.find(_key);
+
+    if(i != s.flights.end()) {
+        if(entry != 0) {
+            /*
+             * Somebody is refreshing the entry, serve the stale one
+             */
+            pthread_mutex_unlock(&s.flight_lock);
+            __sync_add_and_fetch(&stale_hits, 1);
+            return entry;
+        }
+
+        entry = wait(s, i->second);
+
+        pthread_mutex_unlock(&s.flight_lock);
+
+        __sync_add_and_fetch(entry != 0 ? &coalesced : &misses, 1);
+        return entry;
+    }
+
+    if(entry != 0) {
+        entry->unref();
+    }
+
+    /*
+     * The leader of previous flight may have completed after the entry
+     * was looked up
+     */
+    entry = find(s, _key, stale);
+
+    if(entry != 0 && !stale) {
+        pthread_mutex_unlock(&s.flight_lock);
+        __sync_add_and_fetch(&hits, 1);
+        return entry;
+    }
+
+    if(entry != 0) {
+        entry->unref();
+    }
+
+    flight *f = new flight;
+
+    pthread_cond_init(&f->done_cond, NULL);
+    f->done = false;
+    f->waiters = 0;
+    f->result = 0;
+
+    s.flights.insert(std::make_pair(_key, f));
+
+    pthread_mutex_unlock(&s.flight_lock);
+
+    _leader = true;
+
+    __sync_add_and_fetch(&misses, 1);
+
+    return 0;
+}
+
+/*
+ * Wait for the leader to complete. Must be called with flight lock held
+ */
+fcgi_cache_entry *fcgi_cache::wait(shard &_shard, flight *_flight)
+{
+    struct timeval now;
+    struct timespec deadline;
+
+    gettimeofday(&now, NULL);
+
+    deadline.tv_sec = now.tv_sec + wait_timeout / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (wait_timeout % 1000) * 1000000;
+
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    _flight->waiters++;
+
+    while(!_flight->done) {
+        if(pthread_cond_timedwait(&_flight->done_cond, &_shard.flight_lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    _flight->waiters--;
+
+    if(!_flight->done) {
+        __sync_add_and_fetch(&timeouts, 1);
+        return 0;
+    }
+
+    fcgi_cache_entry *entry = _flight->result;
+
+    if(entry != 0) {
+        entry->ref();
+    }
+
+    /*
+     * The leader has left, the last waiter cleans up
+     */
+    if(_flight->waiters == 0) {
+        destroy_flight(_flight);
+    }
+
+    return entry;
+}
+
+void fcgi_cache::destroy_flight(flight *_flight)
+{
+    if(_flight->result != 0) {
+        _flight->result->unref();
+    }
+
+    pthread_cond_destroy(&_flight->done_cond);
+
+    delete _flight;
+}
+
+void fcgi_cache::complete(const std::string &_key, std::string *_data, unsigned _ttl)
+{
+    shard &s = get_shard_by_key(_key);
+    fcgi_cache_entry *entry = _data != 0 ? insert_entry(_key, *_data, _ttl) : 0;
+
+    pthread_mutex_lock(&s.flight_lock);
+
+    flight_map_t::iterator i = s.flights.find(_key);
+
+    if(i == s.flights.end()) {
+        pthread_mutex_unlock(&s.flight_lock);
+
+        if(entry != 0) {
+            entry->unref();
+        }
+
+        return;
+    }
+
+    flight *f = i->second;
+
+    s.flights.erase(i);
+
+    f->done = true;
+    f->result = entry;
+
+    if(f->waiters != 0) {
+        pthread_cond_broadcast(&f->done_cond);
+    }
+    else {
+        destroy_flight(f);
+    }
+
+    pthread_mutex_unlock(&s.flight_lock);
+}
+
+/*
+ * Remove entry from shard. Must be called with write lock held
+ */
+void fcgi_cache::remove(shard &_shard, entry_map_t::iterator _i)
+{
+    fcgi_cache_entry *entry = _i->second;
+
+    _shard.bytes -= entry_size(entry);
+    _shard.entries.erase(_i);
+
+    entry->unref();
+}
+
+/*
+ * Free room for _needed bytes. Entries that were looked up since the
+ * previous sweep get a second chance, entries too old to be served stale
+ * go first. Must be called with write lock held
+ */
+void fcgi_cache::evict(shard &_shard, size_t _needed)
+{
+    time_t now = time(NULL);
+    entry_map_t::iterator i = _shard.entries.lower_bound(_shard.hand);
+
+    while(!_shard.entries.empty() && _shard.bytes + _needed > max_shard_bytes) {
+        if(i == _shard.entries.end()) {
+            i = _shard.entries.begin();
+        }
+
+        fcgi_cache_entry *entry = i->second;
+
+        if(entry->referenced && entry->expires + (time_t)stale_time > now) {
+            entry->referenced = false;
+            i++;
+            continue;
+        }
+
+        remove(_shard, i++);
+
+        __sync_add_and_fetch(&evictions, 1);
+    }
+
+    _shard.hand = i != _shard.entries.end() ? i->first : std::string();
+}
+
+void fcgi_cache::insert(const std::string &_key, std::string &_data, unsigned _ttl)
+{
+    fcgi_cache_entry *entry = insert_entry(_key, _data, _ttl);
+
+    if(entry != 0) {
+        entry->unref();
+    }
+}
+
+/*
+ * Add or replace entry
+ *
+ * @return new entry with reference taken for the caller or 0
+ *         if it is too large
+ */
+fcgi_cache_entry *fcgi_cache::insert_entry(const std::string &_key, std::string &_data, unsigned _ttl)
+{
+    if(_key.size() + _data.size() > max_entry_size) {
+        return 0;
+    }
+
+    shard &s = get_shard_by_key(_key);
+    fcgi_cache_entry *entry = new fcgi_cache_entry(_key, _data, time(NULL) + _ttl);
+
+    pthread_rwlock_wrlock(&s.lock);
+
+    entry_map_t::iterator i = s.entries.find(_key);
+
+    if(i != s.entries.end()) {
+        remove(s, i);
+    }
+
+    evict(s, entry_size(entry));
+
+    s.entries.insert(std::make_pair(_key, entry));
+    s.bytes += entry_size(entry);
+
+    entry->ref();
+
+    pthread_rwlock_unlock(&s.lock);
+
+    __sync_add_and_fetch(&inserts, 1);
+
+    return entry;
+}
+
+void fcgi_cache::invalidate(const string_ref &_host, const string_ref &_path)
+{
+    std::string prefix;
+
+    prefix.reserve(_host.size() + _path.size() + 1);
+    prefix.append(_host.data(), _host.size());
+    prefix.append(_path.data(), _path.size());
+
+    shard &s = get_shard(prefix);
+
+    prefix.append(1, '?');
+
+    pthread_rwlock_wrlock(&s.lock);
+
+    entry_map_t::iterator i = s.entries.lower_bound(prefix);
+
+    while(i != s.entries.end() && string_ref(i->first).starts_with(prefix)) {
+        remove(s, i++);
+    }
+
+    pthread_rwlock_unlock(&s.lock);
+}
+
+void fcgi_cache::clear()
+{
+    for(unsigned n = 0 ; n != num_shards ; n++) {
+        shard &s = shards[n];
+
+        pthread_rwlock_wrlock(&s.lock);
+
+        while(!s.entries.empty()) {
+            remove(s, s.entries.begin());
+        }
+
+        pthread_rwlock_unlock(&s.lock);
+    }
+}
+
+fcgi_cache_stats fcgi_cache::get_stats() const
+{
+    fcgi_cache_stats stats;
+
+    stats.entries = 0;
+    stats.bytes = 0;
+
+    for(unsigned n = 0 ; n != num_shards ; n++) {
+        shard &s = shards[n];
+
+        pthread_rwlock_rdlock(&s.lock);
+        stats.entries += s.entries.size();
+        stats.bytes += s.bytes;
+        pthread_rwlock_unlock(&s.lock);
+    }
+
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.inserts = inserts;
+    stats.evictions = evictions;
+    stats.stale_hits = stale_hits;
+    stats.coalesced = coalesced;
+    stats.timeouts = timeouts;
+
+    return stats;
+}
+
+};
@@ -0,0 +1,205 @@
+
+#ifndef _FCGI_CACHE_H_
+#define _FCGI_CACHE_H_
+
+#include <string>
+#include <map>
+
+#include <time.h>
+#include <pthread.h>
+
+#include "string_ref.h"
+
+namespace fp {
+
+class fcgi_request;
+
+/*
+ * Cached response: headers and body exactly as the handler wrote them
+ */
+class fcgi_cache_entry {
+public:
+    fcgi_cache_entry(const std::string &_key, std::string &_data, time_t _expires)
+        : key(_key)
+        , expires(_expires)
+        , referenced(false)
+        , refs(1)
+    {
+        data.swap(_data);
+    }
+
+    void ref() { __sync_add_and_fetch(&refs, 1); }
+
+    void unref() {
+        if(__sync_sub_and_fetch(&refs, 1) == 0) {
+            delete this;
+        }
+    }
+
+    const std::string key;
+    std::string data;
+    const time_t expires;
+
+    /*
+     * Set by lookups, cleared by eviction sweep
+     */
+    bool referenced;
+
+private:
+    volatile int refs;
+};
+
+/*
+ * Cache statistics
+ */
+struct fcgi_cache_stats {
+    size_t entries;
+    size_t bytes;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long inserts;
+    unsigned long evictions;
+    unsigned long stale_hits;       // stale entries served during refresh
+    unsigned long coalesced;        // misses served by waiting for another request
+    unsigned long timeouts;         // waits that gave up
+};
+
+/*
+ * Memory bounded response cache. Entries are spread over shards by host
+ * and path, each shard has its own reader-writer lock, so lookups never
+ * block each other. When a shard runs over its share of the byte limit
+ * entries are evicted in CLOCK order, which approximates LRU without
+ * touching shared state on lookup.
+ *
+ * Concurrent misses of the same key are coalesced: one request produces
+ * the response, the others wait for it. Expired entries are kept for
+ * a while and served to other requests while one request refreshes them
+ */
+class fcgi_cache {
+public:
+    fcgi_cache(size_t _max_bytes, unsigned _num_shards = 16);
+    ~fcgi_cache();
+
+    /*
+     * Build cache key of a request: host, path and query arguments
+     * in sorted order
+     */
+    static void make_key(const fcgi_request &_request, std::string &_key);
+
+    /*
+     * Set how long expired entries are served while being refreshed
+     */
+    void set_stale_time(unsigned _stale_time) { stale_time = _stale_time; }
+
+    /*
+     * Set how long a request waits for another request producing
+     * the same response, in milliseconds
+     */
+    void set_wait_timeout(unsigned _wait_timeout) { wait_timeout = _wait_timeout; }
+
+    /*
+     * Find entry. If there is no fresh entry and no other request is
+     * producing it, _leader is set and the caller must produce the response
+     * and pass it to complete(). If another request is producing it, a stale
+     * entry is returned if there is one, otherwise the call waits for the
+     * other request. If waiting times out or the other request produced
+     * nothing cacheable, 0 is returned with _leader unset and the caller
+     * produces the response on its own
+     *
+     * @return entry with reference taken or 0. Caller releases the
+     *         reference by calling unref()
+     */
+    fcgi_cache_entry *lookup(const std::string &_key, bool &_leader);
+
+    /*
+     * Finish producing response as a leader, store it and wake up waiting
+     * requests. _data is 0 if the response cannot be cached
+     */
+    void complete(const std::string &_key, std::string *_data, unsigned _ttl);
+
+    /*
+     * Add or replace entry. Data is moved into the entry
+     */
+    void insert(const std::string &_key, std::string &_data, unsigned _ttl);
+
+    /*
+     * Remove entries of a page for all query arguments
+     */
+    void invalidate(const string_ref &_host, const string_ref &_path);
+
+    /*
+     * Remove all entries
+     */
+    void clear();
+
+    /*
+     * Largest response that can be cached
+     */
+    size_t get_max_entry_size() const { return max_entry_size; }
+
+    fcgi_cache_stats get_stats() const;
+
+private:
+    typedef std::map<std::string, fcgi_cache_entry*> entry_map_t;
+
+    /*
+     * Response being produced by a leader
+     */
+    struct flight {
+        pthread_cond_t      done_cond;
+        bool                done;
+        unsigned            waiters;
+        fcgi_cache_entry    *result;
+    };
+
+    typedef std::map<std::string, flight*> flight_map_t;
+
+    struct shard {
+        pthread_rwlock_t    lock;
+        entry_map_t         entries;
+        size_t              bytes;
+
+        /*
+         * Key the eviction sweep continues from
+         */
+        std::string         hand;
+
+        pthread_mutex_t     flight_lock;
+        flight_map_t        flights;
+    };
+
+    shard &get_shard(const string_ref &_host_path);
+    shard &get_shard_by_key(const std::string &_key);
+    static size_t entry_size(const fcgi_cache_entry *_entry);
+
+    fcgi_cache_entry *find(shard &_shard, const std::string &_key, bool &_stale);
+    fcgi_cache_entry *wait(shard &_shard, flight *_flight);
+    fcgi_cache_entry *insert_entry(const std::string &_key, std::string &_data, unsigned _ttl);
+    static void destroy_flight(flight *_flight);
+
+    void remove(shard &_shard, entry_map_t::iterator _i);
+    void evict(shard &_shard, size_t _needed);
+
+    fcgi_cache(const fcgi_cache&);
+    fcgi_cache &operator=(const fcgi_cache&);
+
+private:
+    shard *shards;
+    unsigned num_shards;
+    size_t max_shard_bytes;
+    size_t max_entry_size;
+    unsigned stale_time;
+    unsigned wait_timeout;
+
+    volatile unsigned long hits;
+    volatile unsigned long misses;
+    volatile unsigned long inserts;
+    volatile unsigned long evictions;
+    volatile unsigned long stale_hits;
+    volatile unsigned long coalesced;
+    volatile unsigned long timeouts;
+};
+
+};
+
+#endif //_FCGI_CACHE_H_
@@ -0,0 +1,562 @@
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sstream>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <logger/logger.h>
+
+#include "spool.h"
+#include "fcgi_connection.h"
+
+namespace fp {
+
+fcgi_request_data::~fcgi_request_data()
+{
+    if(stdin_fd != -1) {
+        ::close(stdin_fd);
+    }
+}
+
+fcgi_connection::fcgi_connection(int _fd, int _epoll_fd, const fcgi_values &_values)
+    : fd(_fd)
+    , epoll_fd(_epoll_fd)
+    , refs(1)
+    , values(_values)
+    , in_buf(new u_char[in_buffer_size])
+    , in_start(0)
+    , in_end(0)
+    , out_queue()
+    , out_pos(0)
+    , out_pending(0)
+    , events(EPOLLIN)
+    , receiving()
+    , active()
+    , dead(false)
+    , close_when_drained(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&drained, NULL);
+}
+
+fcgi_connection::~fcgi_connection()
+{
+    ::close(fd);
+
+    for(request_map_t::iterator i = receiving.begin() ; i != receiving.end() ; i++) {
+        delete i->second;
+    }
+
+    delete [] in_buf;
+
+    pthread_cond_destroy(&drained);
+    pthread_mutex_destroy(&lock);
+}
+
+void fcgi_connection::ref()
+{
+    __sync_add_and_fetch(&refs, 1);
+}
+
+void fcgi_connection::unref()
+{
+    if(__sync_sub_and_fetch(&refs, 1) == 0) {
+        delete this;
+    }
+}
+
+bool fcgi_connection::on_readable(request_list_t &_completed)
+{
+    for(;;) {
+        if(in_start != 0) {
+            memmove(in_buf, in_buf + in_start, in_end - in_start);
+            in_end -= in_start;
+            in_start = 0;
+        }
+
+        ssize_t n = ::read(fd, in_buf + in_end, in_buffer_size - in_end);
+
+        if(n == 0) {
+            return false;
+        }
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        in_end += n;
+
+        pthread_mutex_lock(&lock);
+        bool ok = process_records(_completed);
+        pthread_mutex_unlock(&lock);
+
+        if(!ok) {
+            return false;
+        }
+
+        if(in_end != in_buffer_size) {
+            return true;
+        }
+    }
+}
+
+bool fcgi_connection::process_records(request_list_t &_completed)
+{
+    fcgi_record_header h;
+
+    while(in_end - in_start >= FCGI_HEADER_LEN) {
+        if(!fcgi_decode_header(in_buf + in_start, h)) {
+            LogError("fcgi_connection: unsupported protocol version");
+            return false;
+        }
+
+        size_t record_len = FCGI_HEADER_LEN + h.content_length + h.padding_length;
+
+        if(in_end - in_start < record_len) {
+            break;
+        }
+
+        if(!process_record(h, in_buf + in_start + FCGI_HEADER_LEN, _completed)) {
+            return false;
+        }
+
+        in_start += record_len;
+    }
+
+    if(in_start == in_end) {
+        in_start = in_end = 0;
+    }
+
+    return true;
+}
+
+bool fcgi_connection::process_record(const fcgi_record_header &h, const u_char *content, request_list_t &_completed)
+{
+    const char *data = reinterpret_cast<const char*>(content);
+    request_map_t::iterator r;
+
+    if(h.request_id == FCGI_NULL_REQUEST_ID) {
+        if(h.type == FCGI_GET_VALUES) {
+            process_get_values(content, h.content_length);
+        }
+        else {
+            char body[8] = { 0 };
+
+            body[0] = h.type;
+
+            fcgi_append_record(output_chunk(), FCGI_UNKNOWN_TYPE, FCGI_NULL_REQUEST_ID, body, sizeof(body));
+        }
+
+        return flush_output();
+    }
+
+    switch(h.type) {
+        case FCGI_BEGIN_REQUEST:
+            {
+                if(h.content_length < 8) {
+                    return false;
+                }
+
+                unsigned role = (content[0] << 8) | content[1];
+                bool keep_conn = (content[2] & FCGI_KEEP_CONN) != 0;
+
+                if(receiving.find(h.request_id) != receiving.end() || active.find(h.request_id) != active.end()) {
+                    LogError("fcgi_connection: request id " << h.request_id << " is already in use");
+                    return false;
+                }
+
+                if(!values.mpxs_conns && (!receiving.empty() || !active.empty())) {
+                    fcgi_append_end_request(output_chunk(), h.request_id, 0, FCGI_CANT_MPX_CONN);
+                    return flush_output();
+                }
+
+                if(role != FCGI_RESPONDER) {
+                    fcgi_append_end_request(output_chunk(), h.request_id, 0, FCGI_UNKNOWN_ROLE);
+                    return flush_output();
+                }
+
+                receiving.insert(std::make_pair(h.request_id, new fcgi_request_data(this, h.request_id, role, keep_conn)));
+            }
+            break;
+
+        case FCGI_ABORT_REQUEST:
+            if((r = receiving.find(h.request_id)) != receiving.end()) {
+                if(!r->second->keep_conn) {
+                    close_when_drained = true;
+                }
+
+                delete r->second;
+                receiving.erase(r);
+
+                fcgi_append_end_request(output_chunk(), h.request_id, 0, FCGI_REQUEST_COMPLETE);
+                return flush_output();
+            }
+
+            if((r = active.find(h.request_id)) != active.end()) {
+                /*
+                 * Worker thread will complete the request
+                 */
+                r->second->aborted = true;
+            }
+            break;
+
+        case FCGI_PARAMS:
+            if((r = receiving.find(h.request_id)) != receiving.end()) {
+                if(h.content_length == 0) {
+                    r->second->params_complete = true;
+                }
+                else {
+                    r->second->params.append(data, h.content_length);
+                }
+            }
+            break;
+
+        case FCGI_STDIN:
+            if((r = receiving.find(h.request_id)) != receiving.end()) {
+                if(h.content_length == 0) {
+                    if(!r->second->params_complete) {
+                        LogError("fcgi_connection: stdin terminated before params");
+                        return false;
+                    }
+
+                    if(!flush_stdin(r->second)) {
+                        return false;
+                    }
+
+                    _completed.push_back(r->second);
+                    active.insert(*r);
+                    receiving.erase(r);
+                    ref();
+                }
+                else if(!append_stdin(r->second, data, h.content_length)) {
+                    return false;
+                }
+            }
+            break;
+
+        case FCGI_DATA:
+            break;
+
+        default:
+            {
+                char body[8] = { 0 };
+
+                body[0] = h.type;
+
+                fcgi_append_record(output_chunk(), FCGI_UNKNOWN_TYPE, FCGI_NULL_REQUEST_ID, body, sizeof(body));
+
+                return flush_output();
+            }
+    }
+
+    return true;
+}
+
+/*
+ * Spooling is done by the event thread, the request is not passed to
+ * a worker before its body is complete. Writes go to page cache and
+ * normally do not block, but a slow spool disk stalls every connection
+ * of the event thread. To bound that, the body is written out in
+ * batches of spool_threshold bytes rather than record by record, and
+ * bodies over max_body are not written at all
+ */
+bool fcgi_connection::append_stdin(fcgi_request_data *_request, const char *_data, size_t _len)
+{
+    _request->stdin_length += _len;
+
+    if(values.max_body != 0 && _request->stdin_length > values.max_body) {
+        /*
+         * Worker answers the request with 413, drop the body
+         */
+        if(_request->stdin_fd != -1) {
+            ::close(_request->stdin_fd);
+            _request->stdin_fd = -1;
+        }
+
+        std::string().swap(_request->stdin_data);
+        return true;
+    }
+
+    _request->stdin_data.append(_data, _len);
+
+    if(_request->stdin_data.size() <= values.spool_threshold) {
+        return true;
+    }
+
+    if(_request->stdin_fd == -1) {
+        /*
+         * Request body is too large to keep in memory
+         */
+        _request->stdin_fd = spool_open(values.spool_dir);
+
+        if(_request->stdin_fd == -1) {
+            LogError("fcgi_connection: cannot create spool file in " << values.spool_dir << ": " << strerror(errno));
+            return false;
+        }
+    }
+
+    return flush_stdin(_request);
+}
+
+bool fcgi_connection::flush_stdin(fcgi_request_data *_request)
+{
+    if(_request->stdin_fd == -1 || _request->stdin_data.empty()) {
+        return true;
+    }
+
+    if(!spool_write(_request->stdin_fd, _request->stdin_data.data(), _request->stdin_data.size())) {
+        LogError("fcgi_connection: cannot write spool file: " << strerror(errno));
+        return false;
+    }
+
+    /*
+     * Capacity is kept for the next batch
+     */
+    _request->stdin_data.clear();
+
+    return true;
+}
+
+void fcgi_connection::process_get_values(const u_char *content, size_t len)
+{
+    const u_char *p = content, *end = content + len;
+    const char *name, *value;
+    size_t name_len, value_len;
+    std::string result;
+
+    while(p != end && fcgi_decode_name_value(p, end, name, name_len, value, value_len)) {
+        std::string variable(name, name_len);
+        std::ostringstream o;
+
+        if(variable == "FCGI_MAX_CONNS") {
+            o << values.max_conns;
+        }
+        else if(variable == "FCGI_MAX_REQS") {
+            o << values.max_reqs;
+        }
+        else if(variable == "FCGI_MPXS_CONNS") {
+            o << (values.mpxs_conns ? 1 : 0);
+        }
+        else {
+            /*
+             * Unknown variables are omitted from the reply
+             */
+            continue;
+        }
+
+        fcgi_encode_name_value(result, variable, o.str());
+    }
+
+    fcgi_append_record(output_chunk(), FCGI_GET_VALUES_RESULT, FCGI_NULL_REQUEST_ID, result.data(), result.size());
+}
+
+std::string &fcgi_connection::output_chunk()
+{
+    if(out_queue.empty() || out_queue.back().size() >= out_chunk_size) {
+        out_queue.push_back(std::string());
+        out_queue.back().reserve(out_chunk_size + FCGI_MAX_RECORD_LEN);
+    }
+
+    return out_queue.back();
+}
+
+bool fcgi_connection::flush_output()
+{
+    struct iovec iov[16];
+
+    out_pending = 0;
+
+    for(std::deque<std::string>::const_iterator i = out_queue.begin() ; i != out_queue.end() ; i++) {
+        out_pending += i->size();
+    }
+
+    out_pending -= out_pos;
+
+    while(out_pending != 0) {
+        size_t iovcnt = 0;
+        size_t pos = out_pos;
+
+        for(std::deque<std::string>::iterator i = out_queue.begin() ; i != out_queue.end() && iovcnt != 16 ; i++) {
+            iov[iovcnt].iov_base = &(*i)[pos];
+            iov[iovcnt].iov_len = i->size() - pos;
+            iovcnt++;
+            pos = 0;
+        }
+
+        ssize_t n = ::writev(fd, iov, iovcnt);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+
+            return false;
+        }
+
+        out_pending -= n;
+
+        while(n != 0) {
+            size_t left = out_queue.front().size() - out_pos;
+
+            if((size_t)n < left) {
+                out_pos += n;
+                break;
+            }
+
+            n -= left;
+            out_pos = 0;
+            out_queue.pop_front();
+        }
+    }
+
+    if(out_pending <= out_low_water) {
+        pthread_cond_broadcast(&drained);
+    }
+
+    update_events();
+
+    return true;
+}
+
+void fcgi_connection::update_events()
+{
+    unsigned new_events = EPOLLIN;
+
+    if(dead) {
+        return;
+    }
+
+    if(out_pending != 0 || close_when_drained) {
+        new_events |= EPOLLOUT;
+    }
+
+    if(new_events != events) {
+        struct epoll_event ev;
+
+        ev.events = new_events;
+        ev.data.ptr = this;
+
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+            events = new_events;
+        }
+    }
+}
+
+bool fcgi_connection::on_writable()
+{
+    bool result;
+
+    pthread_mutex_lock(&lock);
+
+    result = flush_output() && !(out_pending == 0 && close_when_drained);
+
+    pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+void fcgi_connection::abort()
+{
+    /*
+     * Stop producing output and make the event thread notice
+     * the connection is gone
+     */
+    dead = true;
+
+    ::shutdown(fd, SHUT_RDWR);
+}
+
+void fcgi_connection::close()
+{
+    pthread_mutex_lock(&lock);
+
+    dead = true;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+    out_queue.clear();
+    out_pos = 0;
+    out_pending = 0;
+
+    pthread_cond_broadcast(&drained);
+
+    pthread_mutex_unlock(&lock);
+
+    unref();
+}
+
+void fcgi_connection::write_stream(u_char _type, unsigned _request_id, const char *_data, size_t _len)
+{
+    pthread_mutex_lock(&lock);
+
+    request_map_t::const_iterator r = active.find(_request_id);
+
+    if(r != active.end() && r->second->aborted && _len != 0) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    if(!dead) {
+        fcgi_append_record(output_chunk(), _type, _request_id, _data, _len);
+
+        if(!flush_output()) {
+            abort();
+        }
+    }
+
+    if(!dead && out_pending > out_high_water) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += send_timeout;
+
+        while(!dead && out_pending > out_low_water) {
+            if(pthread_cond_timedwait(&drained, &lock, &deadline) == ETIMEDOUT) {
+                LogError("fcgi_connection: send timed out");
+                abort();
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+void fcgi_connection::end_request(fcgi_request_data *_request, unsigned _app_status)
+{
+    pthread_mutex_lock(&lock);
+
+    active.erase(_request->id);
+
+    if(!dead) {
+        fcgi_append_end_request(output_chunk(), _request->id, _app_status, FCGI_REQUEST_COMPLETE);
+
+        if(!_request->keep_conn) {
+            close_when_drained = true;
+        }
+
+        if(!flush_output()) {
+            abort();
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    delete _request;
+
+    unref();
+}
+
+};
@@ -0,0 +1,203 @@
+
+#ifndef _FCGI_CONNECTION_H_
+#define _FCGI_CONNECTION_H_
+
+#include <string>
+#include <deque>
+#include <list>
+#include <map>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "fcgi_protocol.h"
+
+namespace fp {
+
+class fcgi_connection;
+
+/*
+ * Request as received from the web server. Owned by connection
+ * while records are arriving, then passed to a worker thread
+ */
+struct fcgi_request_data {
+    fcgi_request_data(fcgi_connection *_conn, unsigned _id, unsigned _role, bool _keep_conn)
+        : conn(_conn)
+        , id(_id)
+        , role(_role)
+        , keep_conn(_keep_conn)
+        , params_complete(false)
+        , aborted(false)
+        , params()
+        , stdin_data()
+        , stdin_fd(-1)
+        , stdin_length(0)
+    {
+    }
+
+    ~fcgi_request_data();
+
+    fcgi_connection     *conn;
+    unsigned            id;
+    unsigned            role;
+    bool                keep_conn;
+    bool                params_complete;
+
+    /*
+     * Web server aborted the request while it was processed. Stream
+     * output of aborted request is discarded
+     */
+    bool                aborted;
+
+    /*
+     * Raw FCGI_PARAMS stream (name-value pairs)
+     */
+    std::string         params;
+
+    /*
+     * Content of FCGI_STDIN stream. Once the stream grows over spool
+     * threshold it is moved to a temporary file, stdin_data then
+     * buffers the tail of the stream that is not yet written out and
+     * is empty when the request is completed. stdin_length counts the
+     * whole stream, including the part discarded over max_body
+     */
+    std::string         stdin_data;
+    int                 stdin_fd;
+    size_t              stdin_length;
+};
+
+/*
+ * Settings shared by all connections of the server. max_conns, max_reqs
+ * and mpxs_conns are reported to the web server in FCGI_GET_VALUES_RESULT
+ */
+struct fcgi_values {
+    unsigned            max_conns;
+    unsigned            max_reqs;
+    bool                mpxs_conns;
+
+    /*
+     * Request bodies and uploaded parts larger than spool_threshold
+     * are kept in temporary files in spool_dir
+     */
+    size_t              spool_threshold;
+    std::string         spool_dir;
+
+    /*
+     * Largest request body accepted, 0 if unlimited. Body over the
+     * limit is discarded and the request is answered with 413
+     */
+    size_t              max_body;
+};
+
+/*
+ * FastCGI connection from the web server. Reading and record
+ * decoding is done by the event thread that owns the connection,
+ * output is written by worker threads. Connection is reference counted:
+ * the event thread holds one reference while the connection is registered
+ * in its epoll set, and each request passed to a worker thread holds another.
+ * Several requests can be multiplexed over one connection and the
+ * connection is kept open after a request if FCGI_KEEP_CONN is set
+ */
+class fcgi_connection {
+public:
+    typedef std::list<fcgi_request_data*> request_list_t;
+
+    fcgi_connection(int _fd, int _epoll_fd, const fcgi_values &_values);
+
+    int get_fd() const { return fd; }
+
+    void ref();
+    void unref();
+
+    /*
+     * Read and decode available records. Completed requests are appended
+     * to _completed and hold a reference to the connection
+     *
+     * @return false if connection must be closed
+     */
+    bool on_readable(request_list_t &_completed);
+
+    /*
+     * Write pending output
+     *
+     * @return false if connection must be closed
+     */
+    bool on_writable();
+
+    /*
+     * Remove connection from event set, discard pending output and
+     * drop reference of the event thread
+     */
+    void close();
+
+    /*
+     * Encode data as records of a stream and send them. Blocks while
+     * too much output is pending on the connection. Empty data terminates
+     * the stream
+     */
+    void write_stream(u_char _type, unsigned _request_id, const char *_data, size_t _len);
+
+    /*
+     * Complete request: send FCGI_END_REQUEST, destroy request data
+     * and drop reference held by the request
+     */
+    void end_request(fcgi_request_data *_request, unsigned _app_status);
+
+private:
+    ~fcgi_connection();
+
+    bool process_records(request_list_t &_completed);
+    bool process_record(const fcgi_record_header &h, const u_char *content, request_list_t &_completed);
+    bool append_stdin(fcgi_request_data *_request, const char *_data, size_t _len);
+    bool flush_stdin(fcgi_request_data *_request);
+    void process_get_values(const u_char *content, size_t len);
+
+    std::string &output_chunk();
+    bool flush_output();
+    void update_events();
+    void abort();
+
+private:
+    typedef std::map<unsigned, fcgi_request_data*> request_map_t;
+
+    static const size_t in_buffer_size = FCGI_MAX_RECORD_LEN;
+    static const size_t out_chunk_size = 65536;
+    static const size_t out_high_water = 256 * 1024;
+    static const size_t out_low_water = 64 * 1024;
+    static const int send_timeout = 60;
+
+    int                         fd;
+    int                         epoll_fd;
+    int                         refs;
+
+    const fcgi_values           &values;
+
+    pthread_mutex_t             lock;
+    pthread_cond_t              drained;
+
+    u_char                      *in_buf;
+    size_t                      in_start;
+    size_t                      in_end;
+
+    std::deque<std::string>     out_queue;
+    size_t                      out_pos;
+    size_t                      out_pending;
+    unsigned                    events;
+
+    /*
+     * Requests whose records are still arriving
+     */
+    request_map_t               receiving;
+
+    /*
+     * Requests passed to worker threads
+     */
+    request_map_t               active;
+
+    bool                        dead;
+    bool                        close_when_drained;
+};
+
+};
+
+#endif //_FCGI_CONNECTION_H_
@@ -1,7 +1,12 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
+#include "simd.h"
+#include "spool.h"
 #include "fcgi_handler.h"
 
 #define MULTIPART_FORM_DATA_STRING              "multipart/form-data"
@@ -11,6 +16,7 @@
 #define FORM_DATA_STRING                        "form-data"
 #define ATTACHMENT_STRING                       "attachment"
 #define FIELDNAME_STRING                        "name=\""
+#define FILENAME_STRING                         "filename=\""
 
 namespace fp {
 
@@ -25,7 +31,8 @@ private:
     } formdata_parser_state_t;
 
 public:
-    formdata_parser(const std::string &_content_type, size_t max_header_len, size_t buffer_size, std::map<const std::string, std::string> &_formdata_params);
+    formdata_parser(const std::string &_content_type, size_t max_header_len, size_t buffer_size,
+        fcgi_param_map &_formdata_params, fcgi_form_part_list &_form_parts, arena &_arena, const fcgi_values &_values);
     ~formdata_parser();
 
     void upload_parse_part_header(char *header, char *header_end);
@@ -40,21 +47,40 @@ public:
     void upload_shutdown_ctx();
 
     void upload_putc(u_char c);
+    void upload_write(const u_char *start, const u_char *end);
 
     void upload_process_buf(u_char *start, u_char *end);
 
 private:
-    std::map<const std::string, std::string> &formdata_params;
+    string_ref upload_copy(const arena_string &s);
 
-    std::string                 boundary;
-    std::string                 field_name;
-    std::string                 field_value;
-    std::string                 content_type;
+private:
+    fcgi_param_map              &formdata_params;
+    fcgi_form_part_list         &form_parts;
+    arena                       &request_arena;
+    const fcgi_values           &values;
+
+    arena_string                boundary;
+    arena_string                field_name;
+    arena_string                field_value;
+    arena_string                file_name;
+    arena_string                content_type;
+
+    /*
+     * Temporary file the current part is spooled to and its size
+     */
+    int                         part_fd;
+    size_t                      part_size;
+
+    /*
+     * Memory taken by content of parts kept in memory
+     */
+    size_t                      memory_used;
 
     formdata_parser_state_t     state;
 
-    std::string::iterator       boundary_start;
-    std::string::iterator       boundary_pos;
+    arena_string::iterator      boundary_start;
+    arena_string::iterator      boundary_pos;
     
     u_char                      *header_accumulator;
     u_char                      *header_accumulator_end;
@@ -68,23 +94,27 @@ private:
     unsigned int                first_part:1;
 };
 
-formdata_parser::formdata_parser(const std::string &_content_type, size_t max_header_len, size_t buffer_size, std::map<const std::string, std::string> &_formdata_params)
+formdata_parser::formdata_parser(const std::string &_content_type, size_t max_header_len, size_t buffer_size,
+    fcgi_param_map &_formdata_params, fcgi_form_part_list &_form_parts, arena &_arena, const fcgi_values &_values)
     : formdata_params(_formdata_params)
-    , header_accumulator(new u_char[max_header_len + 1])
-    , output_buffer(new u_char[buffer_size])
+    , form_parts(_form_parts)
+    , request_arena(_arena)
+    , values(_values)
+    , boundary(_arena)
+    , field_name(_arena)
+    , field_value(_arena)
+    , file_name(_arena)
+    , content_type(_arena)
+    , part_fd(-1)
+    , part_size(0)
+    , memory_used(0)
+    , header_accumulator(static_cast<u_char*>(_arena.alloc(max_header_len + 1)))
+    , output_buffer(static_cast<u_char*>(_arena.alloc(buffer_size)))
     , first_part(1)
 {
-	if(header_accumulator == NULL) {
-        throw fcgi_exception("insufficient memory", HTTP_INTERNAL_SERVER_ERROR);
-    }
-
 	header_accumulator_pos = header_accumulator;
 	header_accumulator_end = header_accumulator + max_header_len;
 
-	if(output_buffer == NULL) {
-        throw fcgi_exception("insufficient memory", HTTP_INTERNAL_SERVER_ERROR);
-    }
-
     output_buffer_pos = output_buffer;
     output_buffer_end = output_buffer + buffer_size;
 
@@ -94,10 +124,29 @@ formdata_parser::formdata_parser(const std::string &_content_type, size_t max_he
 }
 
 formdata_parser::~formdata_parser() {
-    delete [] header_accumulator;
-    delete [] output_buffer;
+    if(part_fd != -1) {
+        close(part_fd);
+    }
 }
 
+/*
+ * Find quoted attribute in Content-Disposition header
+ *
+ * @return start of attribute value or 0 if not found
+ */
+static char *upload_find_attribute(char *p, const char *name, size_t len) { /* {{{ */
+    while((p = strstr(p, name)) != 0) {
+        // Don't take filename=" for name="
+        if(!isalnum((u_char)p[-1])) {
+            return p + len;
+        }
+
+        p += len;
+    }
+
+    return 0;
+} /* }}} */
+
 void formdata_parser::upload_parse_part_header(char *header, char *header_end) { /* {{{ */
     if(!strncasecmp(CONTENT_DISPOSITION_STRING, header, sizeof(CONTENT_DISPOSITION_STRING) - 1)) {
         char *p = header + sizeof(CONTENT_DISPOSITION_STRING) - 1;
@@ -110,11 +159,9 @@ void formdata_parser::upload_parse_part_header(char *header, char *header_end) {
             throw fcgi_exception("Content-Disposition is not form-data or attachment", HTTP_BAD_REQUEST);
         }
 
-        fieldname_start = strstr(p, FIELDNAME_STRING);
+        fieldname_start = upload_find_attribute(p, FIELDNAME_STRING, sizeof(FIELDNAME_STRING)-1);
 
         if(fieldname_start != 0) {
-            fieldname_start += sizeof(FIELDNAME_STRING)-1;
-
             fieldname_end = fieldname_start + strcspn(fieldname_start, "\"");
 
             if(*fieldname_end != '\"') {
@@ -123,6 +170,18 @@ void formdata_parser::upload_parse_part_header(char *header, char *header_end) {
 
             field_name.assign(fieldname_start, fieldname_end - fieldname_start);
         }
+
+        fieldname_start = upload_find_attribute(p, FILENAME_STRING, sizeof(FILENAME_STRING)-1);
+
+        if(fieldname_start != 0) {
+            fieldname_end = fieldname_start + strcspn(fieldname_start, "\"");
+
+            if(*fieldname_end != '\"') {
+                throw fcgi_exception("malformed filename in part header", HTTP_BAD_REQUEST);
+            }
+
+            file_name.assign(fieldname_start, fieldname_end - fieldname_start);
+        }
     }else if(!strncasecmp(CONTENT_TYPE_STRING, header, sizeof(CONTENT_TYPE_STRING)-1)) {
         char *content_type_str = header + sizeof(CONTENT_TYPE_STRING)-1;
         
@@ -139,15 +198,45 @@ void formdata_parser::upload_parse_part_header(char *header, char *header_end) {
 void formdata_parser::upload_discard_part_attributes() { /* {{{ */
     field_name.clear();
     field_value.clear();
+    file_name.clear();
     content_type.clear();
+
+    if(part_fd != -1) {
+        close(part_fd);
+        part_fd = -1;
+    }
+
+    part_size = 0;
 } /* }}} */
 
 void formdata_parser::upload_start_part() { /* {{{ */
 } /* }}} */
 
+string_ref formdata_parser::upload_copy(const arena_string &s) { /* {{{ */
+    return string_ref(request_arena.dup(s.data(), s.size()), s.size());
+} /* }}} */
+
 void formdata_parser::upload_finish_part() { /* {{{ */
+    fcgi_form_part part;
+
+    part.name = upload_copy(field_name);
+    part.filename = upload_copy(file_name);
+    part.content_type = upload_copy(content_type);
+    part.size = part_size;
+    part.fd = part_fd;
+    part.mapping = 0;
+
+    if(part_fd == -1) {
+        part.data = upload_copy(field_value);
+        memory_used += part_size;
 
-    formdata_params.insert( std::make_pair(field_name, field_value) );
+        formdata_params.insert( std::make_pair(part.name, part.data) );
+    }
+
+    // Part owns the file now
+    part_fd = -1;
+
+    form_parts.push_back(part);
 
     upload_discard_part_attributes();
 
@@ -162,19 +251,47 @@ void formdata_parser::upload_abort_part() { /* {{{ */
 } /* }}} */
 
 void formdata_parser::upload_flush_output_buffer() { /* {{{ */
-    if(output_buffer_pos > output_buffer) {
-        if(field_value.empty())
-            field_value.assign(output_buffer, output_buffer_pos);
-        output_buffer_pos = output_buffer;	
+    size_t len = output_buffer_pos - output_buffer;
+
+    if(len == 0) {
+        return;
+    }
+
+    if(part_fd == -1 && memory_used + part_size + len > values.spool_threshold) {
+        /*
+         * Part does not fit into memory left for this request,
+         * move it to a temporary file
+         */
+        part_fd = spool_open(values.spool_dir);
+
+        if(part_fd == -1) {
+            throw fcgi_exception("cannot create spool file", HTTP_INTERNAL_SERVER_ERROR);
+        }
+
+        if(!spool_write(part_fd, field_value.data(), field_value.size())) {
+            throw fcgi_exception("cannot write spool file", HTTP_INTERNAL_SERVER_ERROR);
+        }
+
+        field_value.clear();
+    }
+
+    if(part_fd != -1) {
+        if(!spool_write(part_fd, output_buffer, len)) {
+            throw fcgi_exception("cannot write spool file", HTTP_INTERNAL_SERVER_ERROR);
+        }
     }
+    else {
+        field_value.append(reinterpret_cast<const char*>(output_buffer), len);
+    }
+
+    part_size += len;
+    output_buffer_pos = output_buffer;	
 } /* }}} */
 
 void formdata_parser::upload_init_ctx() { /* {{{ */
 	state = upload_state_boundary_seek;
 
-    field_name.clear();
-    field_value.clear();
-    content_type.clear();
+    upload_discard_part_attributes();
 
     discard_data = 0;
 } /* }}} */
@@ -207,13 +324,11 @@ void formdata_parser::upload_parse_content_type(const std::string &content_type)
 
     boundary_start_pos = content_type.find(BOUNDARY_STRING, mime_type_end_ptr - content_type.c_str());
 
-    boundary_start_ptr = content_type.c_str() + boundary_start_pos;
-
-    if(boundary_start_ptr == NULL) {
+    if(boundary_start_pos == std::string::npos) {
         throw fcgi_exception("no boundary found in Content-Type", HTTP_BAD_REQUEST);
     }
 
-    boundary_start_ptr += sizeof(BOUNDARY_STRING) - 1;
+    boundary_start_ptr = content_type.c_str() + boundary_start_pos + sizeof(BOUNDARY_STRING) - 1;
     boundary_end_ptr = boundary_start_ptr + strcspn((char*)boundary_start_ptr, " ;\n\r");
 
     if(boundary_end_ptr == boundary_start_ptr) {
@@ -248,6 +363,28 @@ void formdata_parser::upload_putc(u_char c) { /* {{{ */
     }
 } /* }}} */
 
+void formdata_parser::upload_write(const u_char *start, const u_char *end) { /* {{{ */
+    if(discard_data) {
+        return;
+    }
+
+    while(start != end) {
+        size_t len = end - start;
+
+        if(len > (size_t)(output_buffer_end - output_buffer_pos)) {
+            len = output_buffer_end - output_buffer_pos;
+        }
+
+        memcpy(output_buffer_pos, start, len);
+
+        output_buffer_pos += len;
+        start += len;
+
+        if(output_buffer_pos == output_buffer_end)
+            upload_flush_output_buffer();
+    }
+} /* }}} */
+
 void formdata_parser::upload_process_buf(u_char *start, u_char *end) { /* {{{ */
 	u_char *p;
 
@@ -330,6 +467,35 @@ void formdata_parser::upload_process_buf(u_char *start, u_char *end) { /* {{{ */
 			 * and output data simultaneously
 			 */
 			case upload_state_data:
+                if(boundary_pos == boundary.begin()) {
+                    /*
+                     * No partial match of the delimiter: look for all of it
+                     * but CR, which IE 5.0 may omit, and copy everything
+                     * before it in bulk. Without a match only the tail of
+                     * the buffer may hold the beginning of a delimiter that
+                     * continues in the next one
+                     */
+                    const u_char *delim = (const u_char*)boundary.data() + 1;
+                    size_t delim_len = boundary.size() - 1;
+                    const u_char *q = simd_find(p, end, delim, delim_len);
+
+                    if(q != end) {
+                        if(q != p && q[-1] == '\r') {
+                            q--;
+                        }
+                    }
+                    else {
+                        q = (size_t)(end - p) > delim_len ? end - delim_len : p;
+                        q = simd_find_byte2(q, end, '\r', '\n');
+                    }
+
+                    if(q != p) {
+                        upload_write(p, q);
+                        p = (u_char*)q - 1;
+                        break;
+                    }
+                }
+
 				if(*p == *boundary_pos) 
 					boundary_pos++;
 				else {
@@ -346,7 +512,7 @@ void formdata_parser::upload_process_buf(u_char *start, u_char *end) { /* {{{ */
                             upload_putc(*p);
                     } else {
 						// Output partially matched lump of boundary
-						std::string::iterator q;
+						arena_string::iterator q;
 						for(q = boundary_start; q != boundary_pos; q++)
 							upload_putc(*q);
 
@@ -378,96 +544,428 @@ void formdata_parser::upload_process_buf(u_char *start, u_char *end) { /* {{{ */
 	}
 } /* }}} */
 
-#define STDIN_MAX 32768
+static inline int hex_value(char c)
+{
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+/*
+ * Decode percent-encoded URL component into dst, which may be the same
+ * as src. Spans without '%' and '+' are found by SIMD scan and copied
+ * in bulk
+ *
+ * @return length of decoded data
+ */
+static size_t decode_uri_component(char *dst, const char *src, size_t len)
+{
+    const u_char *p = reinterpret_cast<const u_char*>(src);
+    const u_char *end = p + len;
+    char *d = dst;
+
+    while(p != end) {
+        const u_char *q = simd_find_byte2(p, end, '%', '+');
+
+        if(d != (const char*)p) {
+            memmove(d, p, q - p);
+        }
+
+        d += q - p;
+        p = q;
+
+        if(p == end) {
+            break;
+        }
+
+        if(*p == '+') {
+            *d++ = ' ';
+            p++;
+        }
+        else if(end - p >= 3 && isxdigit(p[1]) && isxdigit(p[2])) {
+            *d++ = (char)((hex_value(p[1]) << 4) | hex_value(p[2]));
+            p += 3;
+        }
+        else {
+            *d++ = *p++;
+        }
+    }
+
+    return d - dst;
+}
+
+/*
+ * Decode percent-encoded URL component. Components that need no decoding
+ * are returned as is, others are decoded into the arena
+ */
+static string_ref decode_uri_component(arena &_arena, const string_ref &_s)
+{
+    const u_char *start = reinterpret_cast<const u_char*>(_s.data());
+    const u_char *end = start + _s.size();
+
+    if(simd_find_byte2(start, end, '%', '+') == end) {
+        return _s;
+    }
+
+    char *dst = static_cast<char*>(_arena.alloc(_s.size()));
+
+    return string_ref(dst, decode_uri_component(dst, _s.data(), _s.size()));
+}
+
+#define FORM_URLENCODED_STRING                  "application/x-www-form-urlencoded"
+
+/*
+ * Maximum size of application/x-www-form-urlencoded body, it is kept in memory
+ */
+#define FORM_URLENCODED_MAX                     (1024 * 1024)
+
+/*
+ * Streaming parser of application/x-www-form-urlencoded body. Body can be
+ * passed in chunks split at any byte
+ */
+class urlencoded_parser {
+public:
+    urlencoded_parser(fcgi_param_map &_formdata_params, arena &_arena);
+
+    void process_buf(const u_char *start, const u_char *end);
+    void finish();
+
+private:
+    void add_param();
+
+private:
+    fcgi_param_map              &formdata_params;
+    arena                       &request_arena;
+
+    arena_string                name;
+    arena_string                value;
+    bool                        in_value;
+    size_t                      total;
+};
+
+urlencoded_parser::urlencoded_parser(fcgi_param_map &_formdata_params, arena &_arena)
+    : formdata_params(_formdata_params)
+    , request_arena(_arena)
+    , name(_arena)
+    , value(_arena)
+    , in_value(false)
+    , total(0)
+{
+}
+
+void urlencoded_parser::process_buf(const u_char *start, const u_char *end)
+{
+    const u_char *p = start, *q;
+
+    total += end - start;
+
+    if(total > FORM_URLENCODED_MAX) {
+        throw fcgi_exception("form data is too large", HTTP_REQUEST_ENTITY_TOO_LARGE);
+    }
+
+    while(p != end) {
+        if(in_value) {
+            q = simd_find_byte(p, end, '&');
+            value.append(reinterpret_cast<const char*>(p), q - p);
+        }
+        else {
+            q = simd_find_byte2(p, end, '&', '=');
+            name.append(reinterpret_cast<const char*>(p), q - p);
+        }
+
+        if(q == end) {
+            break;
+        }
+
+        if(*q == '&') {
+            add_param();
+        }
+        else {
+            in_value = true;
+        }
+
+        p = q + 1;
+    }
+}
+
+void urlencoded_parser::finish()
+{
+    add_param();
+}
+
+void urlencoded_parser::add_param()
+{
+    if(!name.empty() || !value.empty()) {
+        char *n = request_arena.dup(name.data(), name.size());
+        char *v = request_arena.dup(value.data(), value.size());
+
+        formdata_params.insert(std::make_pair(
+            string_ref(n, decode_uri_component(n, n, name.size())),
+            string_ref(v, decode_uri_component(v, v, value.size()))));
+    }
+
+    name.clear();
+    value.clear();
+    in_value = false;
+}
+
+/*
+ * Request body is parsed in chunks of this size, so memory used
+ * by the parser does not depend on the size of the body
+ */
+#define FORMDATA_CHUNK_SIZE 16384
 
 void fcgi_request::parse_form_data() {
-    std::string content_type, content_length;
+    std::string content_type(get_fcgi_param("CONTENT_TYPE").str());
+    std::string content_length(get_fcgi_param("CONTENT_LENGTH").str());
     u_char *buf;
-    unsigned long clen = 128 * 1024;
-
-    content_type = get_fcgi_param("CONTENT_TYPE");
-    content_length = get_fcgi_param("CONTENT_LENGTH");
+    size_t len;
 
     if(content_type.empty())
         throw std::logic_error("HTTP server is not configured to pass CONTENT_TYPE variable");
 
-    if(!content_length.empty())
-    {
-        clen = strtol(content_length.c_str(), NULL, 10);
-
-        if(clen == 0) {
-            throw std::runtime_error("can't parse \"CONTENT_LENGTH\n");
-        }
+    if(content_length.empty())
+        throw std::logic_error("HTTP server is not configured to pass CONTENT_LENGTH variable");
 
-        // *always* put a cap on the amount of data that will be read
-        if (clen > STDIN_MAX) clen = STDIN_MAX;
+    if(strtol(content_length.c_str(), NULL, 10) <= 0) {
+        throw fcgi_exception("can't parse CONTENT_LENGTH", HTTP_BAD_REQUEST);
+    }
 
-        formdata_parser p(content_type, 512, 128 * 1024, m_formdata_params);
+    buf = static_cast<u_char*>(m_arena.alloc(FORMDATA_CHUNK_SIZE));
 
-        buf = new u_char[clen];
+    if(!strncasecmp(content_type.c_str(), FORM_URLENCODED_STRING, sizeof(FORM_URLENCODED_STRING) - 1)) {
+        urlencoded_parser p(m_formdata_params, m_arena);
 
         while(!fcgi_in.eof() && !fcgi_in.fail()) {
-            fcgi_in.read((char*)buf, clen);
-            clen = fcgi_in.gcount();
+            fcgi_in.read((char*)buf, FORMDATA_CHUNK_SIZE);
+            len = fcgi_in.gcount();
 
-            if(clen > 0) {
-                try{
-                    p.upload_process_buf(buf, buf + clen);
-                } catch(...) {
-                }
+            if(len > 0) {
+                p.process_buf(buf, buf + len);
             }
         }
 
-        delete [] buf;
+        p.finish();
+        return;
+    }
+
+    formdata_parser p(content_type, 512, FORMDATA_CHUNK_SIZE, m_formdata_params, m_form_parts, m_arena, m_values);
+
+    while(!fcgi_in.eof() && !fcgi_in.fail()) {
+        fcgi_in.read((char*)buf, FORMDATA_CHUNK_SIZE);
+        len = fcgi_in.gcount();
+
+        if(len > 0) {
+            p.upload_process_buf(buf, buf + len);
+        }
+    }
+
+    // Check that the body was terminated
+    p.upload_process_buf(buf, buf);
+}
+
+const fcgi_form_part *fcgi_request::get_form_part(const string_ref &_name) const
+{
+    for(fcgi_form_part_list::const_iterator i = m_form_parts.begin() ; i != m_form_parts.end() ; i++) {
+        if(i->name == _name) {
+            return &*i;
+        }
+    }
+
+    return 0;
+}
+
+string_ref fcgi_request::map_form_part(const fcgi_form_part &_part)
+{
+    if(_part.fd == -1) {
+        return _part.data;
+    }
+
+    if(_part.size == 0) {
+        return string_ref();
+    }
+
+    if(_part.mapping == 0) {
+        void *p = mmap(0, _part.size, PROT_READ, MAP_PRIVATE, _part.fd, 0);
+
+        if(p == MAP_FAILED) {
+            throw fcgi_exception("cannot map spooled part", HTTP_INTERNAL_SERVER_ERROR);
+        }
+
+        _part.mapping = p;
+    }
+
+    return string_ref(static_cast<const char*>(_part.mapping), _part.size);
+}
+
+/*
+ * FNV-1a
+ */
+static inline size_t hash_name(const string_ref &_name)
+{
+    size_t h = 2166136261u;
+
+    for(string_ref::const_iterator i = _name.begin() ; i != _name.end() ; i++) {
+        h = (h ^ (u_char)*i) * 16777619u;
+    }
+
+    return h;
+}
+
+void fcgi_request::attach(fcgi_request_data &_data)
+{
+    if(_data.stdin_fd != -1) {
+        fcgi_in.attach(_data.stdin_fd);
     }
     else {
-        throw std::logic_error("HTTP server is not configured to pass CONTENT_LENGTH variable");
+        fcgi_in.attach(_data.stdin_data);
+    }
+
+    parse_fcgi_params(_data.params);
+    index_fcgi_params();
+}
+
+void fcgi_request::clear()
+{
+    for(fcgi_form_part_list::iterator i = m_form_parts.begin() ; i != m_form_parts.end() ; i++) {
+        if(i->mapping != 0) {
+            munmap(i->mapping, i->size);
+        }
+
+        if(i->fd != -1) {
+            close(i->fd);
+        }
     }
 
-    do fcgi_in.ignore(1024); while (fcgi_in.gcount() == 1024);
+    /*
+     * Vectors keep their capacity when cleared, replace them
+     * so that they don't refer to memory of the arena being reset
+     */
+    fcgi_form_part_list(m_arena).swap(m_form_parts);
+    env_t(m_arena).swap(m_env);
+
+    m_params.clear();
+    m_formdata_params.clear();
+    m_env_index = 0;
+    m_env_index_mask = 0;
+    m_query_parsed = false;
 }
 
-void fcgi_request::parse_query_args()
+void fcgi_request::parse_fcgi_params(const std::string &_params)
 {
-    std::string query_args = get_fcgi_param("QUERY_STRING");
+    const u_char *p = reinterpret_cast<const u_char*>(_params.data());
+    const u_char *end = p + _params.size();
+    const char *name, *value;
+    size_t name_len, value_len;
+    env_entry e;
+
+    while(p != end) {
+        if(!fcgi_decode_name_value(p, end, name, name_len, value, value_len)) {
+            throw fcgi_exception("malformed FastCGI parameters", HTTP_BAD_REQUEST);
+        }
+
+        e.name = string_ref(name, name_len);
+        e.value = string_ref(value, value_len);
+
+        m_env.push_back(e);
+    }
+}
 
-    size_t first, last, delim;
+void fcgi_request::index_fcgi_params()
+{
+    size_t size = 16;
 
-    first = 0;
-    last = query_args.find_first_of('&');
+    while(size < m_env.size() * 2) {
+        size <<= 1;
+    }
 
-    while(last != std::string::npos) {
-        std::string arg(query_args, first, last - first);
+    m_env_index = static_cast<unsigned*>(m_arena.alloc(size * sizeof(unsigned)));
+    m_env_index_mask = size - 1;
 
-        delim = arg.find_first_of('=');
+    memset(m_env_index, 0, size * sizeof(unsigned));
 
-        if(delim != std::string::npos) {
-            std::string name(arg, 0, delim);
-            std::string value(arg, delim + 1, last - first - delim);
+    for(size_t n = 0 ; n != m_env.size() ; n++) {
+        size_t slot = hash_name(m_env[n].name) & m_env_index_mask;
 
-            m_params.insert(std::make_pair(name, value));
+        while(m_env_index[slot] != 0 && m_env[m_env_index[slot] - 1].name != m_env[n].name) {
+            slot = (slot + 1) & m_env_index_mask;
         }
-        else if(!arg.empty()) {
-            m_params.insert(std::make_pair(arg, std::string()));
+
+        /*
+         * First occurrence of a parameter wins
+         */
+        if(m_env_index[slot] == 0) {
+            m_env_index[slot] = n + 1;
         }
+    }
+}
 
-        first = last + 1;
+const fcgi_request::env_entry *fcgi_request::find_fcgi_param(const string_ref &_name) const
+{
+    if(m_env_index == 0) {
+        return 0;
+    }
+
+    size_t slot = hash_name(_name) & m_env_index_mask;
+    unsigned n;
+
+    while((n = m_env_index[slot]) != 0) {
+        if(m_env[n - 1].name == _name) {
+            return &m_env[n - 1];
+        }
 
-        last = query_args.find_first_of('c', first);
+        slot = (slot + 1) & m_env_index_mask;
     }
 
-    std::string arg(query_args, first);
+    return 0;
+}
+
+void fcgi_request::parse_query_args() const
+{
+    string_ref query_args = get_fcgi_param("QUERY_STRING");
+    size_t first = 0, last, delim;
+
+    m_query_parsed = true;
+
+    while(first <= query_args.size()) {
+        last = query_args.find('&', first);
+
+        if(last == string_ref::npos) {
+            last = query_args.size();
+        }
+
+        string_ref arg = query_args.substr(first, last - first);
+
+        if(!arg.empty()) {
+            delim = arg.find('=');
 
-    delim = arg.find_first_of('=');
+            string_ref name = decode_uri_component(m_arena, arg.substr(0, delim));
+            string_ref value = delim != string_ref::npos
+                ? decode_uri_component(m_arena, arg.substr(delim + 1)) : string_ref();
 
-    if(delim != std::string::npos) {
-        std::string name(arg, 0, delim);
-        std::string value(arg, delim + 1, last - first - delim);
+            m_params.insert(std::make_pair(name, value));
+        }
 
-        m_params.insert(std::make_pair(name, value));
+        first = last + 1;
     }
-    else if(!arg.empty()) {
-        m_params.insert(std::make_pair(arg, std::string()));
+}
+
+void fcgi_response::attach(fcgi_request_data &_data)
+{
+    fcgi_out.attach(_data.conn, _data.id);
+    fcgi_err.attach(_data.conn, _data.id);
+
+    m_data = &_data;
+    m_cache_ttl = 0;
+}
+
+void fcgi_response::finish()
+{
+    fcgi_out.flush();
+    fcgi_err.flush();
+
+    m_data->conn->write_stream(FCGI_STDOUT, m_data->id, 0, 0);
+
+    if(fcgi_err.has_output()) {
+        m_data->conn->write_stream(FCGI_STDERR, m_data->id, 0, 0);
     }
 }
 
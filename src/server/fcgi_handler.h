@@ -3,18 +3,25 @@
 #define _HANDLER_H_
 
 #include <stdexcept>
+#include <string>
+#include <vector>
 #include <map>
 
 #include <netinet/in.h>
 
-#include <fcgio.h>
+#include "arena.h"
+#include "string_ref.h"
+#include "fcgi_stream.h"
+#include "fcgi_connection.h"
 
 namespace fp {
 
 static const int HTTP_BAD_REQUEST                       = 400;
 static const int HTTP_NOT_FOUND                         = 404;
+static const int HTTP_REQUEST_ENTITY_TOO_LARGE          = 413;
 static const int HTTP_UNSUPPORTED_MEDIA_TYPE            = 415;
-static const int HTTP_INTERNAL_SERVER_ERROR             = 503;
+static const int HTTP_INTERNAL_SERVER_ERROR             = 500;
+static const int HTTP_SERVICE_UNAVAILABLE               = 503;
 
 class fcgi_exception : public std::runtime_error {
 public:
@@ -31,92 +38,232 @@ private:
 };
 
 /*
- * FastCGI request
+ * Request parameters. Keys and values reference memory of the request:
+ * its parameter stream or its arena
+ */
+typedef std::map<string_ref, string_ref, std::less<string_ref>,
+    arena_allocator<std::pair<const string_ref, string_ref> > > fcgi_param_map;
+
+/*
+ * Part of multipart/form-data request body. Content of small parts is
+ * kept in memory, larger parts are spooled to a temporary file. The
+ * file is closed when the response is finished
+ */
+struct fcgi_form_part {
+    string_ref  name;
+    string_ref  filename;
+    string_ref  content_type;
+    size_t      size;
+
+    /*
+     * Content of the part if it is kept in memory
+     */
+    string_ref  data;
+
+    /*
+     * Temporary file holding content of the part or -1
+     */
+    int         fd;
+
+    /*
+     * Content of spooled part mapped into memory by map_form_part, or 0
+     */
+    mutable void *mapping;
+};
+
+typedef std::vector<fcgi_form_part, arena_allocator<fcgi_form_part> > fcgi_form_part_list;
+
+/*
+ * FastCGI request. Each worker thread owns one request object and
+ * attaches it to every request it processes.
+ *
+ * Accessors return references into the request, they remain valid until
+ * the response is finished
  */
 class fcgi_request {
 public:
-    fcgi_request(const FCGX_Request &_request)
-        : fcgi_in(_request.in)
-        , m_params()
-        , m_formdata_params()
-        , envp(_request.envp)
+    fcgi_request(arena &_arena, const fcgi_values &_values)
+        : fcgi_in()
+        , m_arena(_arena)
+        , m_values(_values)
+        , m_params(std::less<string_ref>(), _arena)
+        , m_formdata_params(std::less<string_ref>(), _arena)
+        , m_form_parts(_arena)
+        , m_env(_arena)
+        , m_env_index(0)
+        , m_env_index_mask(0)
+        , m_query_parsed(false)
     {
-        parse_query_args();
     }
 
     ~fcgi_request()
     {
     }
 
-    fcgi_istream fcgi_in;
+    /*
+     * Attach to request received from web server and index its parameters
+     */
+    void attach(fcgi_request_data &_data);
+
+    /*
+     * Drop parameters of current request. Must be called before
+     * the arena is reset
+     */
+    void clear();
 
-    std::string get_script_name() const { return get_fcgi_param("SCRIPT_NAME"); }
+    /*
+     * Per-request memory for handlers' scratch data. It is released
+     * when the response is finished
+     */
+    arena &get_arena() { return m_arena; }
+
+    fcgi_istream fcgi_in;
 
-    bool has_param(const std::string &_name) const {
-        std::map<std::string, std::string>::const_iterator i;
-        i = m_params.find(_name);
+    string_ref get_script_name() const { return get_fcgi_param("SCRIPT_NAME"); }
 
-        return i != m_params.end();
+    /*
+     * Query string arguments, percent-decoded. QUERY_STRING is parsed
+     * on first access
+     */
+    bool has_param(const string_ref &_name) const {
+        const fcgi_param_map &params = get_params();
+        return params.find(_name) != params.end();
     }
 
-    std::string get_param(const std::string &_name) const {
-        std::map<std::string, std::string>::const_iterator i;
-        i = m_params.find(_name);
+    string_ref get_param(const string_ref &_name) const {
+        const fcgi_param_map &params = get_params();
+        fcgi_param_map::const_iterator i = params.find(_name);
 
-        if(i == m_params.end()) {
-            return std::string("");
-        }
+        return i != params.end() ? i->second : string_ref();
+    }
 
-        return i->second;
+    bool has_fcgi_param(const string_ref &_name) const {
+        return find_fcgi_param(_name) != 0;
     }
 
-    std::string get_fcgi_param(const std::string &_name) const {
-        char *c_param = FCGX_GetParam(_name.c_str(), envp);
-        return c_param != NULL ? std::string(c_param) : std::string("");
+    string_ref get_fcgi_param(const string_ref &_name) const {
+        const env_entry *e = find_fcgi_param(_name);
+        return e != 0 ? e->value : string_ref();
     }
 
-    bool has_formdata_param(const std::string &_name) const {
-        std::map<std::string, std::string>::const_iterator i;
-        i = m_formdata_params.find(_name);
+    bool has_formdata_param(const string_ref &_name) const {
+        return m_formdata_params.find(_name) != m_formdata_params.end();
+    }
+
+    string_ref get_formdata_param(const string_ref &_name) const {
+        fcgi_param_map::const_iterator i = m_formdata_params.find(_name);
 
-        return i != m_formdata_params.end();
+        return i != m_formdata_params.end() ? i->second : string_ref();
     }
 
-    std::string get_formdata_param(const std::string &_name) const {
-        std::map<std::string, std::string>::const_iterator i;
-        i = m_formdata_params.find(_name);
+    /*
+     * Parts of multipart/form-data body, in the order they were received
+     */
+    const fcgi_form_part_list &get_form_parts() const { return m_form_parts; }
 
-        if(i == m_formdata_params.end()) {
-            return std::string("");
-        }
+    /*
+     * Find part by field name
+     *
+     * @return part or 0 if there is no such field
+     */
+    const fcgi_form_part *get_form_part(const string_ref &_name) const;
 
-        return i->second;
-    }
+    /*
+     * Content of part. Spooled parts are mapped into memory, the mapping
+     * is released when the response is finished
+     */
+    string_ref map_form_part(const fcgi_form_part &_part);
 
+    /*
+     * Parse request body. Fields of application/x-www-form-urlencoded
+     * body and fields of multipart/form-data body kept in memory are
+     * available through get_formdata_param, all multipart parts through
+     * get_form_parts
+     */
     void parse_form_data();
 
 private:
-    void parse_query_args();
+    /*
+     * FastCGI parameter. Name and value point into parameter stream
+     * of the request
+     */
+    struct env_entry {
+        string_ref  name;
+        string_ref  value;
+    };
+
+    typedef std::vector<env_entry, arena_allocator<env_entry> > env_t;
+
+    void parse_fcgi_params(const std::string&);
+    void index_fcgi_params();
+    void parse_query_args() const;
+
+    const fcgi_param_map &get_params() const {
+        if(!m_query_parsed) {
+            parse_query_args();
+        }
+
+        return m_params;
+    }
+
+    const env_entry *find_fcgi_param(const string_ref &_name) const;
 
 private:
-    std::map<const std::string, std::string> m_params;
-    std::map<const std::string, std::string> m_formdata_params;
-    char **envp;
+    arena &m_arena;
+    const fcgi_values &m_values;
+    mutable fcgi_param_map m_params;
+    fcgi_param_map m_formdata_params;
+    fcgi_form_part_list m_form_parts;
+    env_t m_env;
+
+    /*
+     * Open addressing hash of m_env, slots hold index + 1 of an entry
+     * or 0 if empty
+     */
+    unsigned *m_env_index;
+    size_t m_env_index_mask;
+
+    mutable bool m_query_parsed;
 };
 
 /*
- * FastCGI response
+ * FastCGI response. Each worker thread owns one response object and
+ * attaches it to every request it processes
  */
 class fcgi_response {
 public:
-    fcgi_response(const FCGX_Request &_request)
-        : fcgi_out(_request.out) 
-        , fcgi_err(_request.err)
+    fcgi_response()
+        : fcgi_out(FCGI_STDOUT)
+        , fcgi_err(FCGI_STDERR)
+        , m_data(0)
+        , m_cache_ttl(0)
     {
     }
+
+    /*
+     * Attach output streams to request
+     */
+    void attach(fcgi_request_data &_data);
+
+    /*
+     * Flush and terminate output streams
+     */
+    void finish();
+
+    /*
+     * Allow the response to be cached for _ttl seconds. Handlers call it
+     * after the whole response has been written successfully
+     */
+    void set_cache_ttl(unsigned _ttl) { m_cache_ttl = _ttl; }
+
+    unsigned get_cache_ttl() const { return m_cache_ttl; }
     
     fcgi_ostream fcgi_out;
     fcgi_ostream fcgi_err;
+
+private:
+    fcgi_request_data *m_data;
+    unsigned m_cache_ttl;
 };
 
 /*
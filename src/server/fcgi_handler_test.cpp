@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <sstream>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "fcgi_protocol.h"
+#include "fcgi_handler.h"
+
+using namespace fp;
+
+#define BOUNDARY_PREFIX "----b0und"
+#define BOUNDARY BOUNDARY_PREFIX "ary"
+
+/*
+ * Parameters of a request attached to a reused fcgi_request, with
+ * the arena reset between requests. Query string is parsed on first
+ * access, FastCGI parameters are looked up through the index
+ *
+ * Parsing of multipart/form-data and application/x-www-form-urlencoded
+ * request bodies. Bodies are read in chunks of 16K, tests place
+ * delimiters across chunk boundaries
+ */
+class fcgi_handler_test : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(fcgi_handler_test);
+    CPPUNIT_TEST(test_fcgi_params);
+    CPPUNIT_TEST(test_fcgi_param_index);
+    CPPUNIT_TEST(test_query_arg);
+    CPPUNIT_TEST(test_query_args);
+    CPPUNIT_TEST(test_reuse);
+    CPPUNIT_TEST(test_urlencoded);
+    CPPUNIT_TEST(test_urlencoded_chunk_boundary);
+    CPPUNIT_TEST(test_urlencoded_too_large);
+    CPPUNIT_TEST(test_multipart);
+    CPPUNIT_TEST(test_multipart_file);
+    CPPUNIT_TEST(test_multipart_partial_delimiter);
+    CPPUNIT_TEST(test_multipart_chunk_boundary);
+    CPPUNIT_TEST(test_multipart_lf_delimiter);
+    CPPUNIT_TEST(test_multipart_spooled_part);
+    CPPUNIT_TEST(test_multipart_bad_content_type);
+    CPPUNIT_TEST(test_multipart_unterminated);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp()
+    {
+        values.max_conns = 1;
+        values.max_reqs = 1;
+        values.mpxs_conns = false;
+        values.spool_threshold = 64 * 1024;
+        values.spool_dir = "/tmp";
+        values.max_body = 0;
+
+        data = 0;
+        extra.clear();
+        request = new fcgi_request(request_arena, values);
+    }
+
+    void tearDown()
+    {
+        request->clear();
+
+        delete request;
+        delete data;
+
+        request_arena.reset();
+    }
+
+    void test_fcgi_params()
+    {
+        attach("/index", "");
+
+        CPPUNIT_ASSERT(request->has_fcgi_param("SCRIPT_NAME"));
+        CPPUNIT_ASSERT_EQUAL(std::string("/index"), request->get_fcgi_param("SCRIPT_NAME").str());
+        CPPUNIT_ASSERT_EQUAL(std::string("/index"), request->get_script_name().str());
+        CPPUNIT_ASSERT(!request->has_fcgi_param("HTTP_HOST"));
+        CPPUNIT_ASSERT(request->get_fcgi_param("HTTP_HOST").empty());
+    }
+
+    void test_fcgi_param_index()
+    {
+        char name[32], value[32];
+
+        /*
+         * Enough parameters to grow the index, one of them repeated
+         */
+        for(int i = 0 ; i != 100 ; i++) {
+            snprintf(name, sizeof(name), "HTTP_X_%d", i);
+            snprintf(value, sizeof(value), "%d", i);
+            fcgi_encode_name_value(extra, name, value);
+        }
+
+        fcgi_encode_name_value(extra, "HTTP_X_7", "repeated");
+
+        attach("/index", "");
+
+        for(int i = 0 ; i != 100 ; i++) {
+            snprintf(name, sizeof(name), "HTTP_X_%d", i);
+            snprintf(value, sizeof(value), "%d", i);
+            CPPUNIT_ASSERT_EQUAL(std::string(value), request->get_fcgi_param(name).str());
+        }
+
+        CPPUNIT_ASSERT(!request->has_fcgi_param("HTTP_X_100"));
+    }
+
+    void test_query_arg()
+    {
+        attach("/index", "p=42");
+
+        CPPUNIT_ASSERT(request->has_param("p"));
+        CPPUNIT_ASSERT_EQUAL(std::string("42"), request->get_param("p").str());
+        CPPUNIT_ASSERT(!request->has_param("q"));
+    }
+
+    void test_query_args()
+    {
+        attach("/index", "a=1&b=%D0%BF+%26&empty=&novalue&&c=x%3Dy&bad=%4&a=2");
+
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), request->get_param("a").str());
+        CPPUNIT_ASSERT_EQUAL(std::string("\xd0\xbf &"), request->get_param("b").str());
+        CPPUNIT_ASSERT(request->has_param("empty"));
+        CPPUNIT_ASSERT(request->has_param("novalue"));
+        CPPUNIT_ASSERT_EQUAL(std::string("x=y"), request->get_param("c").str());
+        CPPUNIT_ASSERT_EQUAL(std::string("%4"), request->get_param("bad").str());
+    }
+
+    void test_reuse()
+    {
+        attach("/first", "p=1");
+
+        request->clear();
+        request_arena.reset();
+
+        /*
+         * Nothing of the previous request is visible
+         */
+        attach("/second", "q=2");
+
+        CPPUNIT_ASSERT_EQUAL(std::string("/second"), request->get_script_name().str());
+        CPPUNIT_ASSERT(!request->has_param("p"));
+        CPPUNIT_ASSERT_EQUAL(std::string("2"), request->get_param("q").str());
+    }
+
+    void test_urlencoded()
+    {
+        parse(URLENCODED, "a=1&b=%D0%BF+%26&empty=&novalue&&c=x%3Dy");
+
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), param("a"));
+        CPPUNIT_ASSERT_EQUAL(std::string("\xd0\xbf &"), param("b"));
+        CPPUNIT_ASSERT(request->has_formdata_param("empty"));
+        CPPUNIT_ASSERT(request->has_formdata_param("novalue"));
+        CPPUNIT_ASSERT_EQUAL(std::string("x=y"), param("c"));
+    }
+
+    void test_urlencoded_chunk_boundary()
+    {
+        std::string value(20000, 'v');
+
+        /*
+         * '=' and '&' land on both sides of the first chunk boundary
+         */
+        for(size_t pad = 16380 ; pad != 16390 ; pad++) {
+            tearDown();
+            setUp();
+
+            parse(URLENCODED, std::string(pad, 'n') + "=%41" + value + "&x=%42");
+
+            CPPUNIT_ASSERT_EQUAL("A" + value, param(std::string(pad, 'n')));
+            CPPUNIT_ASSERT_EQUAL(std::string("B"), param("x"));
+        }
+    }
+
+    void test_urlencoded_too_large()
+    {
+        CPPUNIT_ASSERT_THROW(parse(URLENCODED, "a=" + std::string(1024 * 1024, 'x')), fcgi_exception);
+    }
+
+    void test_multipart()
+    {
+        std::string body =
+            part("f1", "value 1") +
+            part("f2", "") +
+            part("f3", "line\r\nline\r\n") +
+            "--" BOUNDARY "--\r\n";
+
+        parse(MULTIPART, body);
+
+        CPPUNIT_ASSERT_EQUAL((size_t)3, request->get_form_parts().size());
+        CPPUNIT_ASSERT_EQUAL(std::string("value 1"), param("f1"));
+        CPPUNIT_ASSERT_EQUAL(std::string(""), param("f2"));
+        CPPUNIT_ASSERT_EQUAL(std::string("line\r\nline\r\n"), param("f3"));
+    }
+
+    void test_multipart_file()
+    {
+        std::string body =
+            "--" BOUNDARY "\r\n"
+            "Content-Disposition: form-data; name=\"upload\"; filename=\"a.txt\"\r\n"
+            "Content-Type: text/plain\r\n"
+            "\r\n"
+            "file content\r\n"
+            "--" BOUNDARY "--\r\n";
+
+        parse(MULTIPART, body);
+
+        const fcgi_form_part *p = request->get_form_part("upload");
+
+        CPPUNIT_ASSERT(p != 0);
+        CPPUNIT_ASSERT_EQUAL(std::string("a.txt"), p->filename.str());
+        CPPUNIT_ASSERT_EQUAL(std::string("text/plain"), p->content_type.str());
+        CPPUNIT_ASSERT_EQUAL((size_t)12, p->size);
+        CPPUNIT_ASSERT_EQUAL(std::string("file content"), request->map_form_part(*p).str());
+    }
+
+    void test_multipart_partial_delimiter()
+    {
+        /*
+         * Prefixes of the delimiter inside content are content
+         */
+        std::string value = "a\r\n--" BOUNDARY_PREFIX "\r\n-\r\r\n--\n--" BOUNDARY_PREFIX "x";
+
+        parse(MULTIPART, part("f", value) + "--" BOUNDARY "--\r\n");
+
+        CPPUNIT_ASSERT_EQUAL(value, param("f"));
+    }
+
+    void test_multipart_chunk_boundary()
+    {
+        /*
+         * Delimiter starts at every offset around the first chunk boundary
+         */
+        for(size_t len = 16300 ; len != 16400 ; len++) {
+            tearDown();
+            setUp();
+
+            std::string value(len, 'x');
+
+            parse(MULTIPART, part("f", value) + part("g", "y") + "--" BOUNDARY "--\r\n");
+
+            CPPUNIT_ASSERT_EQUAL(value, param("f"));
+            CPPUNIT_ASSERT_EQUAL(std::string("y"), param("g"));
+        }
+    }
+
+    void test_multipart_lf_delimiter()
+    {
+        /*
+         * IE 5.0 ends parts with LF only
+         */
+        std::string value(20000, 'x');
+
+        parse(MULTIPART, "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"f\"\r\n\r\n" + value +
+            "\n" + part("g", "a\r\nb") + "--" BOUNDARY "--\r\n");
+
+        CPPUNIT_ASSERT_EQUAL(value, param("f"));
+        CPPUNIT_ASSERT_EQUAL(std::string("a\r\nb"), param("g"));
+    }
+
+    void test_multipart_spooled_part()
+    {
+        std::string value;
+
+        for(size_t i = 0 ; i != 100000 ; i++) {
+            value += (char)('a' + i % 26);
+        }
+
+        parse(MULTIPART, part("big", value) + part("small", "s") + "--" BOUNDARY "--\r\n");
+
+        const fcgi_form_part *p = request->get_form_part("big");
+
+        CPPUNIT_ASSERT(p != 0);
+        CPPUNIT_ASSERT(p->fd != -1);
+        CPPUNIT_ASSERT(!request->has_formdata_param("big"));
+        CPPUNIT_ASSERT_EQUAL(value.size(), p->size);
+        CPPUNIT_ASSERT(request->map_form_part(*p) == value);
+        CPPUNIT_ASSERT_EQUAL(std::string("s"), param("small"));
+    }
+
+    void test_multipart_bad_content_type()
+    {
+        CPPUNIT_ASSERT_THROW(parse("multipart/form-data", part("f", "v")), fcgi_exception);
+        tearDown();
+        setUp();
+        CPPUNIT_ASSERT_THROW(parse("text/plain; boundary=" BOUNDARY, part("f", "v")), fcgi_exception);
+        tearDown();
+        setUp();
+
+        /*
+         * Parameters without a boundary
+         */
+        try {
+            parse("multipart/form-data; charset=utf-8", part("f", "v"));
+            CPPUNIT_FAIL("no exception for missing boundary");
+        }
+        catch(const fcgi_exception &e) {
+            CPPUNIT_ASSERT_EQUAL(HTTP_BAD_REQUEST, e.status());
+        }
+    }
+
+    void test_multipart_unterminated()
+    {
+        CPPUNIT_ASSERT_THROW(parse(MULTIPART, part("f", "v")), fcgi_exception);
+    }
+
+private:
+    static const char *URLENCODED;
+    static const char *MULTIPART;
+
+    static std::string part(const std::string &name, const std::string &value)
+    {
+        return "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"" + name + "\"\r\n\r\n" + value + "\r\n";
+    }
+
+    void attach(const std::string &script_name, const std::string &query_string)
+    {
+        delete data;
+
+        data = new fcgi_request_data(0, 1, FCGI_RESPONDER, false);
+
+        fcgi_encode_name_value(data->params, "SCRIPT_NAME", script_name);
+        fcgi_encode_name_value(data->params, "QUERY_STRING", query_string);
+
+        data->params += extra;
+
+        request->attach(*data);
+    }
+
+    void parse(const std::string &content_type, const std::string &body)
+    {
+        std::ostringstream length;
+
+        length << body.size();
+
+        delete data;
+
+        data = new fcgi_request_data(0, 1, FCGI_RESPONDER, false);
+
+        fcgi_encode_name_value(data->params, "CONTENT_TYPE", content_type);
+        fcgi_encode_name_value(data->params, "CONTENT_LENGTH", length.str());
+
+        data->stdin_data = body;
+        data->stdin_length = body.size();
+
+        request->attach(*data);
+        request->parse_form_data();
+    }
+
+    std::string param(const std::string &name) const
+    {
+        return request->get_formdata_param(name).str();
+    }
+
+private:
+    fcgi_values values;
+    std::string extra;
+    arena request_arena;
+    fcgi_request *request;
+    fcgi_request_data *data;
+};
+
+const char *fcgi_handler_test::URLENCODED = "application/x-www-form-urlencoded";
+const char *fcgi_handler_test::MULTIPART = "multipart/form-data; boundary=" BOUNDARY;
+
+CPPUNIT_TEST_SUITE_REGISTRATION(fcgi_handler_test);
@@ -0,0 +1,129 @@
+
+#include "fcgi_protocol.h"
+
+namespace fp {
+
+bool fcgi_decode_header(const u_char *p, fcgi_record_header &h)
+{
+    if(p[0] != FCGI_VERSION_1) {
+        return false;
+    }
+
+    h.type = p[1];
+    h.request_id = (p[2] << 8) | p[3];
+    h.content_length = (p[4] << 8) | p[5];
+    h.padding_length = p[6];
+
+    return true;
+}
+
+void fcgi_encode_header(u_char *p, u_char type, unsigned request_id, size_t content_length, size_t padding_length)
+{
+    p[0] = FCGI_VERSION_1;
+    p[1] = type;
+    p[2] = (request_id >> 8) & 0xff;
+    p[3] = request_id & 0xff;
+    p[4] = (content_length >> 8) & 0xff;
+    p[5] = content_length & 0xff;
+    p[6] = padding_length;
+    p[7] = 0;
+}
+
+static bool decode_length(const u_char *&p, const u_char *end, size_t &len)
+{
+    if(p == end) {
+        return false;
+    }
+
+    if((*p & 0x80) == 0) {
+        len = *p++;
+        return true;
+    }
+
+    if(end - p < 4) {
+        return false;
+    }
+
+    len = ((p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    p += 4;
+
+    return true;
+}
+
+bool fcgi_decode_name_value(const u_char *&p, const u_char *end,
+    const char *&name, size_t &name_len, const char *&value, size_t &value_len)
+{
+    const u_char *q = p;
+
+    if(!decode_length(q, end, name_len) || !decode_length(q, end, value_len)) {
+        return false;
+    }
+
+    if((size_t)(end - q) < name_len || (size_t)(end - q) - name_len < value_len) {
+        return false;
+    }
+
+    name = reinterpret_cast<const char*>(q);
+    value = name + name_len;
+
+    p = q + name_len + value_len;
+
+    return true;
+}
+
+static void encode_length(std::string &out, size_t len)
+{
+    if(len < 0x80) {
+        out.push_back((char)len);
+    }
+    else {
+        out.push_back((char)(((len >> 24) & 0x7f) | 0x80));
+        out.push_back((char)((len >> 16) & 0xff));
+        out.push_back((char)((len >> 8) & 0xff));
+        out.push_back((char)(len & 0xff));
+    }
+}
+
+void fcgi_encode_name_value(std::string &out, const std::string &name, const std::string &value)
+{
+    encode_length(out, name.size());
+    encode_length(out, value.size());
+    out.append(name);
+    out.append(value);
+}
+
+void fcgi_append_record(std::string &out, u_char type, unsigned request_id, const char *data, size_t len)
+{
+    static const char padding[8] = { 0 };
+    u_char header[FCGI_HEADER_LEN];
+
+    do {
+        size_t chunk = len > FCGI_MAX_CONTENT_LEN ? FCGI_MAX_CONTENT_LEN : len;
+        size_t padding_len = (8 - (chunk & 7)) & 7;
+
+        fcgi_encode_header(header, type, request_id, chunk, padding_len);
+
+        out.append(reinterpret_cast<const char*>(header), FCGI_HEADER_LEN);
+        out.append(data, chunk);
+        out.append(padding, padding_len);
+
+        data += chunk;
+        len -= chunk;
+    } while(len != 0);
+}
+
+void fcgi_append_end_request(std::string &out, unsigned request_id, unsigned app_status, u_char protocol_status)
+{
+    char body[8];
+
+    body[0] = (app_status >> 24) & 0xff;
+    body[1] = (app_status >> 16) & 0xff;
+    body[2] = (app_status >> 8) & 0xff;
+    body[3] = app_status & 0xff;
+    body[4] = protocol_status;
+    body[5] = body[6] = body[7] = 0;
+
+    fcgi_append_record(out, FCGI_END_REQUEST, request_id, body, sizeof(body));
+}
+
+};
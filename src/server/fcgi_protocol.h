@@ -0,0 +1,104 @@
+
+#ifndef _FCGI_PROTOCOL_H_
+#define _FCGI_PROTOCOL_H_
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace fp {
+
+/*
+ * FastCGI protocol constants (FastCGI Specification 1.0)
+ */
+static const u_char FCGI_VERSION_1                      = 1;
+
+static const size_t FCGI_HEADER_LEN                     = 8;
+static const size_t FCGI_MAX_CONTENT_LEN                = 65535;
+static const size_t FCGI_MAX_RECORD_LEN                 = FCGI_HEADER_LEN + FCGI_MAX_CONTENT_LEN + 255;
+
+static const unsigned FCGI_NULL_REQUEST_ID              = 0;
+
+/*
+ * Record types
+ */
+static const u_char FCGI_BEGIN_REQUEST                  = 1;
+static const u_char FCGI_ABORT_REQUEST                  = 2;
+static const u_char FCGI_END_REQUEST                    = 3;
+static const u_char FCGI_PARAMS                         = 4;
+static const u_char FCGI_STDIN                          = 5;
+static const u_char FCGI_STDOUT                         = 6;
+static const u_char FCGI_STDERR                         = 7;
+static const u_char FCGI_DATA                           = 8;
+static const u_char FCGI_GET_VALUES                     = 9;
+static const u_char FCGI_GET_VALUES_RESULT              = 10;
+static const u_char FCGI_UNKNOWN_TYPE                   = 11;
+
+/*
+ * Roles
+ */
+static const unsigned FCGI_RESPONDER                    = 1;
+static const unsigned FCGI_AUTHORIZER                   = 2;
+static const unsigned FCGI_FILTER                       = 3;
+
+/*
+ * Flags of FCGI_BEGIN_REQUEST
+ */
+static const u_char FCGI_KEEP_CONN                      = 1;
+
+/*
+ * Protocol status of FCGI_END_REQUEST
+ */
+static const u_char FCGI_REQUEST_COMPLETE               = 0;
+static const u_char FCGI_CANT_MPX_CONN                  = 1;
+static const u_char FCGI_OVERLOADED                     = 2;
+static const u_char FCGI_UNKNOWN_ROLE                   = 3;
+
+struct fcgi_record_header {
+    u_char      type;
+    unsigned    request_id;
+    size_t      content_length;
+    size_t      padding_length;
+};
+
+/*
+ * Decode record header
+ *
+ * @param p pointer to FCGI_HEADER_LEN bytes of input
+ * @return false if record version is not supported
+ */
+bool fcgi_decode_header(const u_char *p, fcgi_record_header &h);
+
+/*
+ * Encode record header into FCGI_HEADER_LEN bytes at p
+ */
+void fcgi_encode_header(u_char *p, u_char type, unsigned request_id, size_t content_length, size_t padding_length);
+
+/*
+ * Decode one name-value pair and advance p past it
+ *
+ * @return false if the pair is truncated
+ */
+bool fcgi_decode_name_value(const u_char *&p, const u_char *end,
+    const char *&name, size_t &name_len, const char *&value, size_t &value_len);
+
+/*
+ * Append name-value pair to a parameter stream
+ */
+void fcgi_encode_name_value(std::string &out, const std::string &name, const std::string &value);
+
+/*
+ * Append one or more records carrying data to out. Records are split
+ * at FCGI_MAX_CONTENT_LEN and padded to 8 byte boundary. Empty data
+ * produces a single empty record, which terminates a stream
+ */
+void fcgi_append_record(std::string &out, u_char type, unsigned request_id, const char *data, size_t len);
+
+/*
+ * Append FCGI_END_REQUEST record to out
+ */
+void fcgi_append_end_request(std::string &out, unsigned request_id, unsigned app_status, u_char protocol_status);
+
+};
+
+#endif //_FCGI_PROTOCOL_H_
@@ -0,0 +1,409 @@
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "fcgi_protocol.h"
+#include "fcgi_connection.h"
+
+using namespace fp;
+
+/*
+ * Record encoding and decoding, and decoding of records as they arrive
+ * on a connection: split at any byte, several per read, multiplexed
+ */
+class fcgi_protocol_test : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(fcgi_protocol_test);
+    CPPUNIT_TEST(test_header);
+    CPPUNIT_TEST(test_name_value);
+    CPPUNIT_TEST(test_truncated_name_value);
+    CPPUNIT_TEST(test_record_split);
+    CPPUNIT_TEST(test_end_request);
+    CPPUNIT_TEST(test_connection_request);
+    CPPUNIT_TEST(test_connection_split_records);
+    CPPUNIT_TEST(test_connection_multiplexed);
+    CPPUNIT_TEST(test_connection_get_values);
+    CPPUNIT_TEST(test_connection_bad_version);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp()
+    {
+        values.max_conns = 10;
+        values.max_reqs = 10;
+        values.mpxs_conns = true;
+        values.spool_threshold = 1024 * 1024;
+        values.spool_dir = "/tmp";
+        values.max_body = 0;
+
+        int fds[2];
+
+        CPPUNIT_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+        server_fd = fds[0];
+        client_fd = fds[1];
+
+        /*
+         * Connection reads until EAGAIN, as on an accepted socket
+         */
+        fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+        epoll_fd = epoll_create(1);
+
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = 0;
+
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+
+        conn = new fcgi_connection(server_fd, epoll_fd, values);
+    }
+
+    void tearDown()
+    {
+        conn->close();
+
+        ::close(client_fd);
+        ::close(epoll_fd);
+    }
+
+    void test_header()
+    {
+        u_char buf[FCGI_HEADER_LEN];
+        fcgi_record_header h;
+
+        fcgi_encode_header(buf, FCGI_STDIN, 0x1234, 0xfedc, 4);
+
+        CPPUNIT_ASSERT(fcgi_decode_header(buf, h));
+        CPPUNIT_ASSERT_EQUAL((int)FCGI_STDIN, (int)h.type);
+        CPPUNIT_ASSERT_EQUAL(0x1234u, h.request_id);
+        CPPUNIT_ASSERT_EQUAL((size_t)0xfedc, h.content_length);
+        CPPUNIT_ASSERT_EQUAL((size_t)4, h.padding_length);
+
+        buf[0] = 2;
+
+        CPPUNIT_ASSERT(!fcgi_decode_header(buf, h));
+    }
+
+    void test_name_value()
+    {
+        std::string out;
+        std::string long_value(300, 'v');
+
+        fcgi_encode_name_value(out, "SCRIPT_NAME", "/index");
+        fcgi_encode_name_value(out, "LONG", long_value);
+        fcgi_encode_name_value(out, "EMPTY", "");
+
+        const u_char *p = (const u_char*)out.data(), *end = p + out.size();
+        const char *name, *value;
+        size_t name_len, value_len;
+
+        CPPUNIT_ASSERT(fcgi_decode_name_value(p, end, name, name_len, value, value_len));
+        CPPUNIT_ASSERT_EQUAL(std::string("SCRIPT_NAME"), std::string(name, name_len));
+        CPPUNIT_ASSERT_EQUAL(std::string("/index"), std::string(value, value_len));
+
+        /*
+         * Values over 127 bytes have four byte length
+         */
+        CPPUNIT_ASSERT(fcgi_decode_name_value(p, end, name, name_len, value, value_len));
+        CPPUNIT_ASSERT_EQUAL(std::string("LONG"), std::string(name, name_len));
+        CPPUNIT_ASSERT_EQUAL(long_value, std::string(value, value_len));
+
+        CPPUNIT_ASSERT(fcgi_decode_name_value(p, end, name, name_len, value, value_len));
+        CPPUNIT_ASSERT_EQUAL(std::string("EMPTY"), std::string(name, name_len));
+        CPPUNIT_ASSERT_EQUAL((size_t)0, value_len);
+
+        CPPUNIT_ASSERT(p == end);
+    }
+
+    void test_truncated_name_value()
+    {
+        std::string out;
+
+        fcgi_encode_name_value(out, "NAME", std::string(200, 'v'));
+
+        for(size_t len = 0 ; len != out.size() ; len++) {
+            const u_char *p = (const u_char*)out.data();
+            const char *name, *value;
+            size_t name_len, value_len;
+
+            CPPUNIT_ASSERT(!fcgi_decode_name_value(p, p + len, name, name_len, value, value_len));
+        }
+    }
+
+    void test_record_split()
+    {
+        std::string data(FCGI_MAX_CONTENT_LEN + 100, 'x');
+        std::string out;
+        fcgi_record_header h;
+
+        fcgi_append_record(out, FCGI_STDOUT, 1, data.data(), data.size());
+
+        CPPUNIT_ASSERT(fcgi_decode_header((const u_char*)out.data(), h));
+        CPPUNIT_ASSERT_EQUAL(FCGI_MAX_CONTENT_LEN, h.content_length);
+
+        size_t second = FCGI_HEADER_LEN + h.content_length + h.padding_length;
+
+        CPPUNIT_ASSERT_EQUAL((size_t)0, second % 8);
+        CPPUNIT_ASSERT(fcgi_decode_header((const u_char*)out.data() + second, h));
+        CPPUNIT_ASSERT_EQUAL((size_t)100, h.content_length);
+        CPPUNIT_ASSERT_EQUAL((size_t)4, h.padding_length);
+        CPPUNIT_ASSERT_EQUAL(second + FCGI_HEADER_LEN + 104, out.size());
+
+        /*
+         * Empty data terminates the stream with an empty record
+         */
+        out.clear();
+        fcgi_append_record(out, FCGI_STDOUT, 1, 0, 0);
+
+        CPPUNIT_ASSERT_EQUAL(FCGI_HEADER_LEN, out.size());
+        CPPUNIT_ASSERT(fcgi_decode_header((const u_char*)out.data(), h));
+        CPPUNIT_ASSERT_EQUAL((size_t)0, h.content_length);
+    }
+
+    void test_end_request()
+    {
+        std::string out;
+        fcgi_record_header h;
+
+        fcgi_append_end_request(out, 7, 0x01020304, FCGI_OVERLOADED);
+
+        CPPUNIT_ASSERT_EQUAL(FCGI_HEADER_LEN + 8, out.size());
+        CPPUNIT_ASSERT(fcgi_decode_header((const u_char*)out.data(), h));
+        CPPUNIT_ASSERT_EQUAL((int)FCGI_END_REQUEST, (int)h.type);
+        CPPUNIT_ASSERT_EQUAL(7u, h.request_id);
+
+        const u_char *body = (const u_char*)out.data() + FCGI_HEADER_LEN;
+
+        CPPUNIT_ASSERT_EQUAL(0x01020304u, (unsigned)((body[0] << 24) | (body[1] << 16) | (body[2] << 8) | body[3]));
+        CPPUNIT_ASSERT_EQUAL((int)FCGI_OVERLOADED, (int)body[4]);
+    }
+
+    void test_connection_request()
+    {
+        std::string in = request(1, "/index", "body", true);
+        fcgi_connection::request_list_t completed;
+
+        send(in);
+
+        CPPUNIT_ASSERT(conn->on_readable(completed));
+        CPPUNIT_ASSERT_EQUAL((size_t)1, completed.size());
+
+        fcgi_request_data *r = completed.front();
+
+        CPPUNIT_ASSERT_EQUAL(1u, r->id);
+        CPPUNIT_ASSERT(r->keep_conn);
+        CPPUNIT_ASSERT_EQUAL(std::string("body"), r->stdin_data);
+        CPPUNIT_ASSERT_EQUAL(std::string("/index"), param(r, "SCRIPT_NAME"));
+
+        conn->end_request(r, 0);
+
+        fcgi_record_header h;
+
+        CPPUNIT_ASSERT(receive(h));
+        CPPUNIT_ASSERT_EQUAL((int)FCGI_END_REQUEST, (int)h.type);
+        CPPUNIT_ASSERT_EQUAL(1u, h.request_id);
+    }
+
+    void test_connection_split_records()
+    {
+        std::string in = request(1, "/a", std::string(70000, 'b'), true) + request(2, "/b", "", true);
+        fcgi_connection::request_list_t completed;
+
+        /*
+         * Deliver the stream in pieces that split headers and contents
+         */
+        for(size_t pos = 0 ; pos < in.size() ; pos += 3) {
+            send(in.substr(pos, 3));
+            CPPUNIT_ASSERT(conn->on_readable(completed));
+        }
+
+        CPPUNIT_ASSERT_EQUAL((size_t)2, completed.size());
+        CPPUNIT_ASSERT_EQUAL((size_t)70000, completed.front()->stdin_data.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("/b"), param(completed.back(), "SCRIPT_NAME"));
+
+        end_all(completed);
+    }
+
+    void test_connection_multiplexed()
+    {
+        std::string a = request(1, "/a", "first", true);
+        std::string b = request(2, "/b", "second", true);
+        std::string in;
+        size_t ra = 0, rb = 0;
+
+        /*
+         * Interleave records of both requests
+         */
+        while(ra != a.size() || rb != b.size()) {
+            ra += copy_record(a, ra, in);
+            rb += copy_record(b, rb, in);
+        }
+
+        fcgi_connection::request_list_t completed;
+
+        send(in);
+
+        CPPUNIT_ASSERT(conn->on_readable(completed));
+        CPPUNIT_ASSERT_EQUAL((size_t)2, completed.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("first"), completed.front()->stdin_data);
+        CPPUNIT_ASSERT_EQUAL(std::string("second"), completed.back()->stdin_data);
+
+        end_all(completed);
+    }
+
+    void test_connection_get_values()
+    {
+        std::string query, in;
+
+        fcgi_encode_name_value(query, "FCGI_MAX_CONNS", "");
+        fcgi_encode_name_value(query, "FCGI_MPXS_CONNS", "");
+        fcgi_append_record(in, FCGI_GET_VALUES, FCGI_NULL_REQUEST_ID, query.data(), query.size());
+
+        fcgi_connection::request_list_t completed;
+
+        send(in);
+
+        CPPUNIT_ASSERT(conn->on_readable(completed));
+        CPPUNIT_ASSERT(completed.empty());
+
+        fcgi_record_header h;
+        std::string content;
+
+        CPPUNIT_ASSERT(receive(h, &content));
+        CPPUNIT_ASSERT_EQUAL((int)FCGI_GET_VALUES_RESULT, (int)h.type);
+
+        const u_char *p = (const u_char*)content.data(), *end = p + content.size();
+        const char *name, *value;
+        size_t name_len, value_len;
+
+        CPPUNIT_ASSERT(fcgi_decode_name_value(p, end, name, name_len, value, value_len));
+        CPPUNIT_ASSERT_EQUAL(std::string("FCGI_MAX_CONNS"), std::string(name, name_len));
+        CPPUNIT_ASSERT_EQUAL(std::string("10"), std::string(value, value_len));
+
+        CPPUNIT_ASSERT(fcgi_decode_name_value(p, end, name, name_len, value, value_len));
+        CPPUNIT_ASSERT_EQUAL(std::string("FCGI_MPXS_CONNS"), std::string(name, name_len));
+        CPPUNIT_ASSERT_EQUAL(std::string("1"), std::string(value, value_len));
+    }
+
+    void test_connection_bad_version()
+    {
+        std::string in = request(1, "/a", "", true);
+        fcgi_connection::request_list_t completed;
+
+        in[0] = 2;
+
+        send(in);
+
+        CPPUNIT_ASSERT(!conn->on_readable(completed));
+        CPPUNIT_ASSERT(completed.empty());
+    }
+
+private:
+    static std::string request(unsigned id, const std::string &script_name, const std::string &body, bool keep_conn)
+    {
+        std::string out, params;
+        char begin[8] = { 0 };
+
+        begin[1] = FCGI_RESPONDER;
+        begin[2] = keep_conn ? FCGI_KEEP_CONN : 0;
+
+        fcgi_append_record(out, FCGI_BEGIN_REQUEST, id, begin, sizeof(begin));
+
+        fcgi_encode_name_value(params, "SCRIPT_NAME", script_name);
+        fcgi_encode_name_value(params, "REQUEST_METHOD", "POST");
+
+        fcgi_append_record(out, FCGI_PARAMS, id, params.data(), params.size());
+        fcgi_append_record(out, FCGI_PARAMS, id, 0, 0);
+
+        if(!body.empty()) {
+            fcgi_append_record(out, FCGI_STDIN, id, body.data(), body.size());
+        }
+
+        fcgi_append_record(out, FCGI_STDIN, id, 0, 0);
+
+        return out;
+    }
+
+    static size_t copy_record(const std::string &in, size_t pos, std::string &out)
+    {
+        fcgi_record_header h;
+
+        if(pos == in.size()) {
+            return 0;
+        }
+
+        fcgi_decode_header((const u_char*)in.data() + pos, h);
+
+        size_t len = FCGI_HEADER_LEN + h.content_length + h.padding_length;
+
+        out.append(in, pos, len);
+
+        return len;
+    }
+
+    static std::string param(const fcgi_request_data *r, const std::string &name)
+    {
+        const u_char *p = (const u_char*)r->params.data(), *end = p + r->params.size();
+        const char *n, *v;
+        size_t n_len, v_len;
+
+        while(fcgi_decode_name_value(p, end, n, n_len, v, v_len)) {
+            if(name == std::string(n, n_len)) {
+                return std::string(v, v_len);
+            }
+        }
+
+        return std::string();
+    }
+
+    void send(const std::string &data)
+    {
+        CPPUNIT_ASSERT_EQUAL((ssize_t)data.size(), ::write(client_fd, data.data(), data.size()));
+    }
+
+    bool receive(fcgi_record_header &h, std::string *content = 0)
+    {
+        u_char header[FCGI_HEADER_LEN];
+        char buf[FCGI_MAX_RECORD_LEN];
+
+        if(::recv(client_fd, header, sizeof(header), MSG_WAITALL) != (ssize_t)sizeof(header)
+            || !fcgi_decode_header(header, h))
+        {
+            return false;
+        }
+
+        size_t len = h.content_length + h.padding_length;
+
+        if(len != 0 && ::recv(client_fd, buf, len, MSG_WAITALL) != (ssize_t)len) {
+            return false;
+        }
+
+        if(content != 0) {
+            content->assign(buf, h.content_length);
+        }
+
+        return true;
+    }
+
+    void end_all(fcgi_connection::request_list_t &completed)
+    {
+        for(fcgi_connection::request_list_t::iterator i = completed.begin() ; i != completed.end() ; i++) {
+            conn->end_request(*i, 0);
+        }
+
+        completed.clear();
+    }
+
+private:
+    fcgi_values values;
+    fcgi_connection *conn;
+    int server_fd, client_fd, epoll_fd;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(fcgi_protocol_test);
@@ -0,0 +1,119 @@
+
+#include <string.h>
+
+#include "fcgi_router.h"
+
+namespace fp {
+
+fcgi_router::node::~node()
+{
+    for(std::vector<node*>::iterator i = children.begin() ; i != children.end() ; i++) {
+        delete *i;
+    }
+}
+
+fcgi_router::node *fcgi_router::node::find_child(char c) const
+{
+    const char *p = static_cast<const char*>(memchr(first_chars.data(), c, first_chars.size()));
+
+    return p != NULL ? children[p - first_chars.data()] : 0;
+}
+
+fcgi_router::fcgi_router()
+    : root(new node())
+{
+}
+
+fcgi_router::~fcgi_router()
+{
+    delete root;
+}
+
+void fcgi_router::add(const std::string &_location, fcgi_handler *_handler, bool _exact)
+{
+    node *n = root;
+    size_t pos = 0;
+
+    while(pos != _location.size()) {
+        node *child = n->find_child(_location[pos]);
+
+        if(child == 0) {
+            /*
+             * Rest of the location becomes a new leaf
+             */
+            child = new node();
+            child->label.assign(_location, pos, std::string::npos);
+
+            n->first_chars.push_back(_location[pos]);
+            n->children.push_back(child);
+
+            n = child;
+            break;
+        }
+
+        size_t common = 0;
+
+        while(common != child->label.size() && pos + common != _location.size()
+            && child->label[common] == _location[pos + common])
+        {
+            common++;
+        }
+
+        if(common != child->label.size()) {
+            /*
+             * Split the edge at the first mismatch
+             */
+            node *middle = new node();
+
+            middle->label.assign(child->label, 0, common);
+            child->label.erase(0, common);
+
+            middle->first_chars.push_back(child->label[0]);
+            middle->children.push_back(child);
+
+            n->children[n->first_chars.find(middle->label[0])] = middle;
+
+            child = middle;
+        }
+
+        n = child;
+        pos += common;
+    }
+
+    if(_exact) {
+        n->exact_handler = _handler;
+    }
+    else {
+        n->prefix_handler = _handler;
+    }
+}
+
+fcgi_handler *fcgi_router::find(const string_ref &_uri) const
+{
+    const node *n = root;
+    const char *p = _uri.data();
+    const char *end = p + _uri.size();
+    fcgi_handler *longest_prefix = root->prefix_handler;
+
+    for(;;) {
+        if(p == end) {
+            return n->exact_handler != 0 ? n->exact_handler : longest_prefix;
+        }
+
+        n = n->find_child(*p);
+
+        if(n == 0 || (size_t)(end - p) < n->label.size()
+            || memcmp(p, n->label.data(), n->label.size()) != 0)
+        {
+            return longest_prefix;
+        }
+
+        p += n->label.size();
+
+        if(n->prefix_handler != 0) {
+            longest_prefix = n->prefix_handler;
+        }
+    }
+}
+
+};
@@ -0,0 +1,75 @@
+
+#ifndef _FCGI_ROUTER_H_
+#define _FCGI_ROUTER_H_
+
+#include <string>
+#include <vector>
+
+#include "fcgi_handler.h"
+
+namespace fp {
+
+/*
+ * Radix trie of location mappings. Exact and prefix mappings share the
+ * trie, a lookup walks the URI once and returns the handler of exact
+ * match if there is one, otherwise the handler of the longest matching
+ * prefix. Router is built once and never modified while it is in use
+ */
+class fcgi_router {
+public:
+    fcgi_router();
+    ~fcgi_router();
+
+    /*
+     * Map URI or URI prefix to handler. Mapping the same location
+     * again replaces its handler
+     */
+    void add(const std::string &_location, fcgi_handler *_handler, bool _exact);
+
+    /*
+     * Find handler for URI
+     *
+     * @return handler or 0 if no location matches
+     */
+    fcgi_handler *find(const string_ref &_uri) const;
+
+private:
+    struct node {
+        node()
+            : label()
+            , exact_handler(0)
+            , prefix_handler(0)
+            , first_chars()
+            , children()
+        {
+        }
+
+        ~node();
+
+        node *find_child(char c) const;
+
+        /*
+         * Edge label leading to this node
+         */
+        std::string         label;
+
+        fcgi_handler        *exact_handler;
+        fcgi_handler        *prefix_handler;
+
+        /*
+         * First character of each child's label, in the order of children
+         */
+        std::string         first_chars;
+        std::vector<node*>  children;
+    };
+
+    fcgi_router(const fcgi_router&);
+    fcgi_router &operator=(const fcgi_router&);
+
+private:
+    node        *root;
+};
+
+};
+
+#endif //_FCGI_ROUTER_H_
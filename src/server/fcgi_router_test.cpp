@@ -0,0 +1,100 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "fcgi_router.h"
+
+using namespace fp;
+
+class fcgi_router_test : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(fcgi_router_test);
+    CPPUNIT_TEST(test_empty);
+    CPPUNIT_TEST(test_longest_prefix);
+    CPPUNIT_TEST(test_exact);
+    CPPUNIT_TEST(test_split_edge);
+    CPPUNIT_TEST(test_replace);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    class null_handler : public fcgi_handler {
+    public:
+        virtual void init() {}
+        virtual void shutdown() {}
+        virtual void handle(fcgi_request&, fcgi_response&) {}
+    };
+
+    null_handler root, blog, blog_feed, exact_blog, other;
+
+public:
+    void test_empty()
+    {
+        fcgi_router router;
+
+        CPPUNIT_ASSERT(router.find("/") == 0);
+        CPPUNIT_ASSERT(router.find("") == 0);
+    }
+
+    void test_longest_prefix()
+    {
+        fcgi_router router;
+
+        router.add("/", &root, false);
+        router.add("/blog", &blog, false);
+        router.add("/blog/feed", &blog_feed, false);
+
+        CPPUNIT_ASSERT(router.find("/") == &root);
+        CPPUNIT_ASSERT(router.find("/about") == &root);
+        CPPUNIT_ASSERT(router.find("/blo") == &root);
+        CPPUNIT_ASSERT(router.find("/blog") == &blog);
+        CPPUNIT_ASSERT(router.find("/blogroll") == &blog);
+        CPPUNIT_ASSERT(router.find("/blog/feed/atom") == &blog_feed);
+        CPPUNIT_ASSERT(router.find("/blog/fee") == &blog);
+        CPPUNIT_ASSERT(router.find("") == 0);
+    }
+
+    void test_exact()
+    {
+        fcgi_router router;
+
+        router.add("/", &root, false);
+        router.add("/blog", &blog, false);
+        router.add("/blog", &exact_blog, true);
+
+        /*
+         * Exact mapping takes precedence over a prefix of the same location
+         */
+        CPPUNIT_ASSERT(router.find("/blog") == &exact_blog);
+        CPPUNIT_ASSERT(router.find("/blog/") == &blog);
+        CPPUNIT_ASSERT(router.find("/bl") == &root);
+    }
+
+    void test_split_edge()
+    {
+        fcgi_router router;
+
+        /*
+         * Locations added in an order that splits existing edges
+         */
+        router.add("/sitemap.xml", &other, true);
+        router.add("/sitemap", &blog, false);
+        router.add("/si", &root, false);
+        router.add("/site", &blog_feed, false);
+
+        CPPUNIT_ASSERT(router.find("/sitemap.xml") == &other);
+        CPPUNIT_ASSERT(router.find("/sitemap.xml.gz") == &blog);
+        CPPUNIT_ASSERT(router.find("/sitemap-1.xml") == &blog);
+        CPPUNIT_ASSERT(router.find("/site/") == &blog_feed);
+        CPPUNIT_ASSERT(router.find("/sit") == &root);
+        CPPUNIT_ASSERT(router.find("/s") == 0);
+    }
+
+    void test_replace()
+    {
+        fcgi_router router;
+
+        router.add("/blog", &blog, false);
+        router.add("/blog", &other, false);
+
+        CPPUNIT_ASSERT(router.find("/blog/1") == &other);
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(fcgi_router_test);
@@ -2,14 +2,20 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
 #include <sstream>
 #include <stdexcept>
+#include <algorithm>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
-
-#include <fcgiapp.h>
-#include <fcgio.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 
 #include <logger/logger.h>
 
@@ -18,19 +24,62 @@
 #include "fcgi_server.h"
 #include "fcgi_handler.h"
 
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
+#endif
+
 namespace fp {
 
 sig_atomic_t fcgi_server::m_exiting = false;
 
 fcgi_server::fcgi_server(const std::string &_endpoint)
-    : endpoint(_endpoint)
+    : endpoints(1, _endpoint)
+    , event_threads(2)
+    , listening_sockets()
+    , listen_backlog(511)
+    , reuseport(false)
+    , defer_accept(0)
+    , request_queue()
+    , queue_length(0)
+    , num_threads(0)
+    , num_idle(0)
+    , idle_timeout(60)
+    , cache(0)
+    , shared_cache(0)
+    , router(new fcgi_router())
+    , router_epoch(0)
+    , min_threads(5)
+    , max_threads(40)
 {
     int rc;
 
-    rc = pthread_mutex_init(&accept_mutex, NULL);
+    router_readers[0] = router_readers[1] = 0;
+
+    rc = pthread_mutex_init(&mapping_lock, NULL);
+
+    if(rc != 0)
+        throw fcgi_server_exception("cannot initialize mapping mutex");
+
+    rc = pthread_mutex_init(&queue_lock, NULL);
+
+    if(rc != 0)
+        throw fcgi_server_exception("cannot initialize request queue mutex");
+
+    rc = pthread_cond_init(&queue_not_empty, NULL);
 
     if(rc != 0)
-        throw fcgi_server_exception("cannot initialize accept mutex");
+        throw fcgi_server_exception("cannot initialize request queue condition");
+
+    rc = pthread_cond_init(&workers_exited, NULL);
+
+    if(rc != 0)
+        throw fcgi_server_exception("cannot initialize worker pool condition");
+
+    values.spool_threshold = 64 * 1024;
+    values.spool_dir = "/tmp";
+    values.max_body = 0;
+
+    set_threads(min_threads, max_threads);
 }
 
 fcgi_server::~fcgi_server()
@@ -38,17 +87,149 @@ fcgi_server::~fcgi_server()
     for(handler_list_t::iterator i = handlers.begin() ; i != handlers.end() ; i++ )
         delete *i;
 
-    pthread_mutex_destroy(&accept_mutex);
+    for(fcgi_connection::request_list_t::iterator i = request_queue.begin() ; i != request_queue.end() ; i++ )
+        (*i)->conn->end_request(*i, 0);
+
+    delete router;
+    delete cache;
+
+    pthread_mutex_destroy(&mapping_lock);
+    pthread_cond_destroy(&workers_exited);
+    pthread_cond_destroy(&queue_not_empty);
+    pthread_mutex_destroy(&queue_lock);
+}
+
+void fcgi_server::add_endpoint(const std::string &_endpoint) {
+    endpoints.push_back(_endpoint);
+}
+
+void fcgi_server::set_event_threads(unsigned _num_event_threads) {
+    if(_num_event_threads == 0)
+        throw fcgi_server_exception("at least one event thread is required");
+
+    event_threads.resize(_num_event_threads);
+}
+
+int fcgi_server::open_socket(const std::string &_endpoint, bool _shared)
+{
+    size_t colon = _endpoint.rfind(':');
+    int fd;
+
+    if(colon == std::string::npos) {
+        /*
+         * No port: endpoint is a path of Unix domain socket
+         */
+        struct sockaddr_un sa;
+
+        if(_endpoint.size() >= sizeof(sa.sun_path)) {
+            return -1;
+        }
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        memcpy(sa.sun_path, _endpoint.c_str(), _endpoint.size());
+
+        unlink(_endpoint.c_str());
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if(fd < 0) {
+            return -1;
+        }
+
+        if(bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    else {
+        std::string host(_endpoint, 0, colon);
+        std::string port(_endpoint, colon + 1);
+        struct addrinfo hints, *res, *ai;
+        int on = 1;
+
+        /*
+         * IPv6 address is written in brackets, [::1]:9002
+         */
+        if(host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        if(getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res) != 0) {
+            return -1;
+        }
+
+        fd = -1;
+
+        /*
+         * Bind the first address that works
+         */
+        for(ai = res ; ai != NULL ; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+            if(fd < 0) {
+                continue;
+            }
+
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+            if(!_shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+                LogError("cannot set SO_REUSEPORT on " << _endpoint << ": " << errno);
+                close(fd);
+                fd = -1;
+                continue;
+            }
+
+            if(defer_accept != 0) {
+                setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept));
+            }
+
+            if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+
+            close(fd);
+            fd = -1;
+        }
+
+        freeaddrinfo(res);
+
+        if(fd < 0) {
+            return -1;
+        }
+    }
+
+    if(listen(fd, listen_backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    listening_sockets.push_back(fd);
+
+    return fd;
 }
 
 void fcgi_server::init() {
-    FCGX_Init();
+    for(std::vector<std::string>::const_iterator e = endpoints.begin() ; e != endpoints.end() ; e++ ) {
+        bool shared = !reuseport || e->rfind(':') == std::string::npos;
+        int fd = -1;
 
-    listening_socket = FCGX_OpenSocket(endpoint.c_str(), 5);
+        for(event_thread_list_t::iterator t = event_threads.begin() ; t != event_threads.end() ; t++ ) {
+            if(!shared || fd < 0) {
+                fd = open_socket(*e, shared);
 
-    if(listening_socket < 0)
-        throw fcgi_server_exception("cannot create listening socket");
-    
+                if(fd < 0)
+                    throw fcgi_server_exception("cannot create listening socket for " + *e);
+            }
+
+            t->listeners.push_back(fd);
+        }
+    }
 
     // For now just call all handlers 
     for(handler_list_t::iterator i = handlers.begin() ; i != handlers.end() ; i++ )
@@ -59,71 +240,449 @@ void fcgi_server::shutdown() {
     for(handler_list_t::iterator i = handlers.begin() ; i != handlers.end() ; i++ )
         (*i)->shutdown();
 
-    close(listening_socket);
+    for(std::vector<int>::const_iterator i = listening_sockets.begin() ; i != listening_sockets.end() ; i++ )
+        close(*i);
+
+    listening_sockets.clear();
+}
+
+void fcgi_server::set_threads(unsigned _min_threads, unsigned _max_threads) {
+    if(_min_threads == 0 || _max_threads < _min_threads)
+        throw fcgi_server_exception("invalid worker thread pool limits");
+
+    pthread_mutex_lock(&queue_lock);
+
+    min_threads = _min_threads;
+    max_threads = _max_threads;
+
+    /*
+     * Requests are multiplexed over connections, so any number of them
+     * can keep all worker threads busy
+     */
+    values.max_conns = max_threads;
+    values.max_reqs = max_threads;
+    values.mpxs_conns = true;
+
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void fcgi_server::set_spool(size_t _threshold, const std::string &_dir)
+{
+    values.spool_threshold = _threshold;
+    values.spool_dir = _dir;
+}
+
+void fcgi_server::set_max_body(size_t _max_body)
+{
+    values.max_body = _max_body;
+}
+
+void fcgi_server::set_cache(size_t _max_bytes)
+{
+    delete cache;
+    cache = new fcgi_cache(_max_bytes);
+}
+
+fcgi_thread_stats fcgi_server::get_thread_stats() {
+    fcgi_thread_stats stats;
+
+    pthread_mutex_lock(&queue_lock);
+
+    stats.threads = num_threads;
+    stats.idle = num_idle;
+    stats.busy = num_threads - num_idle;
+    stats.queued = queue_length;
+
+    pthread_mutex_unlock(&queue_lock);
+
+    return stats;
 }
 
 void fcgi_server::run() {
     void *return_value; 
 
     signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_lock(&queue_lock);
+    num_threads = min_threads;
+    pthread_mutex_unlock(&queue_lock);
+
+    spawn_workers(min_threads);
     
-    for(int i = 0 ; i < NUM_WORKERS ; i++ ) {
-        pthread_create(worker_threads + i, NULL, fcgi_server::worker_thread_starter, (void*)this);
+    for(event_thread_list_t::iterator t = event_threads.begin() ; t != event_threads.end() ; t++ ) {
+        t->server = this;
+        pthread_create(&t->thread, NULL, fcgi_server::event_thread_starter, (void*)&(*t));
+    }
+
+    for(event_thread_list_t::iterator t = event_threads.begin() ; t != event_threads.end() ; t++ ) {
+        pthread_join(t->thread, &return_value);
     }
 
-    for(int i = 0 ; i < NUM_WORKERS ; i++ ) {
-        pthread_join(*(worker_threads + i), &return_value);
+    /*
+     * Worker threads are detached, wait until all of them are gone
+     */
+    pthread_mutex_lock(&queue_lock);
+
+    while(num_threads != 0) {
+        pthread_cond_wait(&workers_exited, &queue_lock);
     }
+
+    pthread_mutex_unlock(&queue_lock);
 }
 
-void fcgi_server::worker_thread() {
-	using namespace std;
+void fcgi_server::spawn_workers(unsigned count) {
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for(unsigned i = 0 ; i < count ; i++ ) {
+        if(pthread_create(&thread, &attr, fcgi_server::worker_thread_starter, (void*)this) != 0) {
+            LogError("cannot create worker thread: " << errno);
+
+            pthread_mutex_lock(&queue_lock);
+            num_threads -= count - i;
+            pthread_cond_broadcast(&workers_exited);
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+void fcgi_server::event_thread(fcgi_event_thread &t) {
+    struct epoll_event ev, events[64];
+    std::set<fcgi_connection*> connections;
+    int epoll_fd;
 
     signal(SIGPIPE, SIG_IGN);
 
-    FCGX_Request request;
-    
-    LogInfo("worker thread started");
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if(epoll_fd < 0) {
+        LogError("epoll_create failed: " << errno);
+        return;
+    }
+
+    /*
+     * Shared listening sockets are polled by all event threads, EPOLLEXCLUSIVE
+     * makes the kernel wake only one of them per incoming connection.
+     * Event data of a listening socket points to its entry in t.listeners
+     */
+    for(std::vector<int>::iterator i = t.listeners.begin() ; i != t.listeners.end() ; i++ ) {
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &(*i);
+
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *i, &ev) < 0) {
+            LogError("cannot add listening socket to epoll set: " << errno);
+            close(epoll_fd);
+            return;
+        }
+    }
 
-    FCGX_InitRequest(&request, listening_socket, 0);
+    LogInfo("event thread started");
 
     while(!m_exiting) {
-        int rc;
+        fcgi_connection::request_list_t completed;
+        int n;
+
+        n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), 1000);
 
-        pthread_mutex_lock(&accept_mutex);
-        rc = FCGX_Accept_r(&request);
-        pthread_mutex_unlock(&accept_mutex);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
 
-        if (rc < 0) {
-            LogInfo("accept failed: " << rc);
+            LogError("epoll_wait failed: " << errno);
             break;
         }
 
-        // Construct request and response and invoke handler
-        fcgi_request fcgi_req(request);
-        fcgi_response fcgi_resp(request);
+        for(int i = 0 ; i < n ; i++ ) {
+            int *listener = static_cast<int*>(events[i].data.ptr);
+
+            if(listener >= &t.listeners.front() && listener <= &t.listeners.back()) {
+                accept_connections(*listener, epoll_fd, connections);
+                continue;
+            }
+
+            fcgi_connection *conn = static_cast<fcgi_connection*>(events[i].data.ptr);
+            bool keep = true;
+
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                keep = conn->on_readable(completed);
+            }
+
+            if(keep && (events[i].events & EPOLLOUT)) {
+                keep = conn->on_writable();
+            }
+
+            if(!keep) {
+                connections.erase(conn);
+                conn->close();
+            }
+        }
+
+        if(!completed.empty()) {
+            enqueue_requests(completed);
+        }
+    }
+
+    for(std::set<fcgi_connection*>::iterator i = connections.begin() ; i != connections.end() ; i++ ) {
+        (*i)->close();
+    }
+
+    close(epoll_fd);
 
-        try{
-            if(FCGX_GetParam("SCRIPT_NAME", request.envp) == NULL)
-                throw std::logic_error("HTTP server is not configured to pass SCRIPT_NAME variable");
+    LogInfo("event thread terminated");
+}
 
+void *fcgi_server::event_thread_starter(void *arg) {
+    fcgi_event_thread *t;
+
+    t = static_cast<fcgi_event_thread*>(arg);
+
+    t->server->event_thread(*t);
+
+    return NULL;
+}
+
+void fcgi_server::accept_connections(int listener, int epoll_fd, std::set<fcgi_connection*> &connections) {
+    struct epoll_event ev;
+
+    for(int i = 0 ; i < 64 ; i++ ) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(fd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                LogError("accept failed: " << errno);
+            }
+
+            break;
+        }
+
+        fcgi_connection *conn = new fcgi_connection(fd, epoll_fd, values);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LogError("cannot add connection to epoll set: " << errno);
+            conn->close();
+            continue;
+        }
+
+        connections.insert(conn);
+    }
+}
+
+void fcgi_server::enqueue_requests(fcgi_connection::request_list_t &requests) {
+    unsigned to_spawn = 0;
+
+    pthread_mutex_lock(&queue_lock);
+
+    queue_length += requests.size();
+    request_queue.splice(request_queue.end(), requests);
+
+    /*
+     * Grow the pool if there are more waiting requests than idle threads
+     */
+    if(queue_length > num_idle && num_threads < max_threads) {
+        to_spawn = std::min<size_t>(queue_length - num_idle, max_threads - num_threads);
+        num_threads += to_spawn;
+
+        LogInfo("growing worker pool by " << to_spawn << " threads (" << num_threads << " threads, "
+            << num_idle << " idle, " << queue_length << " queued)");
+    }
+
+    pthread_cond_broadcast(&queue_not_empty);
+
+    pthread_mutex_unlock(&queue_lock);
+
+    if(to_spawn != 0) {
+        spawn_workers(to_spawn);
+    }
+}
+
+fcgi_request_data *fcgi_server::dequeue_request() {
+    fcgi_request_data *data = 0;
+    time_t idle_since = time(NULL);
+
+    pthread_mutex_lock(&queue_lock);
+
+    num_idle++;
+
+    while(request_queue.empty() && !m_exiting) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+
+        pthread_cond_timedwait(&queue_not_empty, &queue_lock, &deadline);
+
+        if(request_queue.empty() && num_threads > min_threads && time(NULL) - idle_since >= (time_t)idle_timeout) {
+            LogInfo("retiring idle worker thread (" << num_threads - 1 << " threads, "
+                << num_idle - 1 << " idle)");
+            break;
+        }
+    }
+
+    num_idle--;
+
+    if(!request_queue.empty()) {
+        data = request_queue.front();
+        request_queue.pop_front();
+        queue_length--;
+    }
+    else {
+        /*
+         * Calling thread terminates
+         */
+        num_threads--;
+        pthread_cond_broadcast(&workers_exited);
+    }
+
+    pthread_mutex_unlock(&queue_lock);
+
+    return data;
+}
+
+void fcgi_server::worker_thread() {
+    fcgi_request_data *data;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    LogInfo("worker thread started");
+
+    /*
+     * Request and response objects are reused for all requests
+     * this thread processes, per-request memory comes from the arena
+     */
+    arena request_arena;
+    fcgi_request fcgi_req(request_arena, values);
+    fcgi_response fcgi_resp;
+
+    while((data = dequeue_request()) != 0) {
+        process_request(data, fcgi_req, fcgi_resp);
+        request_arena.reset();
+    }
+
+    LogInfo("worker thread terminated");
+}
+
+void fcgi_server::process_request(fcgi_request_data *data, fcgi_request &fcgi_req, fcgi_response &fcgi_resp) {
+    fcgi_connection *conn = data->conn;
+
+    fcgi_resp.attach(*data);
+
+    try{
+        // Parse request and invoke handler
+        fcgi_req.attach(*data);
+
+        if(values.max_body != 0 && data->stdin_length > values.max_body)
+            throw fcgi_exception("Request body is too large", HTTP_REQUEST_ENTITY_TOO_LARGE);
+
+        if(!fcgi_req.has_fcgi_param("SCRIPT_NAME"))
+            throw std::logic_error("HTTP server is not configured to pass SCRIPT_NAME variable");
+
+        if(cache != 0 && fcgi_req.get_fcgi_param("REQUEST_METHOD") == "GET") {
+            process_cacheable_request(fcgi_req, fcgi_resp);
+        }
+        else {
             invoke_handler(fcgi_req.get_script_name(), fcgi_req, fcgi_resp);
+        }
+
+    }catch(const fp::fcgi_exception &e) {
+        fcgi_resp.fcgi_out << "Status: " << e.status() << "\r\nContent-Type: text/plain; encoding=utf-8\r\n\r\nError: " << e.what();
+    }catch(const std::exception &e) {
+        fcgi_resp.fcgi_out << "Status: 500\r\nContent-Type: text/plain; encoding=utf-8\r\nCache-Control: no-cache\r\n\r\nError: " << e.what();
+    }catch(...) {
+        fcgi_resp.fcgi_out << "Status: 500\r\nContent-Type: text/plain; encoding=utf-8\r\nCache-Control: no-cache\r\n\r\nUnknown internal error";
+    }
+
+    // Ensure all data is sent
+    fcgi_resp.finish();
+
+    // Parameters point into request data, drop them before it is released
+    fcgi_req.clear();
+
+    conn->end_request(data, 0);
+}
+
+/*
+ * Serve request from the cache, or invoke handler and store
+ * the response if the handler allows it. Only one request at a time
+ * invokes handler for a key, others wait for its response or get
+ * the stale one
+ */
+void fcgi_server::process_cacheable_request(fcgi_request &fcgi_req, fcgi_response &fcgi_resp) {
+    std::string key;
+    bool leader;
+
+    fcgi_cache::make_key(fcgi_req, key);
+
+    fcgi_cache_entry *entry = cache->lookup(key, leader);
+
+    if(entry != 0) {
+        fcgi_resp.fcgi_out.write(entry->data.data(), entry->data.size());
+        entry->unref();
+        return;
+    }
+
+    std::string captured;
 
-        }catch(const fp::fcgi_exception &e) {
-            fcgi_resp.fcgi_out << "Status: " << e.status() << "\r\nContent-Type: text/plain; encoding=utf-8\r\n\r\nError: " << e.what();
-        }catch(const std::exception &e) {
-            fcgi_resp.fcgi_out << "Status: 500\r\nContent-Type: text/plain; encoding=utf-8\r\nCache-Control: no-cache\r\n\r\nError: " << e.what();
-        }catch(...) {
-            fcgi_resp.fcgi_out << "Status: 500\r\nContent-Type: text/plain; encoding=utf-8\r\nCache-Control: no-cache\r\n\r\nUnknown internal error";
+    if(leader && shared_cache != 0) {
+        time_t expires;
+
+        if(shared_cache->lookup(key, captured, expires)) {
+            fcgi_resp.fcgi_out.write(captured.data(), captured.size());
+
+            // Keep it in the response cache for the rest of its lifetime
+            time_t ttl = expires - time(NULL);
+            cache->complete(key, &captured, ttl > 0 ? ttl : 1);
+            return;
         }
+    }
+
+    fcgi_resp.fcgi_out.set_capture(&captured, cache->get_max_entry_size());
 
-        // Ensure all data is sent
+    try {
+        invoke_handler(fcgi_req.get_script_name(), fcgi_req, fcgi_resp);
+
+        // Pass buffered output through capture
         fcgi_resp.fcgi_out.flush();
+    }
+    catch(...) {
+        fcgi_resp.fcgi_out.set_capture(0, 0);
+
+        // Let waiting requests invoke handler themselves
+        if(leader) {
+            cache->complete(key, 0, 0);
+        }
 
-        FCGX_Finish_r(&request);
+        throw;
     }
 
-    LogInfo("worker thread terminated");
+    unsigned ttl = fcgi_resp.get_cache_ttl();
+    bool cacheable = ttl != 0 && fcgi_resp.fcgi_out.is_capturing();
+
+    fcgi_resp.fcgi_out.set_capture(0, 0);
+
+    if(cacheable && shared_cache != 0) {
+        shared_cache->insert(key, captured, ttl);
+    }
+
+    if(leader) {
+        cache->complete(key, cacheable ? &captured : 0, ttl);
+    }
+    else if(cacheable) {
+        cache->insert(key, captured, ttl);
+    }
 }
 
 void *fcgi_server::worker_thread_starter(void *arg) {
@@ -148,63 +707,94 @@ void fcgi_server::remove_handler(fcgi_handler *_handler)
 }
 
 void fcgi_server::add_handler_mapping(const std::string &_uri, fcgi_handler *_handler) {
+    pthread_mutex_lock(&mapping_lock);
+
     if(_uri.find('=') == 0) {
-        exact_locations_map.insert(std::make_pair(_uri.substr(sizeof("=")), _handler));
+        exact_locations_map[_uri.substr(sizeof("=") - 1)] = _handler;
     }
     else {
-        locations_map.insert(std::make_pair(_uri, _handler));
+        locations_map[_uri] = _handler;
     }
+
+    publish_router();
+
+    pthread_mutex_unlock(&mapping_lock);
 }
 
 void fcgi_server::remove_handler_mapping(const std::string &_uri, fcgi_handler *_handler) {
-}
+    location_map_t *map = &locations_map;
+    std::string location(_uri);
 
-void fcgi_server::invoke_handler(const std::string &_uri, fcgi_request &_request, fcgi_response &_response) const {
-    std::string matched_prefix;
-    fcgi_handler* handler_to_fire;
+    if(_uri.find('=') == 0) {
+        map = &exact_locations_map;
+        location.erase(0, sizeof("=") - 1);
+    }
 
-    // Find and call handlers by exact match
-    std::pair<location_map_t::const_iterator, location_map_t::const_iterator>
-        handlers_to_invoke = exact_locations_map.equal_range(_uri);
+    pthread_mutex_lock(&mapping_lock);
 
-    handler_to_fire = 0;
-    
-    for(location_map_t::const_iterator i = handlers_to_invoke.first ; i != handlers_to_invoke.second ; i++ )
-    {
-        if(i->second != 0) {
-            if(matched_prefix.size() < i->first.size()) { 
-                handler_to_fire = i->second;
-            }
-        }
-    }
+    location_map_t::iterator i = map->find(location);
 
-    if(handler_to_fire != 0) {
-        handler_to_fire->handle(_request, _response);
-        return;
+    if(i != map->end() && (_handler == 0 || i->second == _handler)) {
+        map->erase(i);
+        publish_router();
     }
 
-    location_map_t::const_iterator start = locations_map.begin();
-    location_map_t::const_iterator end = locations_map.end();
+    pthread_mutex_unlock(&mapping_lock);
+}
 
-    matched_prefix.clear();
-    handler_to_fire = 0;
-    
-    for(location_map_t::const_iterator i = start ; i != end ; i++ )
-    {
-        if(_uri.find(i->first) == 0 && i->second != 0) {
-            if(matched_prefix.size() < i->first.size()) { 
-                handler_to_fire = i->second;
-            }
-        }
+void fcgi_server::publish_router() {
+    fcgi_router *new_router = new fcgi_router();
+
+    for(location_map_t::const_iterator i = locations_map.begin() ; i != locations_map.end() ; i++ )
+        new_router->add(i->first, i->second, false);
+
+    for(location_map_t::const_iterator i = exact_locations_map.begin() ; i != exact_locations_map.end() ; i++ )
+        new_router->add(i->first, i->second, true);
+
+    fcgi_router *old_router = __atomic_exchange_n(&router, new_router, __ATOMIC_SEQ_CST);
+
+    /*
+     * Readers that may still see the old router counted themselves
+     * under the current epoch. Move new readers to the other epoch
+     * and wait until lookups under the current one are over. Lookups
+     * are short, the wait is bounded by a trie walk
+     */
+    unsigned epoch = __atomic_fetch_add(&router_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+    while(__atomic_load_n(&router_readers[epoch], __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+
+    delete old_router;
+}
+
+void fcgi_server::invoke_handler(const string_ref &_uri, fcgi_request &_request, fcgi_response &_response) const {
+    unsigned epoch;
+
+    for(;;) {
+        epoch = __atomic_load_n(&router_epoch, __ATOMIC_SEQ_CST);
+
+        __atomic_add_fetch(&router_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+
+        if(__atomic_load_n(&router_epoch, __ATOMIC_SEQ_CST) == epoch)
+            break;
+
+        /*
+         * Router was republished meanwhile, count again under the new epoch
+         */
+        __atomic_sub_fetch(&router_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
     }
 
+    const fcgi_router *current_router = __atomic_load_n(&router, __ATOMIC_SEQ_CST);
+    fcgi_handler *handler_to_fire = current_router->find(_uri);
+
+    __atomic_sub_fetch(&router_readers[epoch & 1], 1, __ATOMIC_RELEASE);
+
     if(handler_to_fire != 0) {
         handler_to_fire->handle(_request, _response);
         return;
     }
 
-    throw fcgi_exception(("No handlers configured for location: \"" + _uri + "\"").c_str(), HTTP_NOT_FOUND);
+    throw fcgi_exception(("No handlers configured for location: \"" + _uri.str() + "\"").c_str(), HTTP_NOT_FOUND);
 }
 
 };
-
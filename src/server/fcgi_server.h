@@ -6,13 +6,15 @@
 #include <set>
 #include <map>
 #include <list>
+#include <vector>
 #include <signal.h>
-
-#include <fcgio.h>
+#include <pthread.h>
 
 #include "fcgi_handler.h"
-
-#define NUM_WORKERS 5
+#include "fcgi_connection.h"
+#include "fcgi_router.h"
+#include "fcgi_cache.h"
+#include "shm_cache.h"
 
 namespace fp {
 
@@ -34,10 +36,32 @@ private:
     std::string error_message;
 };
 
+/*
+ * Worker thread pool statistics
+ */
+struct fcgi_thread_stats {
+    unsigned threads;
+    unsigned busy;
+    unsigned idle;
+    size_t queued;
+};
+
+class fcgi_server;
+
+/*
+ * Event thread and listening sockets it polls
+ */
+struct fcgi_event_thread {
+    fcgi_server         *server;
+    pthread_t           thread;
+    std::vector<int>    listeners;
+};
+
 class fcgi_server {
 private:
-    typedef std::multimap<std::string,fcgi_handler*> location_map_t;
+    typedef std::map<std::string,fcgi_handler*> location_map_t;
     typedef std::list<fcgi_handler*> handler_list_t;
+    typedef std::vector<fcgi_event_thread> event_thread_list_t;
 
 public:
     fcgi_server(const std::string &_endpoint = "127.0.0.1:9002");
@@ -60,22 +84,115 @@ public:
     void remove_handler(fcgi_handler *_handler);
 
     /*
-     * Add handler mapping to server's handler mapping list
+     * Add endpoint to listen on in addition to the one server was
+     * constructed with. Endpoint is either [host]:port or a path
+     * of Unix domain socket
+     */
+    void add_endpoint(const std::string &_endpoint);
+
+    /*
+     * Set backlog of listening sockets
+     */
+    void set_listen_backlog(int _backlog) { listen_backlog = _backlog; }
+
+    /*
+     * Set number of threads that accept connections and read requests
+     */
+    void set_event_threads(unsigned _num_event_threads);
+
+    /*
+     * Give each event thread its own SO_REUSEPORT socket for every TCP
+     * endpoint, so that the kernel balances connections between them.
+     * Unix domain sockets are always shared between event threads
+     */
+    void set_reuseport(bool _reuseport) { reuseport = _reuseport; }
+
+    /*
+     * Enable TCP_DEFER_ACCEPT on TCP endpoints: wake up the server only
+     * when data arrives on a new connection
      *
-     * @param _uri URI template to map
+     * @param _defer_accept timeout in seconds, 0 disables
+     */
+    void set_defer_accept(int _defer_accept) { defer_accept = _defer_accept; }
+
+    /*
+     * Keep request bodies and uploaded parts larger than _threshold
+     * in temporary files in _dir instead of memory. Must be called
+     * before the server is run
+     */
+    void set_spool(size_t _threshold, const std::string &_dir);
+
+    /*
+     * Reject requests with body larger than _max_body with 413 without
+     * spooling the body, 0 disables the limit. Must be called before
+     * the server is run
+     */
+    void set_max_body(size_t _max_body);
+
+    /*
+     * Enable response cache of _max_bytes. GET requests are looked up in
+     * the cache before a handler is invoked, responses are stored if the
+     * handler allowed it by fcgi_response::set_cache_ttl. Must be called
+     * before the server is run
+     */
+    void set_cache(size_t _max_bytes);
+
+    /*
+     * Response cache or 0 if disabled
+     */
+    fcgi_cache *get_cache() const { return cache; }
+
+    /*
+     * Use cache shared with other processes behind the response cache.
+     * Responses missing in the response cache are looked up there, stored
+     * responses go to both. Server does not take ownership of the cache
+     */
+    void set_shared_cache(shm_cache *_shared_cache) { shared_cache = _shared_cache; }
+
+    /*
+     * Add handler mapping to server's handler mapping list. Mappings
+     * can be changed while the server is running, request threads keep
+     * using the previous routing table until the new one is published
+     *
+     * @param _uri URI prefix to map, or URI prefixed by '=' for exact match
      * @param _handler pointer to handler object to be mapped. 
      */
     void add_handler_mapping(const std::string &_uri, fcgi_handler *_handler);
 
+    /*
+     * Remove handler mapping from server's handler mapping list
+     *
+     * @param _uri URI as passed to add_handler_mapping
+     * @param _handler handler the URI is mapped to, 0 matches any handler
+     */
     void remove_handler_mapping(const std::string &_uri, fcgi_handler *_handler);
 
-    void invoke_handler(const std::string &_uri, fcgi_request &, fcgi_response &) const;
+    void invoke_handler(const string_ref &_uri, fcgi_request &, fcgi_response &) const;
    
     /*
      * Initialize server
      */
     void init();
 
+    /*
+     * Set worker thread pool limits. Pool starts with _min_threads threads
+     * and grows up to _max_threads when requests are waiting and all
+     * threads are busy
+     */
+    void set_threads(unsigned _min_threads, unsigned _max_threads);
+
+    /*
+     * Set time after which idle threads above minimum are retired
+     *
+     * @param _idle_timeout timeout in seconds
+     */
+    void set_idle_timeout(unsigned _idle_timeout) { idle_timeout = _idle_timeout; }
+
+    /*
+     * Get current worker thread pool statistics
+     */
+    fcgi_thread_stats get_thread_stats();
+
     /*
      * Run server. Returns when all worker threads terminated
      */
@@ -89,20 +206,72 @@ public:
     static void exit() { m_exiting = true; }
 
 private:
+    void event_thread(fcgi_event_thread &t);
+    static void *event_thread_starter(void *arg);
+
     void worker_thread();
     static void *worker_thread_starter(void *arg);
 
+    void accept_connections(int listener, int epoll_fd, std::set<fcgi_connection*> &connections);
+    void enqueue_requests(fcgi_connection::request_list_t &requests);
+    fcgi_request_data *dequeue_request();
+    void process_request(fcgi_request_data *data, fcgi_request &fcgi_req, fcgi_response &fcgi_resp);
+    void process_cacheable_request(fcgi_request &fcgi_req, fcgi_response &fcgi_resp);
+    void spawn_workers(unsigned count);
+
+    int open_socket(const std::string &_endpoint, bool _shared);
+
+    void publish_router();
+
 private:
-    const std::string endpoint;
-    pthread_t worker_threads[NUM_WORKERS];
+    std::vector<std::string> endpoints;
+    event_thread_list_t event_threads;
 
-    pthread_mutex_t accept_mutex;
+    /*
+     * All listening sockets
+     */
+    std::vector<int> listening_sockets;
+    int listen_backlog;
+    bool reuseport;
+    int defer_accept;
+
+    /*
+     * Completed requests waiting for a worker thread
+     */
+    fcgi_connection::request_list_t request_queue;
+    size_t queue_length;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_not_empty;
+
+    /*
+     * Worker thread pool state, protected by queue_lock
+     */
+    pthread_cond_t workers_exited;
+    unsigned num_threads;
+    unsigned num_idle;
+    unsigned idle_timeout;
+
+    fcgi_values values;
+
+    fcgi_cache *cache;
+    shm_cache *shared_cache;
 
     location_map_t locations_map;
     location_map_t exact_locations_map;
-    handler_list_t handlers;
 
-    int listening_socket;
+    /*
+     * Routing table compiled from location maps. Request threads read
+     * it without locking, writers serialize on mapping_lock and replace
+     * it atomically. A replaced table is freed once lookups that
+     * started before the replacement are over: request threads count
+     * themselves in router_readers under the parity of router_epoch,
+     * writer bumps the epoch and waits for the old parity to drain
+     */
+    fcgi_router *router;
+    volatile unsigned router_epoch;
+    mutable volatile int router_readers[2];
+    pthread_mutex_t mapping_lock;
+    handler_list_t handlers;
 
     unsigned min_threads, max_threads;
     static sig_atomic_t m_exiting;
@@ -0,0 +1,163 @@
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "fcgi_stream.h"
+#include "fcgi_connection.h"
+
+namespace fp {
+
+fcgi_istreambuf::fcgi_istreambuf()
+    : fd(-1)
+    , offset(0)
+{
+    setg(0, 0, 0);
+}
+
+void fcgi_istreambuf::attach(std::string &_data)
+{
+    char *start = _data.empty() ? 0 : &_data[0];
+
+    fd = -1;
+    setg(start, start, start + _data.size());
+}
+
+void fcgi_istreambuf::attach(int _fd)
+{
+    fd = _fd;
+    offset = 0;
+    setg(buffer, buffer, buffer);
+}
+
+fcgi_istreambuf::int_type fcgi_istreambuf::underflow()
+{
+    if(gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    if(fd == -1) {
+        return traits_type::eof();
+    }
+
+    ssize_t n;
+
+    do {
+        n = pread(fd, buffer, buffer_size, offset);
+    } while(n == -1 && errno == EINTR);
+
+    if(n <= 0) {
+        return traits_type::eof();
+    }
+
+    offset += n;
+    setg(buffer, buffer, buffer + n);
+
+    return traits_type::to_int_type(*gptr());
+}
+
+fcgi_ostreambuf::fcgi_ostreambuf(u_char _type)
+    : conn(0)
+    , request_id(0)
+    , type(_type)
+    , output_sent(false)
+    , capture(0)
+    , capture_limit(0)
+{
+    setp(buffer, buffer + buffer_size);
+}
+
+void fcgi_ostreambuf::attach(fcgi_connection *_conn, unsigned _request_id)
+{
+    conn = _conn;
+    request_id = _request_id;
+    output_sent = false;
+    capture = 0;
+    setp(buffer, buffer + buffer_size);
+}
+
+void fcgi_ostreambuf::set_capture(std::string *_capture, size_t _limit)
+{
+    capture = _capture;
+    capture_limit = _limit;
+
+    if(capture != 0) {
+        capture->clear();
+    }
+}
+
+void fcgi_ostreambuf::capture_output(const char *s, size_t n)
+{
+    if(capture == 0) {
+        return;
+    }
+
+    if(capture->size() + n > capture_limit) {
+        capture = 0;
+        return;
+    }
+
+    capture->append(s, n);
+}
+
+fcgi_ostreambuf::~fcgi_ostreambuf()
+{
+}
+
+void fcgi_ostreambuf::flush_buffer()
+{
+    size_t len = pptr() - pbase();
+
+    if(len != 0) {
+        capture_output(pbase(), len);
+        conn->write_stream(type, request_id, pbase(), len);
+        output_sent = true;
+        setp(buffer, buffer + buffer_size);
+    }
+}
+
+fcgi_ostreambuf::int_type fcgi_ostreambuf::overflow(int_type c)
+{
+    flush_buffer();
+
+    if(!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+
+    return traits_type::not_eof(c);
+}
+
+int fcgi_ostreambuf::sync()
+{
+    flush_buffer();
+    return 0;
+}
+
+std::streamsize fcgi_ostreambuf::xsputn(const char *s, std::streamsize n)
+{
+    if((size_t)n <= (size_t)(epptr() - pptr())) {
+        memcpy(pptr(), s, n);
+        pbump(n);
+        return n;
+    }
+
+    /*
+     * Large writes bypass the buffer
+     */
+    flush_buffer();
+
+    if((size_t)n < buffer_size) {
+        memcpy(pptr(), s, n);
+        pbump(n);
+    }
+    else {
+        capture_output(s, n);
+        conn->write_stream(type, request_id, s, n);
+        output_sent = true;
+    }
+
+    return n;
+}
+
+};
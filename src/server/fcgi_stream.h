@@ -0,0 +1,144 @@
+
+#ifndef _FCGI_STREAM_H_
+#define _FCGI_STREAM_H_
+
+#include <string>
+#include <iostream>
+#include <streambuf>
+
+#include <sys/types.h>
+
+namespace fp {
+
+class fcgi_connection;
+
+/*
+ * Stream buffer that reads request body received from the web server
+ */
+class fcgi_istreambuf : public std::streambuf {
+public:
+    fcgi_istreambuf();
+
+    /*
+     * Start reading request body from memory
+     */
+    void attach(std::string &_data);
+
+    /*
+     * Start reading request body from spool file
+     */
+    void attach(int _fd);
+
+protected:
+    virtual int_type underflow();
+
+private:
+    static const size_t buffer_size = 8192;
+
+    int                 fd;
+    off_t               offset;
+    char                buffer[buffer_size];
+};
+
+/*
+ * Stream buffer that encodes output as FastCGI records of given type
+ * and passes them to the connection
+ */
+class fcgi_ostreambuf : public std::streambuf {
+public:
+    fcgi_ostreambuf(u_char _type);
+    virtual ~fcgi_ostreambuf();
+
+    /*
+     * Start writing to request on connection. Buffered output of the
+     * previous request is discarded
+     */
+    void attach(fcgi_connection *_conn, unsigned _request_id);
+
+    /*
+     * Returns true if any data was passed to the connection
+     */
+    bool has_output() const { return output_sent || pptr() != pbase(); }
+
+    /*
+     * Copy output passed to the connection from now on into _capture.
+     * Capturing stops if output grows beyond _limit bytes and when
+     * the buffer is attached to the next request
+     */
+    void set_capture(std::string *_capture, size_t _limit);
+
+    /*
+     * Returns true if all output since set_capture was captured
+     */
+    bool is_capturing() const { return capture != 0; }
+
+protected:
+    virtual int_type overflow(int_type c);
+    virtual int sync();
+    virtual std::streamsize xsputn(const char *s, std::streamsize n);
+
+private:
+    void flush_buffer();
+    void capture_output(const char *s, size_t n);
+
+private:
+    static const size_t buffer_size = 8192;
+
+    fcgi_connection     *conn;
+    unsigned            request_id;
+    u_char              type;
+    bool                output_sent;
+    std::string         *capture;
+    size_t              capture_limit;
+    char                buffer[buffer_size];
+};
+
+class fcgi_istream : public std::istream {
+public:
+    fcgi_istream()
+        : std::istream(0)
+        , m_buf()
+    {
+        init(&m_buf);
+    }
+
+    void attach(std::string &_data) {
+        m_buf.attach(_data);
+        clear();
+    }
+
+    void attach(int _fd) {
+        m_buf.attach(_fd);
+        clear();
+    }
+
+private:
+    fcgi_istreambuf m_buf;
+};
+
+class fcgi_ostream : public std::ostream {
+public:
+    fcgi_ostream(u_char _type)
+        : std::ostream(0)
+        , m_buf(_type)
+    {
+        init(&m_buf);
+    }
+
+    void attach(fcgi_connection *_conn, unsigned _request_id) {
+        m_buf.attach(_conn, _request_id);
+        clear();
+    }
+
+    bool has_output() const { return m_buf.has_output(); }
+
+    void set_capture(std::string *_capture, size_t _limit) { m_buf.set_capture(_capture, _limit); }
+    bool is_capturing() const { return m_buf.is_capturing(); }
+
+private:
+    fcgi_ostreambuf m_buf;
+};
+
+};
+
+#endif //_FCGI_STREAM_H_
@@ -0,0 +1,138 @@
+
+#include "fragment_cache.h"
+
+namespace fp {
+
+/*
+ * Approximate memory used by an entry besides its key, version and data
+ */
+#define FRAGMENT_ENTRY_OVERHEAD 128
+
+fragment_cache::fragment_cache(size_t _max_bytes)
+    : bytes(0)
+    , max_bytes(_max_bytes)
+{
+    pthread_rwlock_init(&lock, NULL);
+}
+
+fragment_cache::~fragment_cache()
+{
+    clear();
+
+    pthread_rwlock_destroy(&lock);
+}
+
+size_t fragment_cache::entry_size(const entry_map_t::value_type &_entry)
+{
+    return _entry.first.size() + _entry.second.version.size() + _entry.second.frag->data.size()
+        + FRAGMENT_ENTRY_OVERHEAD;
+}
+
+fragment *fragment_cache::lookup(const std::string &_key, const std::string &_version)
+{
+    fragment *frag = 0;
+
+    pthread_rwlock_rdlock(&lock);
+
+    entry_map_t::iterator i = entries.find(_key);
+
+    if(i != entries.end() && i->second.version == _version) {
+        frag = i->second.frag;
+        frag->ref();
+
+        __atomic_store_n(&i->second.referenced, true, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(&lock);
+
+    return frag;
+}
+
+/*
+ * Remove entry. Must be called with write lock held
+ */
+void fragment_cache::remove(entry_map_t::iterator _i)
+{
+    fragment *frag = _i->second.frag;
+
+    bytes -= entry_size(*_i);
+    entries.erase(_i);
+
+    frag->unref();
+}
+
+/*
+ * Free room for _needed bytes. Entries that were looked up since the
+ * previous sweep get a second chance. Must be called with write lock held
+ */
+void fragment_cache::evict(size_t _needed)
+{
+    entry_map_t::iterator i = entries.lower_bound(hand);
+
+    while(!entries.empty() && bytes + _needed > max_bytes) {
+        if(i == entries.end()) {
+            i = entries.begin();
+        }
+
+        if(i->second.referenced) {
+            i->second.referenced = false;
+            i++;
+            continue;
+        }
+
+        remove(i++);
+    }
+
+    hand = i != entries.end() ? i->first : std::string();
+}
+
+fragment *fragment_cache::insert(const std::string &_key, const std::string &_version, std::string &_data)
+{
+    size_t size = _key.size() + _version.size() + _data.size() + FRAGMENT_ENTRY_OVERHEAD;
+    fragment *frag = new fragment(_data);
+
+    /*
+     * Too large to cache, still usable by the caller
+     */
+    if(size > max_bytes) {
+        return frag;
+    }
+
+    entry e;
+
+    e.version = _version;
+    e.frag = frag;
+    e.referenced = false;
+
+    pthread_rwlock_wrlock(&lock);
+
+    entry_map_t::iterator i = entries.find(_key);
+
+    if(i != entries.end()) {
+        remove(i);
+    }
+
+    evict(size);
+
+    entries.insert(std::make_pair(_key, e));
+    bytes += size;
+
+    frag->ref();
+
+    pthread_rwlock_unlock(&lock);
+
+    return frag;
+}
+
+void fragment_cache::clear()
+{
+    pthread_rwlock_wrlock(&lock);
+
+    while(!entries.empty()) {
+        remove(entries.begin());
+    }
+
+    pthread_rwlock_unlock(&lock);
+}
+
+};
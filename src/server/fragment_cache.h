@@ -0,0 +1,166 @@
+
+#ifndef _FRAGMENT_CACHE_H_
+#define _FRAGMENT_CACHE_H_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <pthread.h>
+
+namespace fp {
+
+/*
+ * Pre-serialized piece of a page, markup of a single post
+ */
+class fragment {
+public:
+    fragment(std::string &_data)
+        : refs(1)
+    {
+        data.swap(_data);
+    }
+
+    void ref() { __sync_add_and_fetch(&refs, 1); }
+
+    void unref() {
+        if(__sync_sub_and_fetch(&refs, 1) == 0) {
+            delete this;
+        }
+    }
+
+    std::string data;
+
+private:
+    volatile int refs;
+};
+
+/*
+ * Reference to a fragment, released when the holder goes out of scope
+ */
+class fragment_holder {
+public:
+    fragment_holder(fragment *_frag)
+        : frag(_frag)
+    {
+    }
+
+    ~fragment_holder()
+    {
+        if(frag != 0) {
+            frag->unref();
+        }
+    }
+
+    fragment *get() const { return frag; }
+
+private:
+    fragment_holder(const fragment_holder&);
+    fragment_holder &operator=(const fragment_holder&);
+
+private:
+    fragment *frag;
+};
+
+/*
+ * Fragments a page is assembled from, references are released when the
+ * list goes out of scope
+ */
+class fragment_list {
+public:
+    typedef std::vector<fragment*>::const_iterator const_iterator;
+
+    fragment_list() {}
+
+    ~fragment_list()
+    {
+        for(const_iterator i = frags.begin() ; i != frags.end() ; i++) {
+            (*i)->unref();
+        }
+    }
+
+    /*
+     * Take over reference of the fragment
+     */
+    void push_back(fragment *_frag)
+    {
+        try {
+            frags.push_back(_frag);
+        }
+        catch(...) {
+            _frag->unref();
+            throw;
+        }
+    }
+
+    void reserve(size_t _size) { frags.reserve(_size); }
+
+    const_iterator begin() const { return frags.begin(); }
+    const_iterator end() const { return frags.end(); }
+
+private:
+    fragment_list(const fragment_list&);
+    fragment_list &operator=(const fragment_list&);
+
+private:
+    std::vector<fragment*> frags;
+};
+
+/*
+ * Memory bounded cache of fragments. Each fragment has a version, post
+ * modification time usually, and a lookup with a different version
+ * misses, so fragments never go stale. Evicted in CLOCK order
+ */
+class fragment_cache {
+public:
+    fragment_cache(size_t _max_bytes);
+    ~fragment_cache();
+
+    /*
+     * Find fragment of given version
+     *
+     * @return fragment with reference taken or 0
+     */
+    fragment *lookup(const std::string &_key, const std::string &_version);
+
+    /*
+     * Add or replace fragment. Data is moved into the fragment
+     *
+     * @return new fragment with reference taken
+     */
+    fragment *insert(const std::string &_key, const std::string &_version, std::string &_data);
+
+    void clear();
+
+private:
+    struct entry {
+        std::string     version;
+        fragment        *frag;
+        bool            referenced;
+    };
+
+    typedef std::map<std::string, entry> entry_map_t;
+
+    static size_t entry_size(const entry_map_t::value_type &_entry);
+
+    void remove(entry_map_t::iterator _i);
+    void evict(size_t _needed);
+
+    fragment_cache(const fragment_cache&);
+    fragment_cache &operator=(const fragment_cache&);
+
+private:
+    pthread_rwlock_t    lock;
+    entry_map_t         entries;
+    size_t              bytes;
+    size_t              max_bytes;
+
+    /*
+     * Key the eviction sweep continues from
+     */
+    std::string         hand;
+};
+
+};
+
+#endif //_FRAGMENT_CACHE_H_
@@ -0,0 +1,183 @@
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#include <stdexcept>
+#include <new>
+
+#include "gzip_stream.h"
+
+namespace fp {
+
+/*
+ * Window bits for deflateInit2/inflateInit2 that select gzip wrapper
+ */
+#define GZIP_WINDOW_BITS (15 + 16)
+
+gzip_ostreambuf::gzip_ostreambuf(int _level)
+    : finished(false)
+{
+    memset(&zs, 0, sizeof(zs));
+
+    if(deflateInit2(&zs, _level, Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::bad_alloc();
+    }
+
+    setp(buffer, buffer + buffer_size);
+}
+
+gzip_ostreambuf::~gzip_ostreambuf()
+{
+    deflateEnd(&zs);
+}
+
+void gzip_ostreambuf::deflate_buffer(int flush)
+{
+    char out[buffer_size];
+    int rc;
+
+    zs.next_in = reinterpret_cast<Bytef*>(pbase());
+    zs.avail_in = pptr() - pbase();
+
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(out);
+        zs.avail_out = sizeof(out);
+
+        rc = deflate(&zs, flush);
+
+        output.append(out, sizeof(out) - zs.avail_out);
+    } while(zs.avail_out == 0 || (flush == Z_FINISH && rc != Z_STREAM_END));
+
+    setp(buffer, buffer + buffer_size);
+}
+
+gzip_ostreambuf::int_type gzip_ostreambuf::overflow(int_type c)
+{
+    if(finished) {
+        return traits_type::eof();
+    }
+
+    deflate_buffer(Z_NO_FLUSH);
+
+    if(!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+
+    return traits_type::not_eof(c);
+}
+
+int gzip_ostreambuf::sync()
+{
+    /*
+     * Data is only compressed when the buffer is full, so that
+     * flushing the stream does not hurt compression ratio
+     */
+    return 0;
+}
+
+void gzip_ostreambuf::finish()
+{
+    if(!finished) {
+        deflate_buffer(Z_FINISH);
+        finished = true;
+        setp(0, 0);
+    }
+}
+
+bool gzip_inflate(const std::string &_data, std::ostream &_out)
+{
+    z_stream zs;
+    char out[16384];
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+
+    if(inflateInit2(&zs, GZIP_WINDOW_BITS) != Z_OK) {
+        return false;
+    }
+
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(_data.data()));
+    zs.avail_in = _data.size();
+
+    do {
+        zs.next_out = reinterpret_cast<Bytef*>(out);
+        zs.avail_out = sizeof(out);
+
+        rc = inflate(&zs, Z_NO_FLUSH);
+
+        if(rc != Z_OK && rc != Z_STREAM_END) {
+            break;
+        }
+
+        _out.write(out, sizeof(out) - zs.avail_out);
+    } while(rc != Z_STREAM_END);
+
+    inflateEnd(&zs);
+
+    return rc == Z_STREAM_END;
+}
+
+/*
+ * Quality value of a coding from its parameters, 1 if there is none
+ */
+static double coding_quality(const char *p, const char *end)
+{
+    while(p != end) {
+        const char *param_end = static_cast<const char*>(memchr(p, ';', end - p));
+
+        if(param_end == 0) {
+            param_end = end;
+        }
+
+        p += strspn(p, " \t");
+
+        if(param_end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+            return strtod(std::string(p + 2, param_end).c_str(), 0);
+        }
+
+        p = param_end == end ? end : param_end + 1;
+    }
+
+    return 1;
+}
+
+bool accepts_gzip(const std::string &_accept_encoding)
+{
+    const char *p = _accept_encoding.data();
+    const char *end = p + _accept_encoding.size();
+    double gzip = -1, any = -1;
+
+    while(p != end) {
+        const char *coding_end = static_cast<const char*>(memchr(p, ',', end - p));
+
+        if(coding_end == 0) {
+            coding_end = end;
+        }
+
+        p += strspn(p, " \t");
+
+        const char *name_end = p;
+
+        while(name_end != coding_end && *name_end != ';' && *name_end != ' ' && *name_end != '\t') {
+            name_end++;
+        }
+
+        const char *params = static_cast<const char*>(memchr(name_end, ';', coding_end - name_end));
+        double q = params != 0 ? coding_quality(params + 1, coding_end) : 1;
+
+        if(name_end - p == 4 && strncasecmp(p, "gzip", 4) == 0) {
+            gzip = q;
+        }
+        else if(name_end - p == 1 && *p == '*') {
+            any = q;
+        }
+
+        p = coding_end == end ? end : coding_end + 1;
+    }
+
+    return gzip >= 0 ? gzip > 0 : any > 0;
+}
+
+};
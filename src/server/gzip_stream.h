@@ -0,0 +1,89 @@
+
+#ifndef _GZIP_STREAM_H_
+#define _GZIP_STREAM_H_
+
+#include <string>
+#include <iostream>
+#include <streambuf>
+
+#include <zlib.h>
+
+namespace fp {
+
+/*
+ * Stream buffer that compresses everything written to it into a gzip
+ * member kept in memory
+ */
+class gzip_ostreambuf : public std::streambuf {
+public:
+    gzip_ostreambuf(int _level = Z_BEST_COMPRESSION);
+    virtual ~gzip_ostreambuf();
+
+    /*
+     * Flush pending input and write gzip trailer. The buffer must not be
+     * written to afterwards
+     */
+    void finish();
+
+    /*
+     * Compressed data
+     */
+    std::string &data() { return output; }
+
+    /*
+     * Number of bytes written before compression
+     */
+    size_t size() const { return zs.total_in + (pptr() - pbase()); }
+
+protected:
+    virtual int_type overflow(int_type c);
+    virtual int sync();
+
+private:
+    void deflate_buffer(int flush);
+
+    gzip_ostreambuf(const gzip_ostreambuf&);
+    gzip_ostreambuf &operator=(const gzip_ostreambuf&);
+
+private:
+    static const size_t buffer_size = 16384;
+
+    z_stream            zs;
+    bool                finished;
+    std::string         output;
+    char                buffer[buffer_size];
+};
+
+class gzip_ostream : public std::ostream {
+public:
+    gzip_ostream(int _level = Z_BEST_COMPRESSION)
+        : std::ostream(0)
+        , m_buf(_level)
+    {
+        init(&m_buf);
+    }
+
+    void finish() { m_buf.finish(); }
+    std::string &data() { return m_buf.data(); }
+    size_t size() const { return m_buf.size(); }
+
+private:
+    gzip_ostreambuf m_buf;
+};
+
+/*
+ * Decompress gzip data into a stream
+ *
+ * @return false if data is corrupted
+ */
+bool gzip_inflate(const std::string &_data, std::ostream &_out);
+
+/*
+ * Check Accept-Encoding request header for gzip: either gzip itself or
+ * "*", when gzip is not listed, with non-zero quality value
+ */
+bool accepts_gzip(const std::string &_accept_encoding);
+
+};
+
+#endif //_GZIP_STREAM_H_
@@ -0,0 +1,78 @@
+#include <sstream>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "gzip_stream.h"
+
+using namespace fp;
+
+/*
+ * Compression round trip and Accept-Encoding negotiation
+ */
+class gzip_stream_test : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(gzip_stream_test);
+    CPPUNIT_TEST(test_round_trip);
+    CPPUNIT_TEST(test_accepts_gzip);
+    CPPUNIT_TEST(test_quality);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void test_round_trip()
+    {
+        std::string text;
+
+        for(int i = 0 ; i != 10000 ; i++) {
+            text += "<url><loc>http://example.com/</loc></url>";
+        }
+
+        gzip_ostream out;
+
+        out << text;
+        out.finish();
+
+        CPPUNIT_ASSERT_EQUAL(text.size(), out.size());
+        CPPUNIT_ASSERT(out.data().size() < text.size());
+
+        std::ostringstream in;
+
+        CPPUNIT_ASSERT(gzip_inflate(out.data(), in));
+        CPPUNIT_ASSERT(in.str() == text);
+        CPPUNIT_ASSERT(!gzip_inflate(out.data().substr(0, out.data().size() / 2), in));
+    }
+
+    void test_accepts_gzip()
+    {
+        CPPUNIT_ASSERT(accepts_gzip("gzip"));
+        CPPUNIT_ASSERT(accepts_gzip("GZIP"));
+        CPPUNIT_ASSERT(accepts_gzip("gzip, deflate, br"));
+        CPPUNIT_ASSERT(accepts_gzip("deflate,gzip"));
+        CPPUNIT_ASSERT(accepts_gzip("*"));
+
+        CPPUNIT_ASSERT(!accepts_gzip(""));
+        CPPUNIT_ASSERT(!accepts_gzip("identity"));
+        CPPUNIT_ASSERT(!accepts_gzip("x-gzip"));
+        CPPUNIT_ASSERT(!accepts_gzip("gzipped"));
+        CPPUNIT_ASSERT(!accepts_gzip("deflate, x-gzip;q=1"));
+    }
+
+    void test_quality()
+    {
+        CPPUNIT_ASSERT(accepts_gzip("gzip;q=0.5"));
+        CPPUNIT_ASSERT(accepts_gzip("gzip ; q=1.0"));
+        CPPUNIT_ASSERT(accepts_gzip("gzip;level=1;q=0.1, identity"));
+        CPPUNIT_ASSERT(accepts_gzip("identity;q=0, *;q=0.2"));
+
+        CPPUNIT_ASSERT(!accepts_gzip("gzip;q=0"));
+        CPPUNIT_ASSERT(!accepts_gzip("gzip; q=0.000, deflate"));
+        CPPUNIT_ASSERT(!accepts_gzip("gzip;Q=0"));
+        CPPUNIT_ASSERT(!accepts_gzip("*;q=0"));
+
+        /*
+         * Explicit gzip takes precedence over "*"
+         */
+        CPPUNIT_ASSERT(!accepts_gzip("gzip;q=0, *"));
+        CPPUNIT_ASSERT(accepts_gzip("*;q=0, gzip"));
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(gzip_stream_test);
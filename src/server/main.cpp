@@ -12,6 +12,7 @@
 #include <logger/logger.h>
 
 #include "fcgi_server.h"
+#include "shm_cache.h"
 
 #include "main.h"
 
@@ -19,6 +20,8 @@ using namespace fp;
 
 static bool run_main_process = true;
 
+fp::shm_cache *shared_page_cache = 0;
+
 void init_classifier();
 
 int worker_process();
@@ -194,6 +197,16 @@ int main(int argc,char *argv[])
 #endif
     main_process.add_function(worker_process, 1);   
 
+    try {
+        /*
+         * Workers inherit the mapping and keep it across respawns
+         */
+        shared_page_cache = new shm_cache(128 * 1024 * 1024);
+    }
+    catch(const std::exception &e) {
+        LogError("shared page cache disabled: " << e.what());
+    }
+
     if(!main_process.functions_defined()) {
         std::cerr << "No workers defined" << std::endl;
         return -1;
@@ -6,6 +6,16 @@
 
 #include <map>
 
+namespace fp {
+class shm_cache;
+};
+
+/*
+ * Page cache shared by worker processes, created by the master
+ * before workers are forked. 0 if it could not be created
+ */
+extern fp::shm_cache *shared_page_cache;
+
 typedef int (*worker_function_fp)();
 
 class MainProcess {
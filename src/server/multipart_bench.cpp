@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <sstream>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "fcgi_protocol.h"
+#include "fcgi_handler.h"
+#include "simd.h"
+
+using namespace fp;
+
+#define BENCH_BOUNDARY "----b3nchb0undary"
+
+static const size_t BODY_SIZE = 8 * 1024 * 1024;
+static const size_t CHUNK_SIZE = 16384;
+static const int ROUNDS = 4;
+
+/*
+ * Throughput of the multipart/form-data data state before and after
+ * delimiter search was vectorized, and of parse_form_data as a whole.
+ * Both data states are reproduced below in the same harness, so that
+ * only the scan differs. Results are printed, not asserted, parsed
+ * content must match the part in every case
+ */
+class multipart_bench : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(multipart_bench);
+    CPPUNIT_TEST(bench_text);
+    CPPUNIT_TEST(bench_binary);
+    CPPUNIT_TEST(bench_line_breaks);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void bench_text()
+    {
+        std::string value;
+
+        /*
+         * Text of 80 character lines
+         */
+        while(value.size() < BODY_SIZE) {
+            value.append(78, 'a' + value.size() % 26);
+            value.append("\r\n");
+        }
+
+        run("text", value);
+    }
+
+    void bench_binary()
+    {
+        std::string value;
+        unsigned x = 1;
+
+        while(value.size() < BODY_SIZE) {
+            x = x * 1103515245 + 12345;
+            value += (char)(x >> 16);
+        }
+
+        run("binary", value);
+    }
+
+    void bench_line_breaks()
+    {
+        /*
+         * CR or LF every few bytes, where a search for CR and LF alone
+         * would stop every few bytes
+         */
+        std::string value;
+
+        while(value.size() < BODY_SIZE) {
+            value.append("ab\r\ncd\n");
+        }
+
+        run("line breaks", value);
+    }
+
+private:
+    void run(const char *name, const std::string &value)
+    {
+        std::string body = "--" BENCH_BOUNDARY "\r\nContent-Disposition: form-data; name=\"f\"\r\n\r\n"
+            + value + "\r\n--" BENCH_BOUNDARY "--\r\n";
+        double byte_wise_time = 1e9, vectorized_time = 1e9, parse_time = 1e9;
+
+        for(int i = 0 ; i != ROUNDS ; i++) {
+            double start = now();
+
+            CPPUNIT_ASSERT(scan(body, false) == value);
+
+            byte_wise_time = std::min(byte_wise_time, now() - start);
+            start = now();
+
+            CPPUNIT_ASSERT(scan(body, true) == value);
+
+            vectorized_time = std::min(vectorized_time, now() - start);
+            start = now();
+
+            CPPUNIT_ASSERT(parse(body) == value);
+
+            parse_time = std::min(parse_time, now() - start);
+        }
+
+        printf("\nmultipart %-12s byte-wise %7.1f MB/s, vectorized %7.1f MB/s (%.1fx), parse_form_data %7.1f MB/s",
+            name, body.size() / byte_wise_time / 1e6, body.size() / vectorized_time / 1e6,
+            byte_wise_time / vectorized_time, body.size() / parse_time / 1e6);
+    }
+
+    static double now()
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, 0);
+
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+
+    static std::string parse(const std::string &body)
+    {
+        fcgi_values values;
+        arena request_arena;
+        fcgi_request request(request_arena, values);
+        fcgi_request_data data(0, 1, FCGI_RESPONDER, false);
+        std::ostringstream length;
+
+        values.spool_threshold = 2 * BODY_SIZE;
+        values.spool_dir = "/tmp";
+        values.max_body = 0;
+
+        length << body.size();
+
+        fcgi_encode_name_value(data.params, "CONTENT_TYPE", "multipart/form-data; boundary=" BENCH_BOUNDARY);
+        fcgi_encode_name_value(data.params, "CONTENT_LENGTH", length.str());
+
+        data.stdin_data = body;
+        data.stdin_length = body.size();
+
+        request.attach(data);
+        request.parse_form_data();
+
+        std::string result = request.get_formdata_param("f").str();
+
+        request.clear();
+
+        return result;
+    }
+
+    /*
+     * Data state of the parser on the body fed in chunks as
+     * parse_form_data does. Byte-wise is the state machine before
+     * vectorization: every byte is matched against the delimiter and
+     * copied to the output buffer one at a time. Vectorized searches
+     * for the whole delimiter while no part of it is matched and copies
+     * everything before it in bulk, as the parser does now
+     */
+    static std::string scan(const std::string &body, bool vectorized)
+    {
+        const std::string boundary = "\r\n--" BENCH_BOUNDARY;
+        std::string result;
+        u_char output_buffer[CHUNK_SIZE];
+        u_char *output_buffer_pos = output_buffer;
+        u_char *output_buffer_end = output_buffer + sizeof(output_buffer);
+        std::string::const_iterator boundary_start = boundary.begin();
+        std::string::const_iterator boundary_pos = boundary_start;
+        bool done = false;
+
+        result.reserve(body.size());
+
+        /*
+         * Skip the first delimiter and part headers
+         */
+        size_t pos = body.find("\r\n\r\n") + 4;
+
+        for( ; pos < body.size() && !done ; pos += CHUNK_SIZE) {
+            const u_char *p = (const u_char*)body.data() + pos;
+            const u_char *end = p + std::min(CHUNK_SIZE, body.size() - pos);
+
+            for( ; p < end ; p++) {
+                if(vectorized && boundary_pos == boundary.begin()) {
+                    const u_char *delim = (const u_char*)boundary.data() + 1;
+                    size_t delim_len = boundary.size() - 1;
+                    const u_char *q = simd_find(p, end, delim, delim_len);
+
+                    if(q != end) {
+                        if(q != p && q[-1] == '\r') {
+                            q--;
+                        }
+                    }
+                    else {
+                        q = (size_t)(end - p) > delim_len ? end - delim_len : p;
+                        q = simd_find_byte2(q, end, '\r', '\n');
+                    }
+
+                    while(p != q) {
+                        size_t len = std::min((size_t)(q - p), (size_t)(output_buffer_end - output_buffer_pos));
+
+                        memcpy(output_buffer_pos, p, len);
+
+                        output_buffer_pos += len;
+                        p += len;
+
+                        if(output_buffer_pos == output_buffer_end) {
+                            result.append((const char*)output_buffer, output_buffer_pos - output_buffer);
+                            output_buffer_pos = output_buffer;
+                        }
+                    }
+
+                    if(p == end) {
+                        break;
+                    }
+                }
+
+                if(*p == (u_char)*boundary_pos) {
+                    boundary_pos++;
+                }
+                else {
+                    if(boundary_pos == boundary_start) {
+                        if(*p == '\n') {
+                            boundary_pos = boundary.begin() + 2;
+                            boundary_start = boundary.begin() + 1;
+                        }
+                        else {
+                            *output_buffer_pos++ = *p;
+
+                            if(output_buffer_pos == output_buffer_end) {
+                                result.append((const char*)output_buffer, output_buffer_pos - output_buffer);
+                                output_buffer_pos = output_buffer;
+                            }
+                        }
+                    }
+                    else {
+                        for(std::string::const_iterator q = boundary_start ; q != boundary_pos ; q++) {
+                            *output_buffer_pos++ = *q;
+
+                            if(output_buffer_pos == output_buffer_end) {
+                                result.append((const char*)output_buffer, output_buffer_pos - output_buffer);
+                                output_buffer_pos = output_buffer;
+                            }
+                        }
+
+                        p--;
+
+                        boundary_start = boundary.begin();
+                        boundary_pos = boundary_start;
+                    }
+                }
+
+                if(boundary_pos == boundary.end()) {
+                    done = true;
+                    break;
+                }
+            }
+        }
+
+        result.append((const char*)output_buffer, output_buffer_pos - output_buffer);
+
+        return result;
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(multipart_bench);
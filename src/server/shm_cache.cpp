@@ -0,0 +1,596 @@
+
+#include <stdexcept>
+#include <algorithm>
+
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <logger/logger.h>
+
+#include "shm_cache.h"
+
+#define SHM_MAGIC               0x53484d43
+
+/*
+ * Slab page size, also the largest item size
+ */
+#define SHM_PAGE_SIZE           (1024 * 1024)
+
+/*
+ * Item size classes: 512 bytes to 1 megabyte
+ */
+#define SHM_MIN_ITEM_SHIFT      9
+#define SHM_NUM_CLASSES         12
+
+#define SHM_BUCKET_SLOTS        4
+#define SHM_BYTES_PER_BUCKET    8192
+
+/*
+ * How many times a reader retries when writers modify its bucket
+ */
+#define SHM_READ_ATTEMPTS       16
+
+#define SHM_ALIGN(x, a)         (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+namespace fp {
+
+struct shm_cache::slab_class {
+    uint32_t    item_size;
+    uint32_t    num_pages;
+    uint64_t    free_list;
+
+    /*
+     * Position of eviction sweep
+     */
+    uint32_t    hand_page;
+    uint32_t    hand_item;
+};
+
+struct shm_cache::header {
+    uint32_t            magic;
+    uint32_t            num_buckets;
+    uint32_t            num_pages;
+    uint32_t            next_page;      // first page not given to a class yet
+    pthread_mutex_t     lock;
+    slab_class          classes[SHM_NUM_CLASSES];
+
+    volatile unsigned long hits;
+    volatile unsigned long misses;
+    volatile unsigned long inserts;
+    volatile unsigned long evictions;
+};
+
+/*
+ * Index bucket. Sequence counter is odd while a writer modifies the
+ * bucket or an item it references
+ */
+struct shm_cache::bucket {
+    struct slot {
+        uint64_t    hash;
+        uint64_t    item;       // offset of item from segment start, 0 if empty
+    };
+
+    volatile uint32_t   seq;
+    uint32_t            pad;
+    slot                slots[SHM_BUCKET_SLOTS];
+};
+
+/*
+ * Item header, followed by key and data
+ */
+struct shm_cache::item {
+    uint64_t    next;           // free list link
+    int64_t     expires;
+    uint32_t    bucket;
+    uint32_t    key_len;
+    uint32_t    data_len;
+    uint8_t     cls;
+    uint8_t     in_use;
+    uint8_t     referenced;
+    uint8_t     pad;
+};
+
+shm_cache::shm_cache(size_t _size)
+{
+    size_t num_buckets = _size / SHM_BYTES_PER_BUCKET;
+
+    if(num_buckets < 64) {
+        num_buckets = 64;
+    }
+
+    size_t header_size = SHM_ALIGN(sizeof(header), 64);
+    size_t buckets_size = num_buckets * sizeof(bucket);
+    size_t overhead = header_size + buckets_size + 2 * 4096;
+
+    if(_size < overhead + SHM_PAGE_SIZE + 1) {
+        throw std::runtime_error("shared cache is too small");
+    }
+
+    size_t num_pages = (_size - overhead) / (SHM_PAGE_SIZE + 1);
+    size_t page_classes_size = SHM_ALIGN(num_pages, 64);
+    size_t pages_offset = SHM_ALIGN(header_size + page_classes_size + buckets_size, 4096);
+
+    size = pages_offset + num_pages * SHM_PAGE_SIZE;
+
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(p == MAP_FAILED) {
+        throw std::runtime_error("cannot map shared cache: " + std::string(strerror(errno)));
+    }
+
+    base = static_cast<u_char*>(p);
+    hdr = reinterpret_cast<header*>(base);
+    page_classes = base + header_size;
+    buckets = reinterpret_cast<bucket*>(base + header_size + page_classes_size);
+    pages = base + pages_offset;
+
+    /*
+     * Anonymous mapping is zero filled
+     */
+    hdr->magic = SHM_MAGIC;
+    hdr->num_buckets = num_buckets;
+    hdr->num_pages = num_pages;
+    hdr->next_page = 0;
+
+    for(unsigned i = 0 ; i != SHM_NUM_CLASSES ; i++) {
+        hdr->classes[i].item_size = 1 << (SHM_MIN_ITEM_SHIFT + i);
+    }
+
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&hdr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * Each process unmaps its own view of the segment, memory is released
+ * when the last process is gone
+ */
+shm_cache::~shm_cache()
+{
+    munmap(base, size);
+}
+
+uint64_t shm_cache::hash_key(const std::string &_key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for(std::string::const_iterator p = _key.begin() ; p != _key.end() ; p++) {
+        hash ^= (u_char)*p;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+shm_cache::item *shm_cache::get_item(uint64_t _offset) const
+{
+    return reinterpret_cast<item*>(base + _offset);
+}
+
+uint64_t shm_cache::get_offset(const item *_item) const
+{
+    return reinterpret_cast<const u_char*>(_item) - base;
+}
+
+void shm_cache::lock()
+{
+    int rc = pthread_mutex_lock(&hdr->lock);
+
+    if(rc == EOWNERDEAD) {
+        /*
+         * Previous owner died in the middle of an update
+         */
+        LogError("shared cache lock owner died, clearing cache");
+
+        reset();
+
+        pthread_mutex_consistent(&hdr->lock);
+    }
+}
+
+void shm_cache::unlock()
+{
+    pthread_mutex_unlock(&hdr->lock);
+}
+
+/*
+ * Drop all entries and return all pages. Must be called with lock held
+ */
+void shm_cache::reset()
+{
+    for(uint32_t i = 0 ; i != hdr->num_buckets ; i++) {
+        bucket &b = buckets[i];
+
+        /*
+         * Make the counter even and different from what readers
+         * may have seen
+         */
+        b.seq = (b.seq | 1) + 1;
+        __sync_synchronize();
+
+        memset(b.slots, 0, sizeof(b.slots));
+    }
+
+    memset(page_classes, 0, hdr->num_pages);
+
+    hdr->next_page = 0;
+
+    for(unsigned i = 0 ; i != SHM_NUM_CLASSES ; i++) {
+        hdr->classes[i].num_pages = 0;
+        hdr->classes[i].free_list = 0;
+        hdr->classes[i].hand_page = 0;
+        hdr->classes[i].hand_item = 0;
+    }
+}
+
+void shm_cache::remove_slot(bucket &_bucket, unsigned _slot)
+{
+    _bucket.seq++;
+    __sync_synchronize();
+
+    _bucket.slots[_slot].hash = 0;
+    _bucket.slots[_slot].item = 0;
+
+    __sync_synchronize();
+    _bucket.seq++;
+}
+
+/*
+ * Remove item from the index. Readers that found it before retry, so
+ * item memory can be reused afterwards
+ */
+void shm_cache::unlink_item(item *_item)
+{
+    bucket &b = buckets[_item->bucket];
+    uint64_t offset = get_offset(_item);
+
+    for(unsigned s = 0 ; s != SHM_BUCKET_SLOTS ; s++) {
+        if(b.slots[s].item == offset) {
+            remove_slot(b, s);
+            break;
+        }
+    }
+}
+
+void shm_cache::free_item(unsigned _cls, uint64_t _offset)
+{
+    item *it = get_item(_offset);
+
+    it->in_use = 0;
+    it->next = hdr->classes[_cls].free_list;
+    hdr->classes[_cls].free_list = _offset;
+}
+
+/*
+ * Evict one item of a class in CLOCK order
+ *
+ * @return false if the class has no items to evict
+ */
+bool shm_cache::evict_item(unsigned _cls)
+{
+    slab_class &c = hdr->classes[_cls];
+
+    if(c.num_pages == 0) {
+        return false;
+    }
+
+    uint32_t per_page = SHM_PAGE_SIZE / c.item_size;
+    time_t now = time(NULL);
+
+    for(size_t n = 2 * (c.num_pages + 1) * per_page ; n != 0 ; n--) {
+        if(c.hand_item >= per_page || page_classes[c.hand_page] != _cls + 1) {
+            c.hand_item = 0;
+
+            do {
+                c.hand_page = (c.hand_page + 1) % hdr->num_pages;
+            } while(page_classes[c.hand_page] != _cls + 1);
+        }
+
+        item *it = reinterpret_cast<item*>(pages + (size_t)c.hand_page * SHM_PAGE_SIZE + c.hand_item * c.item_size);
+
+        c.hand_item++;
+
+        if(!it->in_use) {
+            continue;
+        }
+
+        if(it->referenced && it->expires > now) {
+            it->referenced = 0;
+            continue;
+        }
+
+        unlink_item(it);
+        free_item(_cls, get_offset(it));
+
+        __sync_add_and_fetch(&hdr->evictions, 1);
+
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Take an item from the free list of a class, giving the class a new
+ * page or evicting an item if needed. Pages are not taken back from
+ * a class once given
+ *
+ * @return offset of item or 0
+ */
+uint64_t shm_cache::alloc_item(unsigned _cls)
+{
+    slab_class &c = hdr->classes[_cls];
+
+    if(c.free_list == 0) {
+        if(hdr->next_page < hdr->num_pages) {
+            uint32_t page = hdr->next_page++;
+            uint32_t per_page = SHM_PAGE_SIZE / c.item_size;
+
+            page_classes[page] = _cls + 1;
+            c.num_pages++;
+
+            for(uint32_t i = per_page ; i != 0 ; i--) {
+                item *it = reinterpret_cast<item*>(pages + (size_t)page * SHM_PAGE_SIZE + (i - 1) * c.item_size);
+
+                it->cls = _cls;
+                free_item(_cls, get_offset(it));
+            }
+        }
+        else if(!evict_item(_cls)) {
+            return 0;
+        }
+    }
+
+    uint64_t offset = c.free_list;
+
+    c.free_list = get_item(offset)->next;
+
+    return offset;
+}
+
+bool shm_cache::lookup(const std::string &_key, std::string &_data, time_t &_expires)
+{
+    uint64_t hash = hash_key(_key);
+    bucket &b = buckets[hash % hdr->num_buckets];
+    uint64_t min_offset = pages - base;
+
+    for(unsigned attempt = 0 ; attempt != SHM_READ_ATTEMPTS ; attempt++) {
+        uint32_t seq = b.seq;
+        bool found = false;
+
+        if(seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        __sync_synchronize();
+
+        for(unsigned s = 0 ; s != SHM_BUCKET_SLOTS ; s++) {
+            uint64_t offset = b.slots[s].item;
+
+            if(offset == 0 || b.slots[s].hash != hash) {
+                continue;
+            }
+
+            /*
+             * Item may be changing under us, validate before copying
+             */
+            if(offset < min_offset || offset + sizeof(item) > size) {
+                break;
+            }
+
+            item *it = get_item(offset);
+            size_t key_len = it->key_len;
+            size_t data_len = it->data_len;
+
+            if(sizeof(item) + key_len + data_len > SHM_PAGE_SIZE || offset + sizeof(item) + key_len + data_len > size) {
+                break;
+            }
+
+            const char *key = reinterpret_cast<const char*>(it + 1);
+
+            if(key_len != _key.size() || memcmp(key, _key.data(), key_len) != 0) {
+                continue;
+            }
+
+            _data.assign(key + key_len, data_len);
+            _expires = it->expires;
+            it->referenced = 1;
+            found = true;
+            break;
+        }
+
+        __sync_synchronize();
+
+        if(b.seq != seq) {
+            continue;
+        }
+
+        if(found && _expires > time(NULL)) {
+            __sync_add_and_fetch(&hdr->hits, 1);
+            return true;
+        }
+
+        break;
+    }
+
+    __sync_add_and_fetch(&hdr->misses, 1);
+
+    return false;
+}
+
+void shm_cache::insert(const std::string &_key, const std::string &_data, unsigned _ttl)
+{
+    size_t item_size = sizeof(item) + _key.size() + _data.size();
+
+    if(item_size > SHM_PAGE_SIZE) {
+        return;
+    }
+
+    unsigned cls = 0;
+
+    while(hdr->classes[cls].item_size < item_size) {
+        cls++;
+    }
+
+    uint64_t hash = hash_key(_key);
+    uint32_t bucket_index = hash % hdr->num_buckets;
+    bucket &b = buckets[bucket_index];
+
+    lock();
+
+    /*
+     * Remove previous version
+     */
+    for(unsigned s = 0 ; s != SHM_BUCKET_SLOTS ; s++) {
+        if(b.slots[s].item != 0 && b.slots[s].hash == hash) {
+            item *old = get_item(b.slots[s].item);
+
+            if(old->key_len == _key.size() && memcmp(old + 1, _key.data(), _key.size()) == 0) {
+                uint64_t offset = b.slots[s].item;
+
+                remove_slot(b, s);
+                free_item(old->cls, offset);
+            }
+        }
+    }
+
+    uint64_t offset = alloc_item(cls);
+
+    if(offset == 0) {
+        unlock();
+        return;
+    }
+
+    item *it = get_item(offset);
+
+    it->expires = time(NULL) + _ttl;
+    it->bucket = bucket_index;
+    it->key_len = _key.size();
+    it->data_len = _data.size();
+    it->in_use = 1;
+    it->referenced = 0;
+
+    memcpy(it + 1, _key.data(), _key.size());
+    memcpy(reinterpret_cast<u_char*>(it + 1) + _key.size(), _data.data(), _data.size());
+
+    /*
+     * Take a free slot or the one that expires first
+     */
+    unsigned slot = 0;
+
+    for(unsigned s = 0 ; s != SHM_BUCKET_SLOTS ; s++) {
+        if(b.slots[s].item == 0) {
+            slot = s;
+            break;
+        }
+
+        if(get_item(b.slots[s].item)->expires < get_item(b.slots[slot].item)->expires) {
+            slot = s;
+        }
+    }
+
+    if(b.slots[slot].item != 0) {
+        item *victim = get_item(b.slots[slot].item);
+        uint64_t victim_offset = b.slots[slot].item;
+
+        remove_slot(b, slot);
+        free_item(victim->cls, victim_offset);
+
+        __sync_add_and_fetch(&hdr->evictions, 1);
+    }
+
+    b.seq++;
+    __sync_synchronize();
+
+    b.slots[slot].hash = hash;
+    b.slots[slot].item = offset;
+
+    __sync_synchronize();
+    b.seq++;
+
+    unlock();
+
+    __sync_add_and_fetch(&hdr->inserts, 1);
+}
+
+void shm_cache::invalidate(const string_ref &_host, const string_ref &_path)
+{
+    invalidate(_host, std::vector<std::string>(1, std::string(_path.data(), _path.size())));
+}
+
+void shm_cache::invalidate(const string_ref &_host, const std::vector<std::string> &_paths)
+{
+    std::vector<std::string> prefixes;
+    std::vector<string_ref> refs;
+
+    prefixes.reserve(_paths.size());
+
+    for(std::vector<std::string>::const_iterator i = _paths.begin() ; i != _paths.end() ; i++) {
+        prefixes.push_back(std::string());
+        prefixes.back().reserve(_host.size() + i->size());
+        prefixes.back().append(_host.data(), _host.size());
+        prefixes.back().append(*i);
+    }
+
+    for(std::vector<std::string>::const_iterator i = prefixes.begin() ; i != prefixes.end() ; i++) {
+        refs.push_back(*i);
+    }
+
+    std::sort(refs.begin(), refs.end());
+
+    if(refs.empty()) {
+        return;
+    }
+
+    lock();
+
+    for(uint32_t i = 0 ; i != hdr->num_buckets ; i++) {
+        bucket &b = buckets[i];
+
+        for(unsigned s = 0 ; s != SHM_BUCKET_SLOTS ; s++) {
+            if(b.slots[s].item == 0) {
+                continue;
+            }
+
+            uint64_t offset = b.slots[s].item;
+            item *it = get_item(offset);
+            string_ref key(reinterpret_cast<const char*>(it + 1), it->key_len);
+
+            if(std::binary_search(refs.begin(), refs.end(), key.substr(0, key.find('?')))) {
+                remove_slot(b, s);
+                free_item(it->cls, offset);
+            }
+        }
+    }
+
+    unlock();
+}
+
+void shm_cache::clear()
+{
+    lock();
+    reset();
+    unlock();
+}
+
+shm_cache_stats shm_cache::get_stats() const
+{
+    shm_cache_stats stats;
+
+    stats.capacity = (size_t)hdr->num_pages * SHM_PAGE_SIZE;
+    stats.hits = hdr->hits;
+    stats.misses = hdr->misses;
+    stats.inserts = hdr->inserts;
+    stats.evictions = hdr->evictions;
+
+    return stats;
+}
+
+};
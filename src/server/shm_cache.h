@@ -0,0 +1,114 @@
+
+#ifndef _SHM_CACHE_H_
+#define _SHM_CACHE_H_
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "string_ref.h"
+
+namespace fp {
+
+/*
+ * Shared cache statistics
+ */
+struct shm_cache_stats {
+    size_t capacity;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long inserts;
+    unsigned long evictions;
+};
+
+/*
+ * Response cache in a shared memory segment. The segment is created by
+ * the master process before it forks workers, so all workers share the
+ * cache and a respawned worker starts with a warm one.
+ *
+ * Values are kept in slab pages split into items of power of two size
+ * classes. Hash index buckets are protected by sequence counters: readers
+ * copy the value out without taking any lock and retry if a writer
+ * modified the bucket meanwhile. Writers are serialized by a robust
+ * process-shared mutex, so a worker that dies while holding it does not
+ * block others; the cache is cleared in that case as it may be
+ * inconsistent
+ */
+class shm_cache {
+public:
+    /*
+     * Map a segment of _size bytes
+     */
+    shm_cache(size_t _size);
+    ~shm_cache();
+
+    /*
+     * Find fresh entry and copy its data
+     *
+     * @return true if found
+     */
+    bool lookup(const std::string &_key, std::string &_data, time_t &_expires);
+
+    /*
+     * Add or replace entry. Entries larger than the largest item size
+     * are not stored
+     */
+    void insert(const std::string &_key, const std::string &_data, unsigned _ttl);
+
+    /*
+     * Remove entries of a page for all query arguments
+     */
+    void invalidate(const string_ref &_host, const string_ref &_path);
+
+    /*
+     * Remove entries of several pages in one pass over the index
+     */
+    void invalidate(const string_ref &_host, const std::vector<std::string> &_paths);
+
+    /*
+     * Remove all entries
+     */
+    void clear();
+
+    shm_cache_stats get_stats() const;
+
+private:
+    struct header;
+    struct slab_class;
+    struct bucket;
+    struct item;
+
+    static uint64_t hash_key(const std::string &_key);
+
+    item *get_item(uint64_t _offset) const;
+    uint64_t get_offset(const item *_item) const;
+
+    void lock();
+    void unlock();
+    void reset();
+
+    uint64_t alloc_item(unsigned _cls);
+    void free_item(unsigned _cls, uint64_t _offset);
+    bool evict_item(unsigned _cls);
+    void unlink_item(item *_item);
+    void remove_slot(bucket &_bucket, unsigned _slot);
+
+    shm_cache(const shm_cache&);
+    shm_cache &operator=(const shm_cache&);
+
+private:
+    u_char *base;
+    size_t size;
+    header *hdr;
+    uint8_t *page_classes;
+    bucket *buckets;
+    u_char *pages;
+};
+
+};
+
+#endif //_SHM_CACHE_H_
@@ -0,0 +1,160 @@
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace fp {
+
+/*
+ * Byte and string search kernels. AVX2 is used when the compiler targets it,
+ * SSE2 on any other x86-64, plain loops elsewhere
+ */
+
+/*
+ * Find first occurrence of byte c in [p, end)
+ *
+ * @return pointer to the byte or end if not found
+ */
+inline const u_char *simd_find_byte(const u_char *p, const u_char *end, u_char c)
+{
+    const u_char *r = static_cast<const u_char*>(memchr(p, c, end - p));
+
+    return r != 0 ? r : end;
+}
+
+/*
+ * Find first occurrence of byte a or byte b in [p, end)
+ *
+ * @return pointer to the byte or end if not found
+ */
+inline const u_char *simd_find_byte2(const u_char *p, const u_char *end, u_char a, u_char b)
+{
+#if defined(__AVX2__)
+    const __m256i va = _mm256_set1_epi8((char)a);
+    const __m256i vb = _mm256_set1_epi8((char)b);
+
+    while(end - p >= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+
+        if(mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i xa = _mm_set1_epi8((char)a);
+    const __m128i xb = _mm_set1_epi8((char)b);
+
+    while(end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, xa), _mm_cmpeq_epi8(v, xb)));
+
+        if(mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+#endif
+
+    while(p != end && *p != a && *p != b) {
+        p++;
+    }
+
+    return p;
+}
+
+/*
+ * Find first occurrence of string [s, s + n) in [p, end). Candidate
+ * positions are those where both the first and the last byte of the string
+ * match, they are compared in full only then
+ *
+ * @return pointer to the occurrence or end if not found
+ */
+inline const u_char *simd_find(const u_char *p, const u_char *end, const u_char *s, size_t n)
+{
+    if(n == 0) {
+        return p;
+    }
+
+    if((size_t)(end - p) < n) {
+        return end;
+    }
+
+    /*
+     * Candidates are in [p, last)
+     */
+    const u_char *last = end - n + 1;
+
+#if defined(__AVX2__)
+    const __m256i vf = _mm256_set1_epi8((char)s[0]);
+    const __m256i vl = _mm256_set1_epi8((char)s[n - 1]);
+
+    while(last - p >= 32) {
+        __m256i f = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + n - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(f, vf), _mm256_cmpeq_epi8(l, vl)));
+
+        while(mask != 0) {
+            const u_char *q = p + __builtin_ctz(mask);
+
+            if(memcmp(q, s, n) == 0) {
+                return q;
+            }
+
+            mask &= mask - 1;
+        }
+
+        p += 32;
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i xf = _mm_set1_epi8((char)s[0]);
+    const __m128i xl = _mm_set1_epi8((char)s[n - 1]);
+
+    while(last - p >= 16) {
+        __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + n - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(f, xf), _mm_cmpeq_epi8(l, xl)));
+
+        while(mask != 0) {
+            const u_char *q = p + __builtin_ctz(mask);
+
+            if(memcmp(q, s, n) == 0) {
+                return q;
+            }
+
+            mask &= mask - 1;
+        }
+
+        p += 16;
+    }
+#endif
+
+    for(; p != last ; p++) {
+        if(*p == s[0] && p[n - 1] == s[n - 1] && memcmp(p, s, n) == 0) {
+            return p;
+        }
+    }
+
+    return end;
+}
+
+};
+
+#endif //_SIMD_H_
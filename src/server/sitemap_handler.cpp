@@ -4,31 +4,92 @@
 #include <fstream>
 #include <cmath>
 #include <vector>
+#include <algorithm>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
 
 #include <openssl/sha.h>
 
 #include <logger/logger.h>
 #include <db/db_pool.h>
+#include <db/db_row.h>
 
 #include "xml.h"
+#include "gzip_stream.h"
 
 #include "sitemap_handler.h"
 
+/*
+ * Limits of a single sitemap file set by sitemaps.org protocol. Size
+ * limit leaves room for one more entry and the closing tag
+ */
+#define SITEMAP_MAX_URLS 50000
+#define SITEMAP_MAX_SIZE (50 * 1024 * 1024 - 16384)
+
+#define SITEMAP_NS "http://www.sitemaps.org/schemas/sitemap/0.9"
+
+/*
+ * How long a request waits for the first rendering of sitemaps
+ */
+#define SITEMAP_INITIAL_WAIT 10
+
 namespace fp {
 
 sitemap_handler::sitemap_handler()
+    : refresh_interval(60)
+    , full_rebuild_interval(86400)
+    , thread_running(false)
+    , exiting(false)
+    , refresh_requested(false)
+    , first_pass_done(false)
 {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wakeup, NULL);
+    pthread_cond_init(&rendered, NULL);
 }
 
 sitemap_handler::~sitemap_handler()
 {
+    for(SiteContainer::iterator i = sites.begin() ; i != sites.end() ; i++) {
+        if(i->second.files != 0) {
+            i->second.files->unref();
+        }
+
+        delete i->second.model;
+    }
+
+    pthread_cond_destroy(&rendered);
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&lock);
 }
 
 void sitemap_handler::init()
 {
+    if(pthread_create(&thread, NULL, sitemap_handler::render_thread_starter, (void*)this) != 0) {
+        LogError("cannot create sitemap render thread: " << errno);
+        return;
+    }
+
+    thread_running = true;
 }
 
 void sitemap_handler::shutdown() {
+    void *return_value;
+
+    if(!thread_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    exiting = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, &return_value);
+
+    thread_running = false;
 }
 
 void sitemap_handler::return_error(fcgi_response &_response, const std::string &msg, int status) const {
@@ -50,7 +111,7 @@ void sitemap_handler::return_error(fcgi_response &_response, const std::string &
 std::string sitemap_handler::get_base_url(DBConn &conn)
 {
     DBStmt stmt(conn, "select option_value from wp_options where option_name='home'");
-    
+
     stmt.execute();
 
     return stmt.fetch() ? stmt.asString(0) : "";
@@ -59,53 +120,165 @@ std::string sitemap_handler::get_base_url(DBConn &conn)
 size_t sitemap_handler::get_num_posts_per_page(DBConn &conn)
 {
     DBStmt stmt(conn, "select option_value from wp_options where option_name='posts_per_page'");
-    
+
     stmt.execute();
 
-    return stmt.fetch() ? stmt.asInt(0) : 10;
+    return stmt.fetch() ? stmt.asInt32(0) : 10;
 }
 
-void sitemap_handler::add_url(XMLDoc &doc, const std::string &loc, const std::string &lastmod, const std::string &changefreq, double priority)
+void sitemap_handler::add_url(XMLWriter &xml, const string_ref &loc, const string_ref &lastmod, const char *changefreq, double priority)
 {
-    XMLNode url_elm("url");
+    char priority_str[32];
+    int len = snprintf(priority_str, sizeof(priority_str), "%g", priority);
+
+    xml.start("url");
+    xml.element("loc", loc);
+    xml.element("lastmod", lastmod);
+    xml.element("changefreq", changefreq);
+    xml.element("priority", string_ref(priority_str, len));
+    xml.end();
+}
 
-    XMLNode loc_elm("loc");
-    loc_elm.add_text(loc);
-    url_elm.add(loc_elm.release());
+void sitemap_handler::add_stylesheet(XMLWriter &xml, const std::string &hostname)
+{
+    if(hostname == "www.nginxguts.com") {
+        xml.pi("xml-stylesheet", "type=\"text/xsl\" href=\"wp-content/plugins/google-sitemap-plugin/sitemap.xsl\"");
+    }
+    else {
+        xml.pi("xml-stylesheet", "type=\"text/xsl\" href=\"wp-content/uploads/sitemap.xsl\"");
+    }
+}
 
-    XMLNode lastmod_elm("lastmod");
-    lastmod_elm.add_text(lastmod);
-    url_elm.add(lastmod_elm.release());
+/*
+ * Convert MySQL datetime to W3C datetime
+ */
+static void format_lastmod(std::string &lastmod, const DBTimestamp &ts)
+{
+    char buf[64];
+
+    if(ts.year == 0) {
+        lastmod.clear();
+        return;
+    }
 
-    XMLNode changefreq_elm("changefreq");
-    changefreq_elm.add_text(changefreq);
-    url_elm.add(changefreq_elm.release());
+    int len = snprintf(buf, sizeof(buf), "%04u-%02u-%02uT%02u:%02u:%02u+00:00",
+        ts.year, ts.month, ts.day, ts.hour, ts.minute, ts.second);
 
-    std::ostringstream priority_str;
-    priority_str << priority;
+    lastmod.assign(buf, len);
+}
+
+static void push_url(sitemap_url_list &urls, const std::string &loc, const std::string &lastmod,
+    const char *changefreq, double priority)
+{
+    urls.push_back(sitemap_url());
 
-    XMLNode priority_elm("priority");
-    priority_elm.add_text(priority_str.str());
-    url_elm.add(priority_elm.release());
+    sitemap_url &u = urls.back();
 
-    doc.add(url_elm.release());
+    u.loc = loc;
+    u.lastmod = lastmod;
+    u.changefreq = changefreq;
+    u.priority = priority;
 }
 
-void sitemap_handler::handle(fcgi_request &_request, fcgi_response &_response)
+static size_t url_size(const sitemap_url &u)
 {
-    LogInfo("sitemap_handler::handle");
+    return u.loc.size() + u.lastmod.size() + strlen(u.changefreq) + 128;
+}
 
-    std::string hostname(_request.get_fcgi_param("SERVER_NAME"));
+size_t sitemap_section::estimate_size(const sitemap_url_list &urls)
+{
+    size_t size = 0;
 
-    PoolContainer::const_iterator site = sites.find(hostname);
+    for(sitemap_url_list::const_iterator i = urls.begin() ; i != urls.end() ; i++) {
+        size += url_size(*i);
+    }
 
-    if(site == sites.end()) {
-        LogError("sitemap_handler::handle site not found: " << hostname);
-        return return_error(_response, "site not found: " + hostname);
+    return size;
+}
+
+void sitemap_section::put(const std::string &key, const sitemap_url_list &urls)
+{
+    size_t size = estimate_size(urls);
+
+    std::map<std::string, size_t>::iterator l = location.find(key);
+
+    if(l != location.end()) {
+        sitemap_shard &shard = shards[l->second];
+        sitemap_url_list &old_urls = shard.entries[key];
+
+        if(old_urls == urls) {
+            return;
+        }
+
+        size_t old_size = estimate_size(old_urls);
+
+        if(shard.num_urls - old_urls.size() + urls.size() <= SITEMAP_MAX_URLS
+            && shard.size - old_size + size <= SITEMAP_MAX_SIZE)
+        {
+            shard.num_urls = shard.num_urls - old_urls.size() + urls.size();
+            shard.size = shard.size - old_size + size;
+            shard.dirty = true;
+
+            old_urls = urls;
+            return;
+        }
+
+        /*
+         * Entry outgrew its shard, move it to the last one
+         */
+        remove(key);
     }
 
-    std::vector<std::string> post_types;
+    if(shards.empty() || shards.back().num_urls + urls.size() > SITEMAP_MAX_URLS
+        || shards.back().size + size > SITEMAP_MAX_SIZE)
+    {
+        shards.push_back(sitemap_shard());
+    }
+
+    sitemap_shard &shard = shards.back();
+
+    shard.entries[key] = urls;
+    shard.num_urls += urls.size();
+    shard.size += size;
+    shard.dirty = true;
+
+    location[key] = shards.size() - 1;
+}
+
+void sitemap_section::remove(const std::string &key)
+{
+    std::map<std::string, size_t>::iterator l = location.find(key);
+
+    if(l == location.end()) {
+        return;
+    }
+
+    sitemap_shard &shard = shards[l->second];
+    sitemap_entry_map::iterator e = shard.entries.find(key);
+
+    shard.num_urls -= e->second.size();
+    shard.size -= estimate_size(e->second);
+    shard.dirty = true;
+
+    shard.entries.erase(e);
+    location.erase(l);
+}
+
+static std::string post_key(unsigned long id)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "post:%lu", id);
+    return key;
+}
+
+static std::string term_key(const sitemap_term &term)
+{
+    return "term:" + term.first + ":" + term.second;
+}
 
+void sitemap_handler::get_types(const std::string &hostname, std::vector<std::string> &post_types,
+    std::vector<std::string> &taxonomy_types) const
+{
     post_types.push_back("post");
 
     if(hostname != "www.nginxguts.com") {
@@ -113,212 +286,766 @@ void sitemap_handler::handle(fcgi_request &_request, fcgi_response &_response)
         post_types.push_back("event");
     }
 
-    std::vector<std::string> taxonomy_types;
-
     taxonomy_types.push_back("category");
 
     if(hostname != "www.nginxguts.com") {
         taxonomy_types.push_back("placecategory");
     }
+}
+
+/*
+ * Make URL of a page or a post
+ */
+void sitemap_handler::make_post_urls(const std::string &hostname, const sitemap_model &model, const string_ref &post_type,
+    const string_ref &name, const DBTimestamp &modified, const DBTimestamp &date, sitemap_url_list &urls) const
+{
+    std::string url, lastmod;
+
+    format_lastmod(lastmod, modified.year != 0 ? modified : date);
+
+    if(post_type == "page") {
+        url.assign(model.base_url).append(1, '/').append(name.data(), name.size()).append(1, '/');
+
+        push_url(urls, url, lastmod, "weekly", 1.0);
+    }
+    else if(hostname != "www.nginxguts.com") {
+        url.assign(model.base_url).append("/wedding-cakes/").append(name.data(), name.size()).append(1, '/');
+
+        push_url(urls, url, lastmod, "weekly", 1.0);
+    }
+    else {
+        char archive[32];
+        int len = snprintf(archive, sizeof(archive), "/%04u/%02u/", date.year, date.month);
+
+        url.assign(model.base_url).append(archive, len).append(name.data(), name.size()).append(1, '/');
+
+        push_url(urls, url, lastmod, "monthly", 1.0);
+    }
+}
+
+/*
+ * Make URLs of an archive and its pages
+ */
+void sitemap_handler::make_paged_urls(const sitemap_model &model, std::string &url, const std::string &lastmod,
+    unsigned num_posts, sitemap_url_list &urls)
+{
+    unsigned page = 0;
 
-    try {
-        DBConnHolder conn(*site->second);
+    push_url(urls, url, lastmod, "daily", 1.0);
 
-        std::string base_url(get_base_url(conn.get()));
-        size_t num_posts_per_page = get_num_posts_per_page(conn.get());
+    if(num_posts > model.num_posts_per_page) {
+        size_t url_len = url.size();
 
-        XMLDoc doc("urlset", "http://www.sitemaps.org/schemas/sitemap/0.9", "1.0");
+        num_posts -= model.num_posts_per_page;
+        page++;
+
+        do {
+            char page_str[32];
+            int len = snprintf(page_str, sizeof(page_str), "page/%u/", page + 1);
+
+            url.resize(url_len);
+            url.append(page_str, len);
+
+            push_url(urls, url, lastmod, "daily", 1.0);
+
+            num_posts = (num_posts > model.num_posts_per_page) ? num_posts - model.num_posts_per_page : 0;
+            page++;
+        } while(num_posts != 0);
+    }
+}
+
+void sitemap_handler::load_front_page(DBConn &conn, const std::string &hostname, sitemap_model &model)
+{
+    DBRowStmt<DBTuple<DBTimestamp, int> > stmt(conn, "select max(post_modified_gmt), count(distinct ID) from wp_posts"
+         " where post_status='publish' and post_type='post'");
+
+    stmt.execute();
+
+    while(stmt.fetch()) {
+        sitemap_url_list urls;
+        std::string url(model.base_url + "/"), lastmod;
+
+        format_lastmod(lastmod, stmt.row().get<0>());
 
         if(hostname == "www.nginxguts.com") {
-            doc.add_pi("xml-stylesheet", "type=\"text/xsl\" href=\"wp-content/plugins/google-sitemap-plugin/sitemap.xsl\"");
+            make_paged_urls(model, url, lastmod, stmt.row().get<1>(), urls);
         }
         else {
-            doc.add_pi("xml-stylesheet", "type=\"text/xsl\" href=\"wp-content/uploads/sitemap.xsl\"");
+            push_url(urls, url, lastmod, "daily", 1.0);
         }
 
-        {
-            /*
-             * Add page URLs
-             */
-            DBStmt stmt(conn.get(), "select post_name, post_modified_gmt, post_date_gmt from wp_posts where post_status='publish' "
-                " and post_type='page' order by post_date_gmt");
-            
-            stmt.execute();
+        model.posts.put("front", urls);
+    }
+}
 
-            while(stmt.fetch()) {
-                std::ostringstream url;
-                std::string modified_dt(stmt.asString(1) != "0000-00-00 00:00:00" ? stmt.asString(1) : stmt.asString(2));
+/*
+ * Reload URLs of a term archive
+ */
+void sitemap_handler::load_term(DBConn &conn, const sitemap_term &term, sitemap_model &model)
+{
+    DBRowStmt<DBTuple<DBTimestamp, int> > stmt(conn, "select max(p.post_modified_gmt), count(distinct p.ID) from wp_terms ts, wp_term_taxonomy tt, wp_term_relationships tr, wp_posts p"
+         " where tt.taxonomy=? and ts.slug=? and tt.term_id=ts.term_id and tt.parent=0 and tt.count!=0 and "
+         " tt.term_taxonomy_id = tr.term_taxonomy_id and tr.object_id=p.ID and p.post_status='publish'");
+
+    stmt.bindString(0, term.first);
+    stmt.bindString(1, term.second);
+
+    stmt.execute();
+
+    sitemap_url_list urls;
+
+    while(stmt.fetch()) {
+        unsigned num_posts = stmt.row().get<1>();
+
+        if(num_posts == 0 || stmt.row().get<0>().year == 0) {
+            continue;
+        }
+
+        std::string url, lastmod;
+
+        url.assign(model.base_url).append(1, '/').append(term.first == "placecategory" ? "weddingcakes" : term.first)
+            .append(1, '/').append(term.second).append(1, '/');
+
+        format_lastmod(lastmod, stmt.row().get<0>());
+
+        make_paged_urls(model, url, lastmod, num_posts, urls);
+    }
+
+    if(urls.empty()) {
+        model.taxonomy.remove(term_key(term));
+    }
+    else {
+        model.taxonomy.put(term_key(term), urls);
+    }
+}
+
+/*
+ * Reload URL of an author archive
+ */
+void sitemap_handler::load_author(DBConn &conn, const std::string &login, sitemap_model &model)
+{
+    DBRowStmt<DBTuple<DBTimestamp> > stmt(conn, "select max(p.post_modified_gmt) from wp_posts p, wp_users u where p.post_author=u.ID "
+        " and u.user_login=? and p.post_status='publish' and p.post_type='post'");
+
+    stmt.bindString(0, login);
+
+    stmt.execute();
+
+    sitemap_url_list urls;
+
+    while(stmt.fetch()) {
+        if(stmt.row().get<0>().year == 0) {
+            continue;
+        }
+
+        std::string lastmod;
+
+        format_lastmod(lastmod, stmt.row().get<0>());
+
+        push_url(urls, model.base_url + "/author/" + login + "/", lastmod, "daily", 1.0);
+    }
+
+    if(urls.empty()) {
+        model.posts.remove("author:" + login);
+    }
+    else {
+        model.posts.put("author:" + login, urls);
+    }
+}
+
+/*
+ * Read all URLs of a site. Pages, posts, authors and the front page go
+ * to posts, category archives to taxonomy
+ */
+sitemap_model *sitemap_handler::load_site(DBConn &conn, const std::string &hostname)
+{
+    std::auto_ptr<sitemap_model> model(new sitemap_model());
+
+    std::vector<std::string> post_types, taxonomy_types;
+
+    get_types(hostname, post_types, taxonomy_types);
+
+    model->base_url = get_base_url(conn);
+    model->num_posts_per_page = get_num_posts_per_page(conn);
+    time(&model->last_full_rebuild);
+
+    {
+        /*
+         * Posts modified while the site is being read are picked up
+         * by the next refresh, posts at the watermark are read now
+         */
+        DBRowStmt<DBTuple<long long, DBTimestamp> > stmt(conn,
+            "select ID, post_modified_gmt from wp_posts"
+            " where post_modified_gmt = (select max(post_modified_gmt) from wp_posts)");
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            model->watermark = stmt.row().get<1>().str();
+            model->watermark_posts.insert(stmt.row().get<0>());
+        }
+    }
+
+    post_types.insert(post_types.begin(), "page");
+
+    for(std::vector<std::string>::const_iterator i = post_types.begin() ; i != post_types.end() ; i++) {
+        /*
+         * Add page and post URLs
+         */
+        DBRowStmt<DBTuple<int, string_ref, DBTimestamp, DBTimestamp> > stmt(conn,
+            "select ID, post_name, post_modified_gmt, post_date_gmt from wp_posts where post_status='publish' "
+            " and post_type=? order by post_date_gmt");
+
+        stmt.bindString(0, *i);
+        stmt.setPrefetch(true);
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            sitemap_url_list urls;
+
+            make_post_urls(hostname, *model, *i, stmt.row().get<1>(), stmt.row().get<2>(), stmt.row().get<3>(), urls);
+
+            model->posts.put(post_key(stmt.row().get<0>()), urls);
+        }
+    }
+
+    for(std::vector<std::string>::const_iterator i = taxonomy_types.begin() ; i != taxonomy_types.end() ; i++) {
+        /*
+         * Add category URLs
+         */
+        DBRowStmt<DBTuple<std::string, DBTimestamp, int> > stmt(conn,
+            "select slug, max(p.post_modified_gmt), count(distinct p.ID) from wp_terms ts, wp_term_taxonomy tt, wp_term_relationships tr, wp_posts p"
+             " where tt.taxonomy=? and tt.term_id=ts.term_id and tt.parent=0 and tt.count!=0 and "
+             " tt.term_taxonomy_id = tr.term_taxonomy_id and tr.object_id=p.ID and p.post_status='publish' group by slug");
+
+        stmt.bindString(0, *i);
+        stmt.setPrefetch(true);
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            sitemap_term term(*i, stmt.row().get<0>());
+            sitemap_url_list urls;
+            std::string url, lastmod;
+
+            url.assign(model->base_url).append(1, '/').append(*i == "placecategory" ? "weddingcakes" : *i)
+                .append(1, '/').append(term.second).append(1, '/');
+
+            format_lastmod(lastmod, stmt.row().get<1>());
+
+            make_paged_urls(*model, url, lastmod, stmt.row().get<2>(), urls);
+
+            model->taxonomy.put(term_key(term), urls);
+        }
+    }
+
+    {
+        /*
+         * Remember terms of posts to know which archives a post change affects
+         */
+        DBRowStmt<DBTuple<int, string_ref, string_ref> > stmt(conn,
+            "select tr.object_id, tt.taxonomy, ts.slug from wp_terms ts, wp_term_taxonomy tt, wp_term_relationships tr"
+            " where tt.term_id=ts.term_id and tt.parent=0 and tt.term_taxonomy_id = tr.term_taxonomy_id");
+
+        stmt.setPrefetch(true);
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            const string_ref &taxonomy = stmt.row().get<1>();
+
+            if(std::find(taxonomy_types.begin(), taxonomy_types.end(), taxonomy) != taxonomy_types.end()) {
+                model->post_terms[stmt.row().get<0>()].push_back(sitemap_term(taxonomy, stmt.row().get<2>()));
+            }
+        }
+    }
+
+    if(hostname == "www.nginxguts.com") {
+        /*
+         * Add author URLs
+         */
+        DBRowStmt<DBTuple<std::string, DBTimestamp> > stmt(conn,
+            "select user_login, max(p.post_modified_gmt) from wp_posts p, wp_users u where p.post_author=u.ID "
+            " and p.post_status='publish' and p.post_type='post' group by user_login");
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            sitemap_url_list urls;
+            const std::string &login = stmt.row().get<0>();
+            std::string lastmod;
+
+            format_lastmod(lastmod, stmt.row().get<1>());
+
+            push_url(urls, model->base_url + "/author/" + login + "/", lastmod, "daily", 1.0);
+
+            model->posts.put("author:" + login, urls);
+        }
+    }
+
+    load_front_page(conn, hostname, *model);
+
+#if 0
+    {
+        /*
+         * Add images URL
+         */
+        DBStmt stmt(conn, "select p.ID, p.post_modified_gmt, p.post_date_gmt, m.meta_value path from wp_posts p, wp_postmeta m "
+            " where p.ID=m.post_id and p.post_type='attachment' and m.meta_key='_wp_attached_file' order by p.post_date_gmt");
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            DBTimestamp modified(stmt.asTimestamp(1));
+            std::string path(stmt.asString(3));
+            std::string url, lastmod;
+            sitemap_url_list urls;
+
+            url.assign(model->base_url).append(path[0] == '/' ? path : "/wp-content/uploads/" + path);
+
+            format_lastmod(lastmod, modified.year != 0 ? modified : stmt.asTimestamp(2));
+
+            push_url(urls, url, lastmod, "monthly", 1.0);
+
+            model->posts.put(post_key(stmt.asInt32(0)), urls);
+        }
+    }
+#endif
+
+    return model.release();
+}
+
+/*
+ * Apply posts modified since the watermark to the model. Only archives
+ * the changed posts belong to are reloaded
+ *
+ * @return false if site settings changed and sitemap has to be rebuilt
+ */
+bool sitemap_handler::refresh_site(DBConn &conn, const std::string &hostname, sitemap_model &model)
+{
+    if(get_base_url(conn) != model.base_url || get_num_posts_per_page(conn) != model.num_posts_per_page) {
+        return false;
+    }
+
+    std::vector<std::string> post_types, taxonomy_types;
+
+    get_types(hostname, post_types, taxonomy_types);
+
+    post_types.push_back("page");
+
+    std::vector<unsigned long> changed_posts;
+    std::set<sitemap_term> changed_terms;
+    std::set<std::string> changed_authors;
+    std::string watermark(model.watermark);
+    std::set<unsigned long> watermark_posts;
+
+    {
+        /*
+         * Watermark is inclusive, posts modified within the same second
+         * after the previous refresh are not lost. Posts already seen
+         * at the watermark are skipped
+         */
+        DBRowStmt<DBTuple<long long, string_ref, string_ref, string_ref, DBTimestamp, DBTimestamp, string_ref> > stmt(conn,
+            "select p.ID, p.post_name, p.post_type, p.post_status, p.post_modified_gmt, p.post_date_gmt, u.user_login"
+            " from wp_posts p left join wp_users u on p.post_author=u.ID where p.post_modified_gmt >= ? order by p.post_modified_gmt");
+
+        stmt.bindString(0, model.watermark);
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            unsigned long id = stmt.row().get<0>();
+            const string_ref &post_type = stmt.row().get<2>();
+            const DBTimestamp &modified = stmt.row().get<4>();
+            std::string modified_dt(modified.str());
+
+            if(modified_dt > watermark) {
+                watermark = modified_dt;
+                watermark_posts.clear();
+            }
+
+            watermark_posts.insert(id);
+
+            if(modified_dt == model.watermark && model.watermark_posts.count(id) != 0) {
+                continue;
+            }
+
+            if(std::find(post_types.begin(), post_types.end(), post_type) == post_types.end()) {
+                continue;
+            }
 
-                url << base_url << '/' << stmt.asString(0) << '/';
+            if(stmt.row().get<3>() == "publish") {
+                sitemap_url_list urls;
 
-                modified_dt[10] = 'T';
+                make_post_urls(hostname, model, post_type, stmt.row().get<1>(), modified, stmt.row().get<5>(), urls);
 
-                add_url(doc, url.str(), modified_dt + "+00:00", "weekly", 1.0);
+                model.posts.put(post_key(id), urls);
+            }
+            else {
+                model.posts.remove(post_key(id));
+            }
+
+            changed_posts.push_back(id);
+
+            if(post_type == "post" && !stmt.row().get<6>().empty()) {
+                changed_authors.insert(stmt.row().get<6>());
             }
         }
+    }
+
+    if(changed_posts.empty()) {
+        model.watermark = watermark;
+        model.watermark_posts.swap(watermark_posts);
+        return true;
+    }
+
+    {
+        /*
+         * Archives the post belonged to before and belongs to now
+         */
+        DBRowStmt<DBTuple<string_ref, string_ref> > stmt(conn,
+            "select tt.taxonomy, ts.slug from wp_terms ts, wp_term_taxonomy tt, wp_term_relationships tr"
+            " where tr.object_id=? and tt.term_id=ts.term_id and tt.parent=0 and tt.term_taxonomy_id = tr.term_taxonomy_id");
+
+        int id;
+
+        stmt.bindInt(0, id);
+
+        for(std::vector<unsigned long>::const_iterator i = changed_posts.begin() ; i != changed_posts.end() ; i++) {
+            sitemap_term_list &terms = model.post_terms[*i];
 
-        for(std::vector<std::string>::const_iterator i = post_types.begin() ; i != post_types.end() ; i++) {
-            /*
-             * Add post URLs
-             */
-            DBStmt stmt(conn.get(), "select post_name, post_modified_gmt, post_date_gmt from wp_posts where post_status='publish' "
-                " and post_type=? order by post_date_gmt");
+            changed_terms.insert(terms.begin(), terms.end());
+            terms.clear();
+
+            id = *i;
 
-            stmt.bindString(0, *i);
-            
             stmt.execute();
 
             while(stmt.fetch()) {
-                std::ostringstream url;
-                std::string dt(stmt.asString(2));
-                std::string modified_dt(stmt.asString(1) != "0000-00-00 00:00:00" ? stmt.asString(1) : stmt.asString(2));
+                const string_ref &taxonomy = stmt.row().get<0>();
 
-                if(hostname != "www.nginxguts.com") {
-                    url << base_url << "/wedding-cakes/" << stmt.asString(0) << '/';
-                }
-                else {
-                    url << base_url << '/' << dt.substr(0, 4) << '/' << dt.substr(5, 2) << '/' << stmt.asString(0) << '/';
+                if(std::find(taxonomy_types.begin(), taxonomy_types.end(), taxonomy) != taxonomy_types.end()) {
+                    terms.push_back(sitemap_term(taxonomy, stmt.row().get<1>()));
                 }
+            }
 
-                modified_dt[10] = 'T';
+            changed_terms.insert(terms.begin(), terms.end());
 
-                add_url(doc, url.str(), modified_dt + "+00:00", hostname != "www.nginxguts.com" ? "weekly" : "monthly", 1.0);
+            if(terms.empty()) {
+                model.post_terms.erase(*i);
             }
         }
+    }
 
-        for(std::vector<std::string>::const_iterator i = taxonomy_types.begin() ; i != taxonomy_types.end() ; i++) {
-            std::string taxonomy(*i);
-            /*
-             * Add category URLs
-             */
-            DBStmt stmt(conn.get(), "select slug, max(p.post_modified_gmt), count(distinct p.ID) from wp_terms ts, wp_term_taxonomy tt, wp_term_relationships tr, wp_posts p"
-                 " where tt.taxonomy=? and tt.term_id=ts.term_id and tt.parent=0 and tt.count!=0 and "
-                 " tt.term_taxonomy_id = tr.term_taxonomy_id and tr.object_id=p.ID and p.post_status='publish' group by slug");
-
-            stmt.bindString(0, taxonomy);
-            
-            stmt.execute();
+    for(std::set<sitemap_term>::const_iterator i = changed_terms.begin() ; i != changed_terms.end() ; i++) {
+        load_term(conn, *i, model);
+    }
 
-            while(stmt.fetch()) {
-                std::ostringstream url;
-                std::string modified_dt(stmt.asString(1));
-                unsigned num_posts = stmt.asInt(2);
-                unsigned page = 0;
+    if(hostname == "www.nginxguts.com") {
+        for(std::set<std::string>::const_iterator i = changed_authors.begin() ; i != changed_authors.end() ; i++) {
+            load_author(conn, *i, model);
+        }
+    }
+
+    load_front_page(conn, hostname, model);
 
-                url << base_url << '/' << (taxonomy == "placecategory" ? "weddingcakes" : taxonomy) << '/' << stmt.asString(0) << '/';
+    model.watermark = watermark;
+    model.watermark_posts.swap(watermark_posts);
 
-                modified_dt[10] = 'T';
+    LogInfo("sitemap_handler::refresh_site " << hostname << ": " << changed_posts.size() << " posts, "
+        << changed_terms.size() << " terms changed");
 
-                add_url(doc, url.str(), modified_dt+"+00:00", "daily", 1.0);
+    return true;
+}
+
+/*
+ * Render dirty shards of a section
+ */
+void sitemap_handler::render_shards(const std::string &hostname, sitemap_section &section)
+{
+    for(sitemap_section::ShardContainer::iterator s = section.shards.begin() ; s != section.shards.end() ; s++) {
+        if(!s->dirty) {
+            continue;
+        }
+
+        gzip_ostream out;
+        XMLWriter xml(out);
+
+        add_stylesheet(xml, hostname);
 
-                if(num_posts > num_posts_per_page) {
-                    num_posts -= num_posts_per_page;
-                    page++;
+        xml.start("urlset").attr("xmlns", SITEMAP_NS);
 
-                    do {
-                        std::ostringstream page_str;
-                        page_str << "page/" << (page + 1) << '/';
-                        add_url(doc, url.str() + page_str.str(), modified_dt+"+00:00", "daily", 1.0);
+        s->lastmod.clear();
 
-                        num_posts = (num_posts > num_posts_per_page) ? num_posts - num_posts_per_page : 0;
-                        page++;
-                    } while(num_posts != 0);
+        for(sitemap_entry_map::const_iterator e = s->entries.begin() ; e != s->entries.end() ; e++) {
+            for(sitemap_url_list::const_iterator i = e->second.begin() ; i != e->second.end() ; i++) {
+                add_url(xml, i->loc, i->lastmod, i->changefreq, i->priority);
+
+                // W3C datetimes in the same format compare as strings
+                if(i->lastmod > s->lastmod) {
+                    s->lastmod = i->lastmod;
                 }
             }
         }
 
-        if(hostname == "www.nginxguts.com") {
-            /*
-             * Add author URLs
-             */
-            DBStmt stmt(conn.get(), "select user_login, max(p.post_modified_gmt) from wp_posts p, wp_users u where p.post_author=u.ID "
-                " and p.post_status='publish' and p.post_type='post' group by user_login");
-            
-            stmt.execute();
+        xml.finish();
+        out.finish();
 
-            while(stmt.fetch()) {
-                std::ostringstream url;
-                std::string modified_dt(stmt.asString(1));
+        s->file.data.swap(out.data());
+        s->file.size = out.size();
+        s->dirty = false;
+    }
+}
 
-                url << base_url << "/author/" << stmt.asString(0) << '/';
+/*
+ * Render changed shards and the index
+ *
+ * @return new file set or 0 if nothing changed
+ */
+sitemap_file_set *sitemap_handler::render_files(const std::string &hostname, sitemap_model &model)
+{
+    static const char *kinds[] = { "posts", "taxonomy" };
+    sitemap_section *sections[] = { &model.posts, &model.taxonomy };
+    bool changed = false;
 
-                modified_dt[10] = 'T';
+    for(size_t k = 0 ; k != sizeof(kinds) / sizeof(kinds[0]) ; k++) {
+        for(sitemap_section::ShardContainer::const_iterator s = sections[k]->shards.begin() ; s != sections[k]->shards.end() ; s++) {
+            changed = changed || s->dirty;
+        }
+    }
 
-                add_url(doc, url.str(), modified_dt+"+00:00", "daily", 1.0);
-            }
+    if(!changed) {
+        return 0;
+    }
+
+    std::auto_ptr<sitemap_file_set> files(new sitemap_file_set());
+    gzip_ostream out;
+    XMLWriter xml(out);
+
+    add_stylesheet(xml, hostname);
+
+    xml.start("sitemapindex").attr("xmlns", SITEMAP_NS);
+
+    for(size_t k = 0 ; k != sizeof(kinds) / sizeof(kinds[0]) ; k++) {
+        render_shards(hostname, *sections[k]);
+
+        unsigned n = 0;
+
+        for(sitemap_section::ShardContainer::const_iterator s = sections[k]->shards.begin() ; s != sections[k]->shards.end() ; s++) {
+            char name[64];
+            snprintf(name, sizeof(name), "/sitemap-%s-%u.xml", kinds[k], ++n);
+
+            files->files[name] = s->file;
+
+            xml.start("sitemap");
+            xml.element("loc", model.base_url + name);
+            xml.element("lastmod", s->lastmod);
+            xml.end();
         }
+    }
+
+    xml.finish();
+    out.finish();
 
+    sitemap_file &index = files->files["/sitemap.xml"];
+
+    index.data.swap(out.data());
+    index.size = out.size();
+
+    return files.release();
+}
+
+/*
+ * Bring the model of a site up to date and render what changed
+ */
+sitemap_file_set *sitemap_handler::update_site(const std::string &hostname, site &_site)
+{
+    time_t now;
+
+    time(&now);
+
+    {
+        DBConnHolder conn(*_site.pool);
+
+        if(_site.model == 0 || now - _site.model->last_full_rebuild >= (time_t)full_rebuild_interval
+            || !refresh_site(conn.get(), hostname, *_site.model))
         {
-            /*
-             * Add front page
-             */
-            DBStmt stmt(conn.get(), "select max(post_modified_gmt), count(distinct ID) from wp_posts"
-                 " where post_status='publish' and post_type='post'");
-            
-            stmt.execute();
+            sitemap_model *model = load_site(conn.get(), hostname);
 
-            while(stmt.fetch()) {
-                std::ostringstream url;
-                std::string modified_dt(stmt.asString(0));
-                unsigned num_posts = stmt.asInt(1);
-                unsigned page = 0;
+            delete _site.model;
+            _site.model = model;
+        }
+    }
+
+    return render_files(hostname, *_site.model);
+}
+
+void sitemap_handler::render_all()
+{
+    for(SiteContainer::iterator i = sites.begin() ; i != sites.end() ; i++) {
+        sitemap_file_set *files;
 
-                url << base_url << '/';
+        try {
+            files = update_site(i->first, i->second);
+        }
+        catch(const db_exception &e) {
+            LogError("sitemap_handler::render_all DB error: " << i->first << ": " << e.what());
+            continue;
+        }
 
-                modified_dt[10] = 'T';
+        if(files == 0) {
+            continue;
+        }
 
-                add_url(doc, url.str(), modified_dt+"+00:00", "daily", 1.0);
+        LogInfo("sitemap_handler::render_all rendered " << files->files.size() << " files for " << i->first);
 
-                if(hostname == "www.nginxguts.com" && num_posts > num_posts_per_page) {
-                    num_posts -= num_posts_per_page;
-                    page++;
+        pthread_mutex_lock(&lock);
+        std::swap(i->second.files, files);
+        pthread_mutex_unlock(&lock);
 
-                    do {
-                        std::ostringstream page_str;
-                        page_str << "page/" << (page + 1) << '/';
-                        add_url(doc, url.str() + page_str.str(), modified_dt+"+00:00", "daily", 1.0);
+        if(files != 0) {
+            files->unref();
+        }
+    }
 
-                        num_posts -= num_posts_per_page;
-                        page++;
-                    } while((num_posts % num_posts_per_page) == num_posts_per_page);
-                }
+    pthread_mutex_lock(&lock);
+    first_pass_done = true;
+    pthread_cond_broadcast(&rendered);
+    pthread_mutex_unlock(&lock);
+}
+
+void *sitemap_handler::render_thread_starter(void *arg) {
+    static_cast<sitemap_handler*>(arg)->render_thread();
+    return NULL;
+}
+
+void sitemap_handler::render_thread()
+{
+    pthread_mutex_lock(&lock);
+
+    while(!exiting) {
+        refresh_requested = false;
+
+        pthread_mutex_unlock(&lock);
+
+        render_all();
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += refresh_interval;
+
+        pthread_mutex_lock(&lock);
+
+        while(!exiting && !refresh_requested) {
+            if(pthread_cond_timedwait(&wakeup, &lock, &deadline) == ETIMEDOUT) {
+                break;
             }
         }
+    }
 
-#if 0
-        {
-            /*
-             * Add images URL
-             */
-            DBStmt stmt(conn.get(), "select p.post_name, p.post_modified_gmt, p.post_date_gmt, m.meta_value path from wp_posts p, wp_postmeta m "
-                " where p.ID=m.post_id and p.post_type='attachment' and m.meta_key='_wp_attached_file' order by p.post_date_gmt");
-            
-            stmt.execute();
+    pthread_mutex_unlock(&lock);
+}
 
-            while(stmt.fetch()) {
-                std::ostringstream url;
-                std::string modified_dt(stmt.asString(1) != "0000-00-00 00:00:00" ? stmt.asString(1) : stmt.asString(2));
-                std::string path(stmt.asString(3));
+/*
+ * Refresh is incremental from the site watermark, so it is enough
+ * to wake up the render thread
+ */
+void sitemap_handler::changed(const std::string &_hostname, const change_set &_changes)
+{
+    if(sites.find(_hostname) == sites.end()) {
+        return;
+    }
 
-                url << base_url << (path[0] == '/' ? path : "/wp-content/uploads/" + path);
+    pthread_mutex_lock(&lock);
+    refresh_requested = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+}
 
-                modified_dt[10] = 'T';
+/*
+ * Get a reference to the current files of a site. Until the first
+ * rendering is done requests wait for it for a limited time
+ */
+sitemap_file_set *sitemap_handler::acquire_files(site &_site)
+{
+    sitemap_file_set *files;
+
+    pthread_mutex_lock(&lock);
+
+    if(!first_pass_done && thread_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SITEMAP_INITIAL_WAIT;
 
-                add_url(doc, url.str(), modified_dt + "+00:00", "monthly", 1.0);
+        while(!first_pass_done) {
+            if(pthread_cond_timedwait(&rendered, &lock, &deadline) == ETIMEDOUT) {
+                break;
             }
         }
-#endif
+    }
+
+    files = _site.files;
+
+    if(files != 0) {
+        files->ref();
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return files;
+}
+
+void sitemap_handler::handle(fcgi_request &_request, fcgi_response &_response)
+{
+    LogInfo("sitemap_handler::handle");
 
-        _response.fcgi_out << "Status: 200\r\n";
-        _response.fcgi_out << "Content-Type: application/xml\r\n";
+    std::string hostname(_request.get_fcgi_param("SERVER_NAME"));
+
+    SiteContainer::iterator s = sites.find(hostname);
+
+    if(s == sites.end()) {
+        LogError("sitemap_handler::handle site not found: " << hostname);
+        return return_error(_response, "site not found: " + hostname);
+    }
+
+    sitemap_file_set *files = acquire_files(s->second);
+
+    if(files == 0) {
+        _response.fcgi_out << "Retry-After: 60\r\n";
+        return return_error(_response, "sitemap is not ready yet", HTTP_SERVICE_UNAVAILABLE);
+    }
+
+    sitemap_file_set::FileContainer::const_iterator file = files->files.find(_request.get_script_name());
+
+    if(file == files->files.end()) {
+        files->unref();
+        return return_error(_response, "sitemap not found", HTTP_NOT_FOUND);
+    }
+
+    bool gzip = accepts_gzip(_request.get_fcgi_param("HTTP_ACCEPT_ENCODING").str());
+
+    _response.fcgi_out << "Status: 200\r\n";
+    _response.fcgi_out << "Content-Type: application/xml\r\n";
+    _response.fcgi_out << "Vary: Accept-Encoding\r\n";
+
+    if(gzip) {
+        _response.fcgi_out << "Content-Encoding: gzip\r\n";
+        _response.fcgi_out << "Content-Length: " << file->second.data.size() << "\r\n";
         _response.fcgi_out << "\r\n";
-        _response.fcgi_out << doc;
+
+        _response.fcgi_out.write(file->second.data.data(), file->second.data.size());
     }
-    catch(const db_exception &e) {
-        LogError("sitemap_handler::handle DB error: " <<  e.what());
-        return_error(_response, e.what());
+    else {
+        _response.fcgi_out << "Content-Length: " << file->second.size << "\r\n";
+        _response.fcgi_out << "\r\n";
+
+        if(!gzip_inflate(file->second.data, _response.fcgi_out)) {
+            LogError("sitemap_handler::handle corrupted sitemap " << file->first);
+        }
     }
+
+    files->unref();
 }
 
 };
-
@@ -1,4 +1,3 @@
-
 #ifndef _SITEMAP_HANDLER_H_
 #define _SITEMAP_HANDLER_H_
 
@@ -7,17 +6,173 @@
 #include <string>
 #include <set>
 #include <map>
+#include <vector>
+#include <deque>
+
+#include <pthread.h>
 
 #include <db/db_pool.h>
 
 #include "fcgi_handler.h"
+#include "change_feed.h"
 #include "xml.h"
 
 namespace fp {
 
-class sitemap_handler : public fp::fcgi_handler {
+/*
+ * Sitemap URL
+ */
+struct sitemap_url {
+    std::string loc;
+    std::string lastmod;
+    const char  *changefreq;
+    double      priority;
+};
+
+inline bool operator==(const sitemap_url &a, const sitemap_url &b)
+{
+    return a.loc == b.loc && a.lastmod == b.lastmod && a.changefreq == b.changefreq && a.priority == b.priority;
+}
+
+typedef std::vector<sitemap_url> sitemap_url_list;
+
+/*
+ * Pre-rendered sitemap file
+ */
+struct sitemap_file {
+    std::string data;       // gzipped content
+    size_t      size;       // size before compression
+};
+
+/*
+ * Files that make up the sitemap of a site, keyed by URI. The render
+ * thread replaces the set as a whole, requests in progress keep the
+ * previous set alive by holding a reference
+ */
+class sitemap_file_set {
+public:
+    typedef std::map<std::string, sitemap_file> FileContainer;
+
+    sitemap_file_set()
+        : refs(1)
+    {
+    }
+
+    void ref() { __sync_add_and_fetch(&refs, 1); }
+
+    void unref() {
+        if(__sync_sub_and_fetch(&refs, 1) == 0) {
+            delete this;
+        }
+    }
+
+    FileContainer files;
+
+private:
+    volatile int refs;
+};
+
+/*
+ * URLs that are added, replaced and removed together: a post, a
+ * category archive with its pages, an author page or the front page
+ */
+typedef std::map<std::string, sitemap_url_list> sitemap_entry_map;
+
+/*
+ * Contents of one sitemap file
+ */
+struct sitemap_shard {
+    sitemap_shard()
+        : num_urls(0)
+        , size(0)
+        , dirty(true)
+    {
+    }
+
+    sitemap_entry_map   entries;
+    size_t              num_urls;
+    size_t              size;       // estimated size of rendered URLs
+    bool                dirty;      // entries changed since last rendering
+    std::string         lastmod;    // latest lastmod of entries at last rendering
+    sitemap_file        file;
+};
+
+/*
+ * Sequence of shards, e.g. all /sitemap-posts-N.xml files. An entry stays
+ * in the shard it was first placed in unless it outgrows it, so changing
+ * an entry makes only one shard dirty
+ */
+class sitemap_section {
+public:
+    typedef std::deque<sitemap_shard> ShardContainer;
+
+    /*
+     * Add or replace entry. Shard is not marked dirty if URLs did not change
+     */
+    void put(const std::string &key, const sitemap_url_list &urls);
+
+    void remove(const std::string &key);
+
+    ShardContainer shards;
+
+private:
+    static size_t estimate_size(const sitemap_url_list &urls);
+
+    std::map<std::string, size_t> location;
+};
+
+/*
+ * Taxonomy and slug of a term
+ */
+typedef std::pair<std::string, std::string> sitemap_term;
+typedef std::vector<sitemap_term> sitemap_term_list;
+
+/*
+ * Everything the render thread knows about a site between refreshes
+ */
+struct sitemap_model {
+    sitemap_model()
+        : num_posts_per_page(10)
+        , watermark("0000-00-00 00:00:00")
+        , last_full_rebuild(0)
+    {
+    }
+
+    std::string     base_url;
+    size_t          num_posts_per_page;
+    std::string     watermark;          // posts modified after it are not seen yet
+    std::set<unsigned long> watermark_posts;    // posts seen at watermark
+    time_t          last_full_rebuild;
+    sitemap_section posts;
+    sitemap_section taxonomy;
+    std::map<unsigned long, sitemap_term_list> post_terms;
+};
+
+/*
+ * Serves /sitemap.xml as a sitemap index over numbered shards
+ * /sitemap-posts-N.xml and /sitemap-taxonomy-N.xml. Shards are rendered
+ * by a background thread and kept gzipped in memory. The thread picks up
+ * posts modified since the previous refresh and re-renders only shards
+ * they affect, the whole sitemap is rebuilt from scratch less often.
+ * A change feed wakes the thread up as soon as a site changes
+ */
+class sitemap_handler : public fp::fcgi_handler, public change_listener {
     typedef std::set<std::string> CategoryContainer;
-    typedef std::map<std::string, DBPool*> PoolContainer;
+
+    struct site {
+        site(DBPool &_pool)
+            : pool(&_pool)
+            , files(0)
+            , model(0)
+        {
+        }
+
+        DBPool              *pool;
+        sitemap_file_set    *files;
+        sitemap_model       *model;     // owned by render thread
+    };
+
+    typedef std::map<std::string, site> SiteContainer;
 public:
     sitemap_handler();
     virtual ~sitemap_handler();
@@ -27,9 +182,28 @@ public:
 
     virtual void handle(fcgi_request &_request, fcgi_response &_response);
 
+    virtual void changed(const std::string &_hostname, const change_set &_changes);
+
     void add_site(const std::string &hostname, DBPool &pool)
     {
-        sites.insert(std::make_pair(hostname, &pool));
+        sites.insert(std::make_pair(hostname, site(pool)));
+    }
+
+    /*
+     * Set interval between incremental refreshes in seconds
+     */
+    void set_refresh_interval(unsigned _refresh_interval)
+    {
+        refresh_interval = _refresh_interval;
+    }
+
+    /*
+     * Set interval between full sitemap rebuilds in seconds. Full rebuild
+     * picks up posts deleted from the database
+     */
+    void set_full_rebuild_interval(unsigned _full_rebuild_interval)
+    {
+        full_rebuild_interval = _full_rebuild_interval;
     }
 
 private:
@@ -37,9 +211,44 @@ private:
 
     static std::string get_base_url(DBConn&);
     size_t get_num_posts_per_page(DBConn&);
-    static void add_url(XMLDoc&, const std::string&, const std::string&, const std::string&, double);
+    static void add_url(XMLWriter&, const string_ref&, const string_ref&, const char*, double);
+    static void add_stylesheet(XMLWriter&, const std::string&);
+
+    void get_types(const std::string&, std::vector<std::string>&, std::vector<std::string>&) const;
+    void make_post_urls(const std::string&, const sitemap_model&, const string_ref&, const string_ref&,
+        const DBTimestamp&, const DBTimestamp&, sitemap_url_list&) const;
+    static void make_paged_urls(const sitemap_model&, std::string&, const std::string&, unsigned, sitemap_url_list&);
+
+    void load_front_page(DBConn&, const std::string&, sitemap_model&);
+    void load_term(DBConn&, const sitemap_term&, sitemap_model&);
+    void load_author(DBConn&, const std::string&, sitemap_model&);
+
+    sitemap_model *load_site(DBConn&, const std::string&);
+    bool refresh_site(DBConn&, const std::string&, sitemap_model&);
+
+    void render_shards(const std::string&, sitemap_section&);
+    sitemap_file_set *render_files(const std::string&, sitemap_model&);
+    sitemap_file_set *update_site(const std::string&, site&);
+
+    void render_all();
+    void render_thread();
+    static void *render_thread_starter(void*);
+
+    sitemap_file_set *acquire_files(site&);
+
+    SiteContainer sites;
+
+    unsigned refresh_interval;
+    unsigned full_rebuild_interval;
 
-    PoolContainer sites;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t rendered;
+    bool thread_running;
+    bool exiting;
+    bool refresh_requested;
+    bool first_pass_done;
 };
 
 };
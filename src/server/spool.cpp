@@ -0,0 +1,60 @@
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "spool.h"
+
+namespace fp {
+
+int spool_open(const std::string &_dir)
+{
+    int fd;
+
+#ifdef O_TMPFILE
+    fd = open(_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+    if(fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+        return fd;
+    }
+#endif
+
+    /*
+     * File system does not support O_TMPFILE
+     */
+    std::string path(_dir + "/fcgi-spool.XXXXXX");
+
+    fd = mkstemp(&path[0]);
+
+    if(fd != -1) {
+        unlink(path.c_str());
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    return fd;
+}
+
+bool spool_write(int _fd, const void *_data, size_t _len)
+{
+    const char *p = static_cast<const char*>(_data);
+
+    while(_len != 0) {
+        ssize_t n = write(_fd, p, _len);
+
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        p += n;
+        _len -= n;
+    }
+
+    return true;
+}
+
+};
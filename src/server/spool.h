@@ -0,0 +1,28 @@
+
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace fp {
+
+/*
+ * Create anonymous temporary file in directory. The file has no name
+ * and is removed when the descriptor is closed
+ *
+ * @return file descriptor or -1 on error
+ */
+int spool_open(const std::string &_dir);
+
+/*
+ * Write all data to file, retrying on short writes
+ *
+ * @return false on error
+ */
+bool spool_write(int _fd, const void *_data, size_t _len);
+
+};
+
+#endif //_SPOOL_H_
@@ -0,0 +1,123 @@
+
+#ifndef _STRING_REF_H_
+#define _STRING_REF_H_
+
+#include <string>
+#include <ostream>
+
+#include <string.h>
+
+namespace fp {
+
+/*
+ * Non-owning reference to a character sequence. Referenced memory must
+ * outlive the reference
+ */
+class string_ref {
+public:
+    typedef const char *const_iterator;
+
+    static const size_t npos = (size_t)-1;
+
+    string_ref()
+        : m_data("")
+        , m_size(0)
+    {
+    }
+
+    string_ref(const char *_s)
+        : m_data(_s)
+        , m_size(strlen(_s))
+    {
+    }
+
+    string_ref(const char *_s, size_t _size)
+        : m_data(_s)
+        , m_size(_size)
+    {
+    }
+
+    template<class A>
+    string_ref(const std::basic_string<char, std::char_traits<char>, A> &_s)
+        : m_data(_s.data())
+        , m_size(_s.size())
+    {
+    }
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+    size_t length() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    const_iterator begin() const { return m_data; }
+    const_iterator end() const { return m_data + m_size; }
+
+    char operator[](size_t i) const { return m_data[i]; }
+
+    std::string str() const { return std::string(m_data, m_size); }
+    operator std::string() const { return str(); }
+
+    int compare(const string_ref &_other) const {
+        int rc = memcmp(m_data, _other.m_data, m_size < _other.m_size ? m_size : _other.m_size);
+
+        if(rc != 0) {
+            return rc;
+        }
+
+        return m_size < _other.m_size ? -1 : m_size > _other.m_size ? 1 : 0;
+    }
+
+    bool starts_with(const string_ref &_prefix) const {
+        return m_size >= _prefix.m_size && memcmp(m_data, _prefix.m_data, _prefix.m_size) == 0;
+    }
+
+    size_t find(char c, size_t pos = 0) const {
+        if(pos >= m_size) {
+            return npos;
+        }
+
+        const char *p = static_cast<const char*>(memchr(m_data + pos, c, m_size - pos));
+
+        return p != 0 ? p - m_data : npos;
+    }
+
+    string_ref substr(size_t pos, size_t n = npos) const {
+        if(pos > m_size) {
+            pos = m_size;
+        }
+
+        if(n > m_size - pos) {
+            n = m_size - pos;
+        }
+
+        return string_ref(m_data + pos, n);
+    }
+
+private:
+    const char  *m_data;
+    size_t      m_size;
+};
+
+inline bool operator==(const string_ref &a, const string_ref &b)
+{
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+inline bool operator!=(const string_ref &a, const string_ref &b)
+{
+    return !(a == b);
+}
+
+inline bool operator<(const string_ref &a, const string_ref &b)
+{
+    return a.compare(b) < 0;
+}
+
+inline std::ostream &operator<<(std::ostream &os, const string_ref &s)
+{
+    return os.write(s.data(), s.size());
+}
+
+};
+
+#endif //_STRING_REF_H_
@@ -0,0 +1,313 @@
+
+#include <errno.h>
+
+#include <logger/logger.h>
+#include <db/db_row.h>
+
+#include "simd.h"
+
+#include "teaser_index.h"
+
+#define MORE_MARKER "<!--more-->"
+
+/*
+ * Seconds to wait before loading again after a DB error
+ */
+#define TEASER_RETRY_INTERVAL 30
+
+namespace fp {
+
+teaser_index::teaser_index(DBPool &_pool, size_t _max_posts)
+    : pool(_pool)
+    , max_posts(_max_posts)
+    , recent_loaded(false)
+    , thread_running(false)
+    , exiting(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&queue_lock, NULL);
+    pthread_cond_init(&wakeup, NULL);
+}
+
+teaser_index::~teaser_index()
+{
+    shutdown();
+
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&queue_lock);
+    pthread_mutex_destroy(&lock);
+}
+
+void teaser_index::init()
+{
+    if(pthread_create(&thread, NULL, teaser_index::load_thread_starter, (void*)this) != 0) {
+        LogError("cannot create teaser load thread: " << errno);
+        return;
+    }
+
+    thread_running = true;
+}
+
+void teaser_index::shutdown()
+{
+    void *return_value;
+
+    if(!thread_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    exiting = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&queue_lock);
+
+    pthread_join(thread, &return_value);
+
+    thread_running = false;
+}
+
+bool teaser_index::split(const string_ref &_content, string_ref &_teaser)
+{
+    const u_char *start = reinterpret_cast<const u_char*>(_content.data());
+    const u_char *end = start + _content.size();
+    const u_char *marker = simd_find(start, end, reinterpret_cast<const u_char*>(MORE_MARKER),
+        sizeof(MORE_MARKER) - 1);
+
+    _teaser = _content.substr(0, marker - start);
+
+    return marker != end;
+}
+
+/*
+ * Cut content of a post
+ */
+void teaser_index::cut(teaser &t, const std::string &modified, const string_ref &content)
+{
+    string_ref text;
+
+    t.modified = modified;
+    t.more = split(content, text);
+    t.text.assign(text.data(), text.size());
+}
+
+/*
+ * Put teaser into the index, its strings are moved
+ */
+void teaser_index::store(int id, teaser &t)
+{
+    pthread_mutex_lock(&lock);
+
+    TeaserContainer::iterator i = teasers.find(id);
+
+    if(i == teasers.end()) {
+        if(teasers.size() >= max_posts) {
+            teasers.erase(lru.back());
+            lru.pop_back();
+        }
+
+        i = teasers.insert(std::make_pair(id, teaser())).first;
+
+        lru.push_front(id);
+        i->second.lru = lru.begin();
+    }
+
+    i->second.modified.swap(t.modified);
+    i->second.text.swap(t.text);
+    i->second.more = t.more;
+
+    pthread_mutex_unlock(&lock);
+}
+
+void teaser_index::remove(int id)
+{
+    pthread_mutex_lock(&lock);
+
+    TeaserContainer::iterator i = teasers.find(id);
+
+    if(i != teasers.end()) {
+        lru.erase(i->second.lru);
+        teasers.erase(i);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Fill the index with the newest posts, the ones listings show
+ */
+void teaser_index::load_recent(DBConn &conn)
+{
+    DBRowStmt<DBTuple<int, DBTimestamp, string_ref> > stmt(conn,
+        "select id, post_modified_gmt, post_content from wp_posts where post_status='publish'"
+        " and post_type='post' order by post_date_gmt desc limit ?");
+
+    int limit = max_posts;
+
+    stmt.bindInt(0, limit);
+
+    stmt.execute();
+
+    while(stmt.fetch()) {
+        teaser t;
+
+        cut(t, stmt.row().get<1>().str(), stmt.row().get<2>());
+        store(stmt.row().get<0>(), t);
+    }
+}
+
+/*
+ * Cut posts again by post_name. Posts that are no longer published
+ * are dropped from the index
+ */
+void teaser_index::load_posts(DBConn &conn, const std::set<std::string> &names)
+{
+    DBRowStmt<DBTuple<int, DBTimestamp, string_ref, string_ref> > stmt(conn,
+        "select id, post_modified_gmt, post_status, post_content from wp_posts where post_name=? and post_type='post'");
+
+    for(std::set<std::string>::const_iterator i = names.begin() ; i != names.end() ; i++) {
+        stmt.bindString(0, *i);
+
+        stmt.execute();
+
+        while(stmt.fetch()) {
+            if(stmt.row().get<2>() == "publish") {
+                teaser t;
+
+                cut(t, stmt.row().get<1>().str(), stmt.row().get<3>());
+                store(stmt.row().get<0>(), t);
+            }
+            else {
+                remove(stmt.row().get<0>());
+            }
+        }
+    }
+}
+
+bool teaser_index::get(DBConn &conn, int id, std::string &text, bool &more, std::string &modified)
+{
+    pthread_mutex_lock(&lock);
+
+    TeaserContainer::iterator i = teasers.find(id);
+
+    if(i != teasers.end()) {
+        text = i->second.text;
+        more = i->second.more;
+        modified = i->second.modified;
+
+        lru.splice(lru.begin(), lru, i->second.lru);
+
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    /*
+     * Not in the index yet, the post is cut here once rather than
+     * listed without content
+     */
+    DBRowStmt<DBTuple<DBTimestamp, string_ref> > stmt(conn,
+        "select post_modified_gmt, post_content from wp_posts where id=? and post_status='publish'");
+
+    stmt.bindInt(0, id);
+
+    stmt.execute();
+
+    if(!stmt.fetch()) {
+        return false;
+    }
+
+    teaser t;
+
+    cut(t, stmt.row().get<0>().str(), stmt.row().get<1>());
+
+    text = t.text;
+    more = t.more;
+    modified = t.modified;
+
+    store(id, t);
+
+    return true;
+}
+
+/*
+ * The index follows the site of its pool, every post the feed
+ * reports is looked up there
+ */
+void teaser_index::changed(const std::string&, const change_set &_changes)
+{
+    if(_changes.posts.empty()) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    changed_posts.insert(_changes.posts.begin(), _changes.posts.end());
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void teaser_index::load_thread()
+{
+    pthread_mutex_lock(&queue_lock);
+
+    while(!exiting) {
+        std::set<std::string> names;
+        bool recent = !recent_loaded;
+        bool failed = false;
+
+        names.swap(changed_posts);
+
+        pthread_mutex_unlock(&queue_lock);
+
+        try {
+            DBConnHolder conn(pool);
+
+            if(recent) {
+                load_recent(conn.get());
+            }
+
+            load_posts(conn.get(), names);
+        }
+        catch(const db_exception &e) {
+            LogError("teaser_index::load_thread DB error: " << e.what());
+            failed = true;
+        }
+
+        pthread_mutex_lock(&queue_lock);
+
+        if(failed) {
+            /*
+             * Keep the work for the next attempt
+             */
+            changed_posts.insert(names.begin(), names.end());
+
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += TEASER_RETRY_INTERVAL;
+
+            while(!exiting) {
+                if(pthread_cond_timedwait(&wakeup, &queue_lock, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+
+            continue;
+        }
+
+        recent_loaded = true;
+
+        while(!exiting && changed_posts.empty()) {
+            pthread_cond_wait(&wakeup, &queue_lock);
+        }
+    }
+
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void *teaser_index::load_thread_starter(void *arg)
+{
+    static_cast<teaser_index*>(arg)->load_thread();
+    return NULL;
+}
+
+};
@@ -0,0 +1,102 @@
+
+#ifndef _TEASER_INDEX_H_
+#define _TEASER_INDEX_H_
+
+#include <string>
+#include <list>
+#include <set>
+#include <map>
+
+#include <pthread.h>
+
+#include <db/db_pool.h>
+
+#include "change_feed.h"
+#include "string_ref.h"
+
+namespace fp {
+
+/*
+ * Part of post content shown in listings
+ */
+struct teaser {
+    std::string     modified;   // version of the post it was cut from
+    std::string     text;       // content before the more marker
+    bool            more;       // the marker was found
+
+    std::list<int>::iterator lru;
+};
+
+/*
+ * Teasers of posts, so that listings never read whole post bodies.
+ * Post bodies are read and cut by a background thread: the newest posts
+ * on start and posts the change feed reports as modified. A post that
+ * is asked for but is not in the index is cut once by the caller. Teasers
+ * used least recently are dropped when there are too many of them
+ */
+class teaser_index : public change_listener {
+public:
+    teaser_index(DBPool &_pool, size_t _max_posts = 1000);
+    ~teaser_index();
+
+    void init();
+    void shutdown();
+
+    /*
+     * Get teaser of a post and version of the post it was cut from,
+     * which may lag behind the post until the change feed reports it.
+     * A post that is not in the index is read with the connection given
+     * and added to the index
+     *
+     * @return false if the post is not published
+     */
+    bool get(DBConn &_conn, int _id, std::string &_text, bool &_more, std::string &_modified);
+
+    virtual void changed(const std::string &_hostname, const change_set &_changes);
+
+    /*
+     * Cut content at the more marker
+     *
+     * @return true if the marker was found
+     */
+    static bool split(const string_ref &_content, string_ref &_teaser);
+
+private:
+    typedef std::map<int, teaser> TeaserContainer;
+
+    void load_recent(DBConn&);
+    void load_posts(DBConn&, const std::set<std::string>&);
+    static void cut(teaser&, const std::string&, const string_ref&);
+    void store(int, teaser&);
+    void remove(int);
+
+    void load_thread();
+    static void *load_thread_starter(void*);
+
+    teaser_index(const teaser_index&);
+    teaser_index &operator=(const teaser_index&);
+
+private:
+    DBPool              &pool;
+
+    pthread_mutex_t     lock;
+    TeaserContainer     teasers;
+    std::list<int>      lru;        // most recently used first
+    size_t              max_posts;
+
+    /*
+     * Work for the load thread, guarded by queue_lock
+     */
+    pthread_mutex_t         queue_lock;
+    pthread_cond_t          wakeup;
+    std::set<std::string>   changed_posts;  // post_name of modified posts
+    bool                    recent_loaded;
+
+    pthread_t thread;
+    bool thread_running;
+    bool exiting;
+};
+
+};
+
+#endif //_TEASER_INDEX_H_
@@ -0,0 +1,14 @@
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+/*
+ * Runs all test suites registered in the test objects
+ */
+int main(int argc, char **argv)
+{
+    CppUnit::TextUi::TestRunner runner;
+
+    runner.addTest(CppUnit::TestFactoryRegistry::getRegistry().makeTest());
+
+    return runner.run() ? 0 : 1;
+}
@@ -10,8 +10,10 @@
 
 #include "wp_handler.h"
 #include "sitemap_handler.h"
+#include "change_feed.h"
 
 #include "fcgi_server.h"
+#include "main.h"
 
 using namespace fp;
 
@@ -74,15 +76,48 @@ int worker_process()
     try{
         fcgi_server s(":9002");
 
+        /*
+         * Do not grow beyond the number of DB connections
+         */
+        s.set_threads(5, 40);
+        s.set_idle_timeout(60);
+
+        /*
+         * Each event thread gets its own listening socket
+         */
+        s.set_event_threads(2);
+        s.set_reuseport(true);
+        s.set_listen_backlog(1024);
+
+        /*
+         * Cache rendered pages
+         */
+        s.set_cache(64 * 1024 * 1024);
+        s.set_shared_cache(shared_page_cache);
+
         drop_permissions();
 
-        std::auto_ptr<fcgi_handler> wp_handler_ptr(new wp_handler(pool_wp_com));
+        std::auto_ptr<wp_handler> wp_handler_ptr(new wp_handler(pool_wp_com));
         std::auto_ptr<sitemap_handler> sitemap_handler_ptr(new sitemap_handler());
 
         sitemap_handler_ptr->add_site("wordpress.example.com", pool_wp_com);
 
+        /*
+         * Cut teasers again, invalidate cached pages and refresh sitemaps
+         * as soon as posts, terms or options change
+         */
+        change_feed feed;
+        page_cache_invalidator invalidator(s.get_cache(), shared_page_cache);
+
+        feed.add_site("wordpress.example.com", pool_wp_com);
+        feed.add_listener(wp_handler_ptr.get());
+        feed.add_listener(&invalidator);
+        feed.add_listener(sitemap_handler_ptr.get());
+
         s.add_handler_mapping("/", wp_handler_ptr.get());
-        s.add_handler_mapping("/sitemap.xml", sitemap_handler_ptr.get());
+        s.add_handler_mapping("=/sitemap.xml", sitemap_handler_ptr.get());
+        s.add_handler_mapping("/sitemap-posts-", sitemap_handler_ptr.get());
+        s.add_handler_mapping("/sitemap-taxonomy-", sitemap_handler_ptr.get());
 
         s.add_handler(sitemap_handler_ptr.release());
         s.add_handler(wp_handler_ptr.release());
@@ -90,9 +125,11 @@ int worker_process()
         LogInfo("worker process " << getpid() << " started");
 
         s.init();
+        feed.init();
 
         s.run();
 
+        feed.shutdown();
         s.shutdown();
     }catch(const fcgi_server_exception &e) {
         LogInfo("worker caught server_exception: " << e.get_error_message());
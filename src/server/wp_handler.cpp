@@ -2,12 +2,15 @@
 #include <cstdio>
 #include <stdexcept>
 #include <fstream>
+#include <sstream>
+#include <vector>
 #include <cmath>
 
 #include <openssl/sha.h>
 
 #include <logger/logger.h>
 #include <db/db_pool.h>
+#include <db/db_row.h>
 
 #include "url.h"
 #include "xml.h"
@@ -16,10 +19,23 @@
 
 #define REDIRECT_URL "/document.php?id="
 
+/*
+ * How long rendered pages are kept in the response cache, in seconds.
+ * Edits are picked up by the change feed, the TTL is a safety net
+ */
+#define PAGE_CACHE_TTL 3600
+
+/*
+ * Memory for rendered posts
+ */
+#define FRAGMENT_CACHE_SIZE (16 * 1024 * 1024)
+
 namespace fp {
 
 wp_handler::wp_handler(DBPool &_pool)
     : pool(_pool)
+    , fragments(FRAGMENT_CACHE_SIZE)
+    , teasers(_pool)
 {
 }
 
@@ -29,9 +45,16 @@ wp_handler::~wp_handler()
 
 void wp_handler::init()
 {
+    teasers.init();
 }
 
 void wp_handler::shutdown() {
+    teasers.shutdown();
+}
+
+void wp_handler::changed(const std::string &_hostname, const change_set &_changes)
+{
+    teasers.changed(_hostname, _changes);
 }
 
 void wp_handler::return_error(fcgi_response &_response, const std::string &msg, int status) const {
@@ -50,101 +73,194 @@ void wp_handler::return_error(fcgi_response &_response, const std::string &msg,
     _response.fcgi_out << "</html>";
 }
 
-void wp_handler::return_success(fcgi_request &_request, fcgi_response &_response, int document_id) const {
-    std::string content_type(_request.get_param("showxml") != "yes" ? "text/xml" : "application/xml");
+void wp_handler::start_page(fcgi_request &_request, fcgi_response &_response, XMLWriter &xml) const {
+    bool xslt = _request.get_param("showxml") != "yes";
 
-    XMLDoc doc("page");
+    _response.fcgi_out << "Status: 200\r\n";
+    _response.fcgi_out << "Content-Type: " << (xslt ? "text/xml" : "application/xml") << "\r\n";
+    _response.fcgi_out << "\r\n";
 
-    if(_request.get_param("showxml") != "yes") {
-        doc.add_pi("modxslt-stylesheet", "type=\"text/xsl\" href=\"xsl/feedback.xsl\"");
+    if(xslt) {
+        xml.pi("modxslt-stylesheet", "type=\"text/xsl\" href=\"xsl/feedback.xsl\"");
     }
 
-    XMLNode document("document");
+    xml.start("page");
+}
 
-    document.set_attr("id", document_id);
+void wp_handler::return_success(fcgi_request &_request, fcgi_response &_response, int document_id) const {
+    XMLWriter xml(_response.fcgi_out);
 
-    doc.add(document.get());
+    start_page(_request, _response, xml);
 
-    document.release();
+    xml.start("document").attr("id", document_id).end();
 
-    _response.fcgi_out << "Status: 200\r\n";
-    _response.fcgi_out << "Content-Type: " << content_type << "\r\n";
-    _response.fcgi_out << "\r\n";
-    _response.fcgi_out << doc;
+    xml.finish();
 }
 
 void wp_handler::handle_get(fcgi_request &_request, fcgi_response &_response)
 {
-    std::string content_type(_request.get_param("showxml") != "yes" ? "text/xml" : "application/xml");
+    XMLWriter xml(_response.fcgi_out);
+
+    start_page(_request, _response, xml);
+
+    xml.finish();
+}
+
+static std::string fragment_key(const char *kind, int id)
+{
+    char key[64];
+    int len = snprintf(key, sizeof(key), "%s:%d", kind, id);
+
+    return std::string(key, len);
+}
+
+fragment *wp_handler::get_teaser(DBConn &conn, int id, const std::string &modified, bool &complete)
+{
+    std::string key(fragment_key("teaser", id));
+    fragment *frag = fragments.lookup(key, modified);
 
-    XMLDoc doc("page");
+    complete = true;
 
-    if(_request.get_param("showxml") != "yes") {
-        doc.add_pi("modxslt-stylesheet", "type=\"text/xsl\" href=\"xsl/feedback.xsl\"");
+    if(frag != 0) {
+        return frag;
     }
 
-    _response.fcgi_out << "Status: 200\r\n";
-    _response.fcgi_out << "Content-Type: " << content_type << "\r\n";
-    _response.fcgi_out << "\r\n";
-    _response.fcgi_out << doc;
+    std::string text, version;
+    bool more = false;
+
+    /*
+     * The fragment is versioned by the teaser it was rendered from, so
+     * that it is rendered again once the index catches up with the post
+     */
+    if(!teasers.get(conn, id, text, more, version)) {
+        return 0;
+    }
+
+    complete = version == modified;
+
+    DBRowStmt<DBTuple<string_ref, string_ref> > stmt(conn, "select post_title, post_excerpt from wp_posts where id=?");
+
+    stmt.bindInt(0, id);
+
+    stmt.execute();
+
+    if(!stmt.fetch()) {
+        return 0;
+    }
+
+    std::ostringstream os;
+    XMLWriter xml(os, 0);
+
+    xml.start("post").attr("id", id);
+
+    xml.element("title", stmt.row().get<0>());
+    xml.element("excerpt", stmt.row().get<1>());
+
+    xml.start("content");
+    if(more) {
+        xml.attr("more", "yes");
+    }
+    xml.text(text);
+    xml.end();
+
+    xml.end();
+
+    std::string data(os.str());
+
+    return fragments.insert(key, version, data);
+}
+
+fragment *wp_handler::get_post(DBConn &conn, int id, const std::string &modified)
+{
+    std::string key(fragment_key("post", id));
+    fragment *frag = fragments.lookup(key, modified);
+
+    if(frag != 0) {
+        return frag;
+    }
+
+    DBRowStmt<DBTuple<string_ref> > stmt(conn, "select post_content from wp_posts where id=?");
+
+    stmt.bindInt(0, id);
+
+    stmt.execute();
+
+    if(!stmt.fetch()) {
+        return 0;
+    }
+
+    std::ostringstream os;
+    XMLWriter xml(os, 0);
+
+    xml.start("post").attr("id", id).text(stmt.row().get<0>()).end();
+
+    std::string data(os.str());
+
+    return fragments.insert(key, modified, data);
 }
 
+/*
+ * Front page is assembled from rendered posts. Listed posts are cut
+ * at the more marker, their bodies are never read here
+ */
 void wp_handler::handle_blogroll(fcgi_request &_request, fcgi_response &_response)
 {
-    std::string content_type(_request.get_param("showxml") != "yes" ? "text/xml" : "application/xml");
+    bool complete = true;
 
     try {
         DBConnHolder conn(pool);
 
-        DBStmt stmt(conn.get(), "select id, post_title, post_excerpt, post_content from wp_posts where post_status='publish' "
-            " and post_type='post' order by post_date_gmt desc limit 10");
-        
-        stmt.execute();
+        std::vector<std::pair<int, std::string> > posts;
+
+        {
+            DBRowStmt<DBTuple<int, DBTimestamp> > stmt(conn.get(), "select id, post_modified_gmt from wp_posts where post_status='publish' "
+                " and post_type='post' order by post_date_gmt desc limit 10");
 
-        XMLDoc doc("page");
+            stmt.execute();
 
-        if(_request.get_param("showxml") != "yes") {
-            doc.add_pi("modxslt-stylesheet", "type=\"text/xsl\" href=\"xsl/feedback.xsl\"");
+            while(stmt.fetch()) {
+                posts.push_back(std::make_pair(stmt.row().get<0>(), stmt.row().get<1>().str()));
+            }
         }
 
-        XMLNode posts("posts");
+        /*
+         * Resolve all teasers before headers are written, so that
+         * a DB error still produces a well-formed error response
+         */
+        fragment_list frags;
 
-        while(stmt.fetch()) {
-            XMLNode post("post");
+        frags.reserve(posts.size());
 
-            post.set_attr("id", stmt.asInt(0));
+        for(std::vector<std::pair<int, std::string> >::const_iterator i = posts.begin() ; i != posts.end() ; i++) {
+            bool teaser_complete;
+            fragment *frag = get_teaser(conn.get(), i->first, i->second, teaser_complete);
 
-            XMLNode title("title");
-            title.add_text(stmt.asString(1));
-            post.add(title.release());
+            if(frag != 0) {
+                frags.push_back(frag);
+            }
 
-            XMLNode excerpt("excerpt");
-            excerpt.add_text(stmt.asString(2));
-            post.add(excerpt.release());
+            complete = complete && teaser_complete;
+        }
 
-            std::string content(stmt.asString(3));
+        XMLWriter xml(_response.fcgi_out);
 
-            size_t more_pos = content.find("<!--more-->");
+        start_page(_request, _response, xml);
 
-            XMLNode content_elm("content");
-            if(more_pos != std::string::npos) {
-                content_elm.set_attr("more", "yes");
-                content_elm.add_text(content.substr(0, more_pos));
-            }
-            else {
-                content_elm.add_text(content);
-            }
-            post.add(content_elm.release());
+        xml.start("posts");
 
-            posts.add(post.release());
+        for(fragment_list::const_iterator i = frags.begin() ; i != frags.end() ; i++) {
+            xml.raw((*i)->data);
         }
 
-        doc.add(posts.release());
+        xml.finish();
 
-        _response.fcgi_out << "Status: 200\r\n";
-        _response.fcgi_out << "Content-Type: " << content_type << "\r\n";
-        _response.fcgi_out << "\r\n";
-        _response.fcgi_out << doc;
+        /*
+         * Teasers the index has not caught up with yet would not be
+         * invalidated when it does, such page is not cached
+         */
+        if(complete) {
+            _response.set_cache_ttl(PAGE_CACHE_TTL);
+        }
     }
     catch(const db_exception &e) {
         LogError("wp_handler::handle DB error: " <<  e.what());
@@ -198,41 +314,45 @@ void wp_handler::handle_author(fcgi_request &_request, fcgi_response &_response,
 
 bool wp_handler::handle_post(fcgi_request &_request, fcgi_response &_response, const std::string &name)
 {
-    std::string content_type(_request.get_param("showxml") != "yes" ? "text/xml" : "application/xml");
-
     LogInfo("wp_handler::handle_post name=" << name);
 
     try {
         DBConnHolder conn(pool);
 
-        DBStmt stmt(conn.get(), "select id, post_content from wp_posts where post_status='publish' and post_name=?");
+        int id;
+        std::string modified;
 
-        stmt.bindString(0, name);
-        
-        stmt.execute();
+        {
+            DBRowStmt<DBTuple<int, DBTimestamp> > stmt(conn.get(),
+                "select id, post_modified_gmt from wp_posts where post_status='publish' and post_name=?");
 
-        if(!stmt.fetch()) {
-            return false;
+            stmt.bindString(0, name);
+
+            stmt.execute();
+
+            if(!stmt.fetch()) {
+                return false;
+            }
+
+            id = stmt.row().get<0>();
+            modified = stmt.row().get<1>().str();
         }
 
-        XMLDoc doc("page");
+        fragment_holder frag(get_post(conn.get(), id, modified));
 
-        if(_request.get_param("showxml") != "yes") {
-            doc.add_pi("modxslt-stylesheet", "type=\"text/xsl\" href=\"xsl/feedback.xsl\"");
+        if(frag.get() == 0) {
+            return false;
         }
 
-        XMLNode post("post");
+        XMLWriter xml(_response.fcgi_out);
 
-        post.set_attr("id", stmt.asInt(0));
+        start_page(_request, _response, xml);
 
-        post.add_text(stmt.asString(1));
+        xml.raw(frag.get()->data);
 
-        doc.add(post.release());
+        xml.finish();
 
-        _response.fcgi_out << "Status: 200\r\n";
-        _response.fcgi_out << "Content-Type: " << content_type << "\r\n";
-        _response.fcgi_out << "\r\n";
-        _response.fcgi_out << doc;
+        _response.set_cache_ttl(PAGE_CACHE_TTL);
     }
     catch(const db_exception &e) {
         LogError("wp_handler::handle DB error: " <<  e.what());
@@ -251,15 +371,15 @@ void wp_handler::handle_404(fcgi_request &_request, fcgi_response &_response)
 
 void wp_handler::handle(fcgi_request &_request, fcgi_response &_response)
 {
-    std::string script_name = _request.get_fcgi_param("SCRIPT_NAME");
+    string_ref script_name = _request.get_script_name();
 
-    if(script_name == "/" || script_name == "") {
+    if(script_name == "/" || script_name.empty()) {
         handle_blogroll(_request, _response);
     }
-    else if(script_name.find("/category/") == 0) {
+    else if(script_name.starts_with("/category/")) {
         handle_category(_request, _response, script_name.substr(sizeof("/category/") - 1));
     }
-    else if(script_name.find("/author/") == 0) {
+    else if(script_name.starts_with("/author/")) {
         handle_author(_request, _response, script_name.substr(sizeof("/author/") - 1));
     }
     else if(!handle_post(_request, _response, script_name.substr(1))) {
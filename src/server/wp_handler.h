@@ -10,10 +10,14 @@
 #include <db/db_pool.h>
 
 #include "fcgi_handler.h"
+#include "change_feed.h"
+#include "fragment_cache.h"
+#include "teaser_index.h"
+#include "xml.h"
 
 namespace fp {
 
-class wp_handler : public fp::fcgi_handler {
+class wp_handler : public fp::fcgi_handler, public change_listener {
     typedef std::set<std::string> CategoryContainer;
 public:
     wp_handler(DBPool&);
@@ -24,6 +28,11 @@ public:
 
     virtual void handle(fcgi_request &_request, fcgi_response &_response);
 
+    /*
+     * Teasers of modified posts are cut again
+     */
+    virtual void changed(const std::string &_hostname, const change_set &_changes);
+
 private:
     void handle_get(fcgi_request&, fcgi_response&);
     void handle_blogroll(fcgi_request&, fcgi_response&);
@@ -35,7 +44,22 @@ private:
     void return_error(fcgi_response&, const std::string&, int status = 200) const;
     void return_success(fcgi_request&, fcgi_response&, int) const;
 
+    /*
+     * Write response headers and start the page document
+     */
+    void start_page(fcgi_request&, fcgi_response&, XMLWriter&) const;
+
+    /*
+     * Get markup of a post as listed on the front page and as shown
+     * on its own page, rendering it if it is not cached. A teaser is
+     * incomplete while the teaser index lags behind the post
+     */
+    fragment *get_teaser(DBConn&, int, const std::string&, bool&);
+    fragment *get_post(DBConn&, int, const std::string&);
+
     DBPool &pool;
+    fragment_cache fragments;
+    teaser_index teasers;
 };
 
 };
@@ -3,8 +3,14 @@
 #define _XML_H_
 
 #include <stdexcept>
+#include <vector>
+#include <ostream>
+#include <stdio.h>
+#include <string.h>
 #include <libxml/tree.h>
 
+#include "string_ref.h"
+
 class XMLText {
 public:
     XMLText()
@@ -190,4 +196,205 @@ inline std::ostream &operator<<(std::ostream &o, const XMLDoc &doc)
     return o;
 }
 
+/*
+ * Forward-only XML writer. Markup goes straight to the stream buffer of
+ * the output stream, text and attribute values are escaped while they are
+ * copied, nothing is built in memory. The XML declaration is written
+ * before the first processing instruction or element, so HTTP headers
+ * can be written to the stream after the writer is constructed.
+ *
+ * Element names are kept by pointer until the element is ended, they
+ * must stay valid until then (string literals usually). A writer
+ * constructed with no version writes a fragment without the declaration
+ *
+ * Text is copied as UTF-8, non-ASCII characters are not turned into
+ * character references as xmlDocDumpMemory does. Control characters
+ * that XML 1.0 does not allow are replaced with U+FFFD
+ */
+class XMLWriter {
+public:
+    XMLWriter(std::ostream &_os, const char *_version = "1.0")
+        : m_buf(_os.rdbuf())
+        , m_version(_version)
+        , m_stack()
+        , m_started(false)
+        , m_tag_open(false)
+    {
+        m_stack.reserve(16);
+    }
+
+    void pi(const char *name, const fp::string_ref &content)
+    {
+        start_document();
+
+        write("<?");
+        write(name);
+        write(" ");
+        write(content);
+        write("?>\n");
+    }
+
+    XMLWriter &start(const char *name)
+    {
+        start_document();
+        close_tag();
+
+        write("<");
+        write(name);
+
+        m_stack.push_back(name);
+        m_tag_open = true;
+
+        return *this;
+    }
+
+    /*
+     * Add attribute to element just started
+     */
+    XMLWriter &attr(const char *name, const fp::string_ref &value)
+    {
+        write(" ");
+        write(name);
+        write("=\"");
+        write_escaped(value, true);
+        write("\"");
+
+        return *this;
+    }
+
+    XMLWriter &attr(const char *name, long value)
+    {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%ld", value);
+
+        return attr(name, fp::string_ref(buf, len));
+    }
+
+    XMLWriter &text(const fp::string_ref &content)
+    {
+        close_tag();
+        write_escaped(content, false);
+
+        return *this;
+    }
+
+    XMLWriter &end()
+    {
+        if(m_tag_open) {
+            write("/>");
+            m_tag_open = false;
+        }
+        else {
+            write("</");
+            write(m_stack.back());
+            write(">");
+        }
+
+        m_stack.pop_back();
+
+        return *this;
+    }
+
+    /*
+     * Insert pre-serialized markup, a fragment written by another writer
+     */
+    XMLWriter &raw(const fp::string_ref &markup)
+    {
+        start_document();
+        close_tag();
+        write(markup);
+
+        return *this;
+    }
+
+    /*
+     * Write element with text content
+     */
+    XMLWriter &element(const char *name, const fp::string_ref &content)
+    {
+        return start(name).text(content).end();
+    }
+
+    /*
+     * End all open elements and the document
+     */
+    void finish()
+    {
+        while(!m_stack.empty()) {
+            end();
+        }
+
+        if(m_version != 0) {
+            write("\n");
+        }
+    }
+
+private:
+    void start_document()
+    {
+        if(!m_started && m_version != 0) {
+            write("<?xml version=\"");
+            write(m_version);
+            write("\"?>\n");
+            m_started = true;
+        }
+    }
+
+    void close_tag()
+    {
+        if(m_tag_open) {
+            write(">");
+            m_tag_open = false;
+        }
+    }
+
+    void write(const char *s)
+    {
+        m_buf->sputn(s, strlen(s));
+    }
+
+    void write(const fp::string_ref &s)
+    {
+        m_buf->sputn(s.data(), s.size());
+    }
+
+    void write_escaped(const fp::string_ref &s, bool in_attr)
+    {
+        const char *span = s.begin();
+        const char *entity;
+
+        for(const char *p = span ; p != s.end() ; p++) {
+            switch(*p) {
+                case '&': entity = "&amp;"; break;
+                case '<': entity = "&lt;"; break;
+                case '>': entity = "&gt;"; break;
+                case '\r': entity = in_attr ? "&#13;" : "&#xD;"; break;
+                case '"': if(!in_attr) continue; entity = "&quot;"; break;
+                case '\n': if(!in_attr) continue; entity = "&#10;"; break;
+                case '\t': if(!in_attr) continue; entity = "&#9;"; break;
+                default:
+                    if((unsigned char)*p >= 0x20) continue;
+                    entity = "&#xFFFD;";
+                    break;
+            }
+
+            m_buf->sputn(span, p - span);
+            write(entity);
+            span = p + 1;
+        }
+
+        m_buf->sputn(span, s.end() - span);
+    }
+
+    XMLWriter(const XMLWriter&);
+    XMLWriter &operator=(const XMLWriter&);
+
+private:
+    std::streambuf *m_buf;
+    const char *m_version;
+    std::vector<const char*> m_stack;
+    bool m_started;
+    bool m_tag_open;
+};
+
 #endif
@@ -0,0 +1,109 @@
+#include <sstream>
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "xml.h"
+
+class xml_test : public CppUnit::TestFixture {
+    CPPUNIT_TEST_SUITE(xml_test);
+    CPPUNIT_TEST(test_document);
+    CPPUNIT_TEST(test_fragment);
+    CPPUNIT_TEST(test_text_escaping);
+    CPPUNIT_TEST(test_attr_escaping);
+    CPPUNIT_TEST(test_control_characters);
+    CPPUNIT_TEST(test_utf8);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void test_document()
+    {
+        std::ostringstream o;
+
+        {
+            XMLWriter xml(o);
+
+            xml.pi("xml-stylesheet", "type=\"text/xsl\" href=\"s.xsl\"");
+            xml.start("urlset").attr("xmlns", "http://www.sitemaps.org/schemas/sitemap/0.9");
+            xml.start("url").attr("id", 42L).element("loc", "http://example.com/").start("empty").end();
+            xml.finish();
+        }
+
+        CPPUNIT_ASSERT_EQUAL(std::string(
+            "<?xml version=\"1.0\"?>\n"
+            "<?xml-stylesheet type=\"text/xsl\" href=\"s.xsl\"?>\n"
+            "<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">"
+            "<url id=\"42\"><loc>http://example.com/</loc><empty/></url></urlset>\n"), o.str());
+    }
+
+    void test_fragment()
+    {
+        std::ostringstream o;
+
+        {
+            XMLWriter xml(o, 0);
+
+            xml.element("p", "a").raw("<br/>");
+            xml.finish();
+        }
+
+        CPPUNIT_ASSERT_EQUAL(std::string("<p>a</p><br/>"), o.str());
+    }
+
+    void test_text_escaping()
+    {
+        CPPUNIT_ASSERT_EQUAL(std::string("<t>a&lt;b&gt;&amp;c\"d'\t\n&#xD;</t>"),
+            text("a<b>&c\"d'\t\n\r"));
+        CPPUNIT_ASSERT_EQUAL(std::string("<t></t>"), text(""));
+        CPPUNIT_ASSERT_EQUAL(std::string("<t>&amp;&amp;</t>"), text("&&"));
+    }
+
+    void test_attr_escaping()
+    {
+        CPPUNIT_ASSERT_EQUAL(std::string("<t a=\"a&lt;b&gt;&amp;c&quot;d'&#9;&#10;&#13;\"/>"),
+            attr("a<b>&c\"d'\t\n\r"));
+    }
+
+    void test_control_characters()
+    {
+        /*
+         * Characters XML 1.0 does not allow are replaced, NUL included
+         */
+        CPPUNIT_ASSERT_EQUAL(std::string("<t>a&#xFFFD;b&#xFFFD;&#xFFFD;</t>"),
+            text(std::string("a\x01" "b\x1f", 4) + std::string(1, '\0')));
+        CPPUNIT_ASSERT_EQUAL(std::string("<t a=\"&#xFFFD;\"/>"), attr("\x0b"));
+    }
+
+    void test_utf8()
+    {
+        /*
+         * Non-ASCII text is copied as UTF-8, not as character references
+         */
+        CPPUNIT_ASSERT_EQUAL(std::string("<t>\xd0\xbf\xd1\x80\xd0\xb8 \xe2\x82\xac</t>"),
+            text("\xd0\xbf\xd1\x80\xd0\xb8 \xe2\x82\xac"));
+    }
+
+private:
+    static std::string text(const std::string &s)
+    {
+        std::ostringstream o;
+        XMLWriter xml(o, 0);
+
+        xml.element("t", s);
+        xml.finish();
+
+        return o.str();
+    }
+
+    static std::string attr(const std::string &s)
+    {
+        std::ostringstream o;
+        XMLWriter xml(o, 0);
+
+        xml.start("t").attr("a", s).end();
+        xml.finish();
+
+        return o.str();
+    }
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(xml_test);